@@ -0,0 +1,167 @@
+#include "async_io.h"
+
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+
+void execute_io_request(int fd, const IoRequest &request) {
+    size_t done = 0;
+    while (done < request.size) {
+        auto offset = static_cast<off_t>(request.offset + done);
+        auto result = request.write ? pwrite(fd, request.buffer + done, request.size - done, offset)
+                                    : pread(fd, request.buffer + done, request.size - done, offset);
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result <= 0)
+            break;
+        done += static_cast<size_t>(result);
+    }
+    // Reading past the end of the file (or a failed read) gives zeroes
+    if (!request.write && done < request.size)
+        std::memset(request.buffer + done, 0, request.size - done);
+}
+
+ThreadPoolIoEngine::ThreadPoolIoEngine(int fd)
+        : fd{fd}, batch{nullptr}, next_request{0}, remaining{0}, stopping{false} {
+    for (uint32_t i = 0; i < ASYNC_IO_THREADS; i++) {
+        workers.emplace_back([this]() {
+            std::unique_lock<std::mutex> guard(lock);
+            for (;;) {
+                work_available.wait(guard, [this]() {
+                    return stopping || (batch && next_request < batch->size());
+                });
+                if (stopping)
+                    return;
+                work(guard);
+            }
+        });
+    }
+}
+
+ThreadPoolIoEngine::~ThreadPoolIoEngine() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    work_available.notify_all();
+    for (auto &worker: workers)
+        worker.join();
+}
+
+void ThreadPoolIoEngine::work(std::unique_lock<std::mutex> &guard) {
+    while (batch && next_request < batch->size()) {
+        const auto &request = (*batch)[next_request++];
+        guard.unlock();
+        execute_io_request(fd, request);
+        guard.lock();
+        if (!--remaining)
+            work_done.notify_all();
+    }
+}
+
+void ThreadPoolIoEngine::submit(const std::vector<IoRequest> &requests) {
+    if (requests.empty())
+        return;
+
+    std::unique_lock<std::mutex> guard(lock);
+    batch = &requests;
+    next_request = 0;
+    remaining = requests.size();
+    work_available.notify_all();
+
+    // The submitting thread helps with the batch as well
+    work(guard);
+    work_done.wait(guard, [this]() { return !remaining; });
+    batch = nullptr;
+}
+
+const char *ThreadPoolIoEngine::get_name() const {
+    return "thread pool";
+}
+
+#ifdef MYFS_HAVE_LIBURING
+UringIoEngine::UringIoEngine(int fd) : fd{fd}, ring{} {
+    initialized = io_uring_queue_init(ASYNC_IO_QUEUE_DEPTH, &ring, 0) == 0;
+}
+
+UringIoEngine::~UringIoEngine() {
+    if (initialized)
+        io_uring_queue_exit(&ring);
+}
+
+bool UringIoEngine::is_initialized() const {
+    return initialized;
+}
+
+void UringIoEngine::submit(const std::vector<IoRequest> &requests) {
+    // Bytes done of each request, requests cut short by the kernel are submitted again for the rest of the data
+    std::vector<size_t> done(requests.size(), 0);
+    std::vector<size_t> resubmit;
+    size_t next_request = 0;
+    size_t in_flight = 0;
+    size_t completed = 0;
+
+    while (completed < requests.size()) {
+        // Fill the submission queue
+        while (in_flight < ASYNC_IO_QUEUE_DEPTH && (!resubmit.empty() || next_request < requests.size())) {
+            auto sqe = io_uring_get_sqe(&ring);
+            if (!sqe)
+                break;
+            size_t i;
+            if (!resubmit.empty()) {
+                i = resubmit.back();
+                resubmit.pop_back();
+            } else
+                i = next_request++;
+            const auto &request = requests[i];
+            auto size = static_cast<unsigned>(request.size - done[i]);
+            if (request.write)
+                io_uring_prep_write(sqe, fd, request.buffer + done[i], size, request.offset + done[i]);
+            else
+                io_uring_prep_read(sqe, fd, request.buffer + done[i], size, request.offset + done[i]);
+            sqe->user_data = i;
+            in_flight++;
+        }
+        io_uring_submit_and_wait(&ring, 1);
+
+        // Collect the completions
+        io_uring_cqe *cqe;
+        unsigned head;
+        unsigned count = 0;
+        io_uring_for_each_cqe(&ring, head, cqe) {
+            count++;
+            in_flight--;
+            auto i = static_cast<size_t>(cqe->user_data);
+            const auto &request = requests[i];
+            if (cqe->res == -EINTR || cqe->res == -EAGAIN) {
+                resubmit.push_back(i);
+                continue;
+            }
+            if (cqe->res > 0)
+                done[i] += static_cast<size_t>(cqe->res);
+            if (cqe->res > 0 && done[i] < request.size) {
+                resubmit.push_back(i);
+                continue;
+            }
+            // Reading past the end of the file (or a failed read) gives zeroes
+            if (!request.write && done[i] < request.size)
+                std::memset(request.buffer + done[i], 0, request.size - done[i]);
+            completed++;
+        }
+        io_uring_cq_advance(&ring, count);
+    }
+}
+
+const char *UringIoEngine::get_name() const {
+    return "io_uring";
+}
+#endif
+
+std::unique_ptr<AsyncIoEngine> create_async_io_engine(int fd) {
+#ifdef MYFS_HAVE_LIBURING
+    auto uring = std::make_unique<UringIoEngine>(fd);
+    if (uring->is_initialized())
+        return uring;
+#endif
+    return std::make_unique<ThreadPoolIoEngine>(fd);
+}
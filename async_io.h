@@ -0,0 +1,155 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifdef MYFS_HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+/** Maximum number of requests in flight in the io_uring engine */
+constexpr uint32_t ASYNC_IO_QUEUE_DEPTH = 64;
+/** Number of threads of the thread pool engine */
+constexpr uint32_t ASYNC_IO_THREADS = 8;
+
+/**
+ * One read or write of a batch
+ */
+struct IoRequest {
+    /** True if the data is written, false if it is read */
+    bool write;
+    /** Offset of the data in bytes */
+    uint64_t offset;
+    /** Buffer with the data to be written / to be filled with the data */
+    char *buffer;
+    /** Size of the data in bytes */
+    size_t size;
+};
+
+/**
+ * Engine executing batches of reads and writes of one file with many of them in flight at once
+ * The requests of one batch can be executed in any order, so they must not overlap
+ */
+class AsyncIoEngine {
+public:
+    /**
+     * Destructor
+     */
+    virtual ~AsyncIoEngine() = default;
+
+    /**
+     * Executes all the requests of the batch and waits until all of them are done
+     * Reading past the end of the file gives zeroes
+     * @param requests Requests to be executed
+     */
+    virtual void submit(const std::vector<IoRequest> &requests) = 0;
+
+    /**
+     * Gets the name of the engine
+     * @return Name of the engine
+     */
+    virtual const char *get_name() const = 0;
+};
+
+/**
+ * Engine doing blocking pread / pwrite calls on a pool of threads
+ */
+class ThreadPoolIoEngine : public AsyncIoEngine {
+private:
+    /** File descriptor of the file */
+    int fd;
+    /** Threads of the pool */
+    std::vector<std::thread> workers;
+    /** Lock of the batch state */
+    std::mutex lock;
+    /** Signals the workers that there is a new batch (or that they should stop) */
+    std::condition_variable work_available;
+    /** Signals the submitter that the whole batch is done */
+    std::condition_variable work_done;
+    /** Batch being executed (nullptr if there is none) */
+    const std::vector<IoRequest> *batch;
+    /** Number of the next request of the batch to be taken */
+    size_t next_request;
+    /** Number of the requests of the batch that aren't done yet */
+    size_t remaining;
+    /** True if the workers should stop */
+    bool stopping;
+
+    /**
+     * Takes the requests of the current batch one by one until there are none left
+     * @param guard Held lock of the batch state (released while the request is executed)
+     */
+    void work(std::unique_lock<std::mutex> &guard);
+
+public:
+    /**
+     * Constructor, starts the threads
+     * @param fd File descriptor of the file (stays owned by the caller)
+     */
+    explicit ThreadPoolIoEngine(int fd);
+
+    /**
+     * Destructor, stops the threads
+     */
+    ~ThreadPoolIoEngine() override;
+
+    void submit(const std::vector<IoRequest> &requests) override;
+
+    const char *get_name() const override;
+};
+
+#ifdef MYFS_HAVE_LIBURING
+/**
+ * Engine submitting the requests to the kernel through io_uring
+ */
+class UringIoEngine : public AsyncIoEngine {
+private:
+    /** File descriptor of the file */
+    int fd;
+    /** Submission and completion queues */
+    io_uring ring;
+    /** True if the ring was set up */
+    bool initialized;
+
+public:
+    /**
+     * Constructor, sets up the ring (the kernel can refuse it, check is_initialized)
+     * @param fd File descriptor of the file (stays owned by the caller)
+     */
+    explicit UringIoEngine(int fd);
+
+    /**
+     * Destructor, tears the ring down
+     */
+    ~UringIoEngine() override;
+
+    /**
+     * Checks if the ring was set up
+     * @return True if the engine can be used, false otherwise
+     */
+    bool is_initialized() const;
+
+    void submit(const std::vector<IoRequest> &requests) override;
+
+    const char *get_name() const override;
+};
+#endif
+
+/**
+ * Executes one request with blocking calls (short reads and writes are continued)
+ * @param fd File descriptor of the file
+ * @param request Request to be executed
+ */
+void execute_io_request(int fd, const IoRequest &request);
+
+/**
+ * Creates the best engine available - io_uring if it is supported, the thread pool otherwise
+ * @param fd File descriptor of the file (stays owned by the caller)
+ * @return Created engine
+ */
+std::unique_ptr<AsyncIoEngine> create_async_io_engine(int fd);
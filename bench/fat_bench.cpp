@@ -0,0 +1,99 @@
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <vector>
+#include "pseudofat.h"
+
+/**
+ * Runs the scan the given number of times and prints the time of one scan
+ * @param label Label of the scan
+ * @param entries Number of the entries gone through by one scan
+ * @param repetitions Number of the runs
+ * @param scan Function doing the scan
+ */
+template<typename Scan>
+static void measure(const std::string &label, uint64_t entries, uint32_t repetitions, Scan scan) {
+    auto start_time = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < repetitions; i++)
+        scan();
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start_time;
+    auto per_scan = elapsed.count() / repetitions;
+    std::cout << std::left << std::setw(32) << label << std::right << std::fixed << std::setprecision(3)
+              << per_scan << "ms " << std::setw(10) << std::setprecision(1)
+              << (per_scan > 0 ? static_cast<double>(entries) / 1000 / per_scan : 0.0) << " M entries/s" << std::endl;
+}
+
+/**
+ * Benchmark of the FAT scans - the scalar scanner against the ones using SSE2 and AVX2, on a FAT of files with
+ * free runs and a few bad clusters in between
+ */
+int main(int argc, char **argv) {
+    uint64_t cluster_count = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1024 * 1024;
+    uint32_t repetitions = argc > 2 ? static_cast<uint32_t>(std::strtoul(argv[2], nullptr, 10)) : 100;
+    if (!cluster_count || cluster_count > MAX_CLUSTER_COUNT || !repetitions) {
+        std::cout << "Usage: " << argv[0] << " [clusters (1048576)] [repetitions (100)]" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    // Files of up to 64 clusters chained one after another, separated by free runs and sometimes a bad cluster
+    std::vector<uint32_t> fat(cluster_count);
+    std::mt19937_64 random(42);
+    uint64_t cluster = 0;
+    while (cluster < cluster_count) {
+        auto length = std::min<uint64_t>(random() % 64 + 1, cluster_count - cluster);
+        for (uint64_t i = 0; i < length; i++, cluster++)
+            fat[cluster] = i + 1 < length ? static_cast<uint32_t>(cluster + 1) : FAT_EOF;
+        auto gap = std::min<uint64_t>(random() % 32, cluster_count - cluster);
+        for (uint64_t i = 0; i < gap; i++)
+            fat[cluster++] = random() % 64 ? FAT_FREE : FAT_BAD;
+    }
+    std::cout << "FAT: " << cluster_count << " entries, " << repetitions << " repetitions" << std::endl;
+
+    auto reference = create_fat_scanner("scalar");
+    auto free_count = reference->count(fat.data(), fat.size(), FAT_FREE);
+    std::vector<uint64_t> free_bitmap((cluster_count + 63) / 64);
+    reference->build_bitmap(fat.data(), fat.size(), FAT_FREE, free_bitmap.data());
+    auto short_run = reference->find_run(fat.data(), fat.size(), FAT_FREE, 16, 0);
+    std::vector<uint32_t> filled(cluster_count);
+
+    for (const auto *type: {"scalar", "sse2", "avx2"}) {
+        auto scanner = create_fat_scanner(type);
+        if (!scanner) {
+            std::cout << type << ": not supported" << std::endl;
+            continue;
+        }
+
+        // Every scanner has to give the same results as the scalar one
+        std::vector<uint64_t> bitmap(free_bitmap.size());
+        scanner->build_bitmap(fat.data(), fat.size(), FAT_FREE, bitmap.data());
+        if (scanner->count(fat.data(), fat.size(), FAT_FREE) != free_count || bitmap != free_bitmap ||
+            scanner->find_run(fat.data(), fat.size(), FAT_FREE, 16, 0) != short_run ||
+            scanner->find_run(fat.data(), fat.size(), FAT_FREE, 16, short_run + 1) !=
+            reference->find_run(fat.data(), fat.size(), FAT_FREE, 16, short_run + 1)) {
+            std::cerr << type << ": results differ from the scalar scanner" << std::endl;
+            return EXIT_FAILURE;
+        }
+
+        // Results go to a volatile sink, so the scans aren't optimized away
+        volatile uint64_t sink = 0;
+        auto name = std::string(scanner->get_name());
+        measure(name + ", count free", cluster_count, repetitions, [&]() {
+            sink = sink + scanner->count(fat.data(), fat.size(), FAT_FREE);
+        });
+        measure(name + ", free bitmap", cluster_count, repetitions, [&]() {
+            scanner->build_bitmap(fat.data(), fat.size(), FAT_FREE, bitmap.data());
+            sink = sink + bitmap[0];
+        });
+        measure(name + ", free run (not found)", cluster_count, repetitions, [&]() {
+            sink = sink + scanner->find_run(fat.data(), fat.size(), FAT_FREE, cluster_count, 0);
+        });
+        measure(name + ", fill", cluster_count, repetitions, [&]() {
+            scanner->fill(filled.data(), filled.size(), FAT_FREE);
+            sink = sink + filled[cluster_count - 1];
+        });
+    }
+
+    return EXIT_SUCCESS;
+}
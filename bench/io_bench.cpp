@@ -0,0 +1,135 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fcntl.h>
+#include <iomanip>
+#include <iostream>
+#include <numeric>
+#include <random>
+#include <unistd.h>
+#include <vector>
+#include "block_device.h"
+
+/**
+ * Writes the dirty pages of the image and drops them from the page cache, so the next reads go to the disk
+ * @param filepath Filepath of the image
+ */
+static void drop_page_cache(const std::string &filepath) {
+    int fd = open(filepath.c_str(), O_RDWR);
+    if (fd < 0)
+        return;
+    fsync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+/**
+ * Runs one pass over all the clusters and prints its throughput
+ * @param label Label of the pass
+ * @param bytes Number of the bytes moved by the pass
+ * @param pass Function doing the pass
+ */
+template<typename Pass>
+static void measure(const std::string &label, uint64_t bytes, Pass pass) {
+    auto start_time = std::chrono::steady_clock::now();
+    pass();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start_time;
+    std::cout << std::left << std::setw(32) << label << std::right << std::fixed << std::setprecision(3)
+              << elapsed.count() << "s " << std::setw(10) << std::setprecision(1)
+              << (elapsed.count() > 0 ? static_cast<double>(bytes) / (1024 * 1024) / elapsed.count() : 0.0)
+              << " MB/s" << std::endl;
+}
+
+/**
+ * Benchmark of the cluster I/O - one cluster at a time through the stream device (the original path) against
+ * batches submitted to the asynchronous engine, on clusters scattered over the image like a fragmented file
+ */
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        std::cout << "Usage: " << argv[0] << " <image file> [size MB (256)] [cluster KB (4)] [batch (64)]"
+                  << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::string filepath = argv[1];
+    uint64_t size = (argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 256) * 1024 * 1024;
+    uint64_t cluster_size = (argc > 3 ? std::strtoull(argv[3], nullptr, 10) : 4) * 1024;
+    size_t batch_size = argc > 4 ? std::strtoull(argv[4], nullptr, 10) : 64;
+    if (!size || !cluster_size || !batch_size || cluster_size > size) {
+        std::cerr << "Invalid arguments" << std::endl;
+        return EXIT_FAILURE;
+    }
+    auto cluster_count = size / cluster_size;
+
+    // Fill the image with real data (a sparse image would read holes)
+    StreamBlockDevice device;
+    device.open(filepath);
+    device.create(size);
+    std::vector<char> chunk(1024 * 1024);
+    std::mt19937_64 random(42);
+    for (uint64_t offset = 0; offset < size; offset += chunk.size()) {
+        for (auto &byte: chunk)
+            byte = static_cast<char>(random());
+        device.write(offset, chunk.data(), std::min<uint64_t>(chunk.size(), size - offset));
+    }
+    device.sync();
+
+    // Clusters in a random order, like the FAT chain of a badly fragmented file
+    std::vector<uint64_t> order(cluster_count);
+    std::iota(order.begin(), order.end(), 0);
+    std::shuffle(order.begin(), order.end(), random);
+    std::vector<char> data(cluster_count * cluster_size);
+    std::vector<char> batched_data(cluster_count * cluster_size);
+
+    auto engine_name = [&]() {
+        int fd = open(filepath.c_str(), O_RDWR);
+        auto name = std::string(create_async_io_engine(fd)->get_name());
+        close(fd);
+        return name;
+    }();
+    std::cout << "Image: " << size / (1024 * 1024) << "MB, cluster: " << cluster_size / 1024 << "KB, batch: "
+              << batch_size << ", engine: " << engine_name << std::endl;
+
+    // Reads of the scattered clusters
+    drop_page_cache(filepath);
+    measure("read, one cluster at a time", size, [&]() {
+        for (uint64_t i = 0; i < cluster_count; i++)
+            device.read(order[i] * cluster_size, &data[i * cluster_size], cluster_size);
+    });
+    drop_page_cache(filepath);
+    measure("read, batched", size, [&]() {
+        std::vector<IoRequest> requests;
+        for (uint64_t i = 0; i < cluster_count; i++) {
+            requests.push_back(IoRequest{false, order[i] * cluster_size, &batched_data[i * cluster_size],
+                                         cluster_size});
+            if (requests.size() == batch_size || i + 1 == cluster_count) {
+                device.submit(requests);
+                requests.clear();
+            }
+        }
+    });
+    if (data != batched_data) {
+        std::cerr << "Batched reads differ from the reads one cluster at a time" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    // Writes of the scattered clusters (including the time to make them durable)
+    measure("write, one cluster at a time", size, [&]() {
+        for (uint64_t i = 0; i < cluster_count; i++)
+            device.write(order[i] * cluster_size, &data[i * cluster_size], cluster_size);
+        device.sync();
+        drop_page_cache(filepath);
+    });
+    measure("write, batched", size, [&]() {
+        std::vector<IoRequest> requests;
+        for (uint64_t i = 0; i < cluster_count; i++) {
+            requests.push_back(IoRequest{true, order[i] * cluster_size, &data[i * cluster_size], cluster_size});
+            if (requests.size() == batch_size || i + 1 == cluster_count) {
+                device.submit(requests);
+                requests.clear();
+            }
+        }
+        drop_page_cache(filepath);
+    });
+
+    return EXIT_SUCCESS;
+}
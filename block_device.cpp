@@ -0,0 +1,305 @@
+#include "block_device.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * Copies the data within the file by the kernel (or just shares the blocks if the host file system can)
+ * @param fd File descriptor of the file
+ * @param source Offset of the data to be copied in bytes
+ * @param destination Offset the data is copied to in bytes
+ * @param size Size of the data in bytes
+ * @return True if all the data was copied, false otherwise
+ */
+static bool copy_file_data(int fd, uint64_t source, uint64_t destination, uint64_t size) {
+    auto source_offset = static_cast<loff_t>(source);
+    auto destination_offset = static_cast<loff_t>(destination);
+    while (size) {
+        auto copied = copy_file_range(fd, &source_offset, fd, &destination_offset, size, 0);
+        if (copied < 0 && errno == EINTR)
+            continue;
+        if (copied <= 0)
+            return false;
+        size -= static_cast<uint64_t>(copied);
+    }
+    return true;
+}
+
+StreamBlockDevice::~StreamBlockDevice() {
+    engine.reset();
+    if (fd >= 0)
+        close(fd);
+    file.close();
+}
+
+bool StreamBlockDevice::open(const std::string &path) {
+    filepath = path;
+    file.open(filepath, std::ios::binary | std::ios::in | std::ios::out);
+    if (file.is_open())
+        return true;
+
+    // If the file doesn't exist, create it
+    file.open(filepath, std::ios::binary | std::ios::in | std::ios::out | std::ios::trunc);
+    return false;
+}
+
+bool StreamBlockDevice::is_open() const {
+    return file.is_open();
+}
+
+void StreamBlockDevice::create(uint64_t size) {
+    // Truncate the file, resize it (the filesystem fills it with zeroes) and open it again
+    if (file.is_open()) file.close();
+    file.open(filepath, std::ios::binary | std::ios::in | std::ios::out | std::ios::trunc);
+    file.close();
+    std::filesystem::resize_file(filepath, size);
+    file.open(filepath, std::ios::binary | std::ios::in | std::ios::out);
+}
+
+void StreamBlockDevice::read(uint64_t offset, char *buffer, size_t size) {
+    std::lock_guard<std::mutex> guard(lock);
+    file.seekp(static_cast<std::streamoff>(offset));
+    file.read(buffer, static_cast<std::streamsize>(size));
+}
+
+void StreamBlockDevice::write(uint64_t offset, const char *buffer, size_t size) {
+    std::lock_guard<std::mutex> guard(lock);
+    file.seekp(static_cast<std::streamoff>(offset));
+    file.write(buffer, static_cast<std::streamsize>(size));
+}
+
+void StreamBlockDevice::sync() {
+    // Flushing the stream only hands the data to the kernel, the descriptor makes it durable
+    std::lock_guard<std::mutex> guard(lock);
+    if (prepare_descriptor())
+        fdatasync(fd);
+    else
+        file.flush();
+}
+
+bool StreamBlockDevice::prepare_descriptor() {
+    // The buffered writes of the stream have to reach the file before anything goes around the stream
+    // (the stream reads afterwards are fine, every read seeks and throws its buffer away)
+    file.flush();
+    if (fd < 0)
+        fd = ::open(filepath.c_str(), O_RDWR);
+    return fd >= 0;
+}
+
+void StreamBlockDevice::submit(const std::vector<IoRequest> &requests) {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (prepare_descriptor() && !engine)
+            engine = create_async_io_engine(fd);
+    }
+    // The engine is busy with the batch of another thread, this one goes through the stream
+    std::unique_lock<std::mutex> engine_guard(engine_lock, std::try_to_lock);
+    if (engine && engine_guard.owns_lock())
+        engine->submit(requests);
+    else
+        BlockDevice::submit(requests);
+}
+
+bool StreamBlockDevice::copy(uint64_t source, uint64_t destination, uint64_t size) {
+    std::lock_guard<std::mutex> guard(lock);
+    return prepare_descriptor() && copy_file_data(fd, source, destination, size);
+}
+
+void StreamBlockDevice::discard(uint64_t offset, uint64_t size) {
+    // The stream has no file descriptor, punch the hole through a new one (after the buffered data is written)
+    std::lock_guard<std::mutex> guard(lock);
+    file.flush();
+    int fd = ::open(filepath.c_str(), O_RDWR);
+    if (fd < 0)
+        return;
+    fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, static_cast<off_t>(offset), static_cast<off_t>(size));
+    close(fd);
+}
+
+PositionalBlockDevice::PositionalBlockDevice() : fd{-1} {}
+
+PositionalBlockDevice::~PositionalBlockDevice() {
+    engine.reset();
+    if (fd >= 0)
+        close(fd);
+}
+
+bool PositionalBlockDevice::open(const std::string &filepath) {
+    // Open the file (create it if it doesn't exist)
+    fd = ::open(filepath.c_str(), O_RDWR);
+    bool existed = fd >= 0;
+    if (!existed)
+        fd = ::open(filepath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    return existed;
+}
+
+bool PositionalBlockDevice::is_open() const {
+    return fd >= 0;
+}
+
+void PositionalBlockDevice::create(uint64_t size) {
+    // Truncating to zero first throws away the old content
+    if (ftruncate(fd, 0) == 0)
+        ftruncate(fd, static_cast<off_t>(size));
+}
+
+void PositionalBlockDevice::read(uint64_t offset, char *buffer, size_t size) {
+    execute_io_request(fd, IoRequest{false, offset, buffer, size});
+}
+
+void PositionalBlockDevice::write(uint64_t offset, const char *buffer, size_t size) {
+    execute_io_request(fd, IoRequest{true, offset, const_cast<char *>(buffer), size});
+}
+
+void PositionalBlockDevice::sync() {
+    fdatasync(fd);
+}
+
+void PositionalBlockDevice::submit(const std::vector<IoRequest> &requests) {
+    // The engine is busy with the batch of another thread, this one is executed right here
+    std::unique_lock<std::mutex> engine_guard(engine_lock, std::try_to_lock);
+    if (engine_guard.owns_lock() && !engine)
+        engine = create_async_io_engine(fd);
+    if (engine_guard.owns_lock() && engine)
+        engine->submit(requests);
+    else
+        BlockDevice::submit(requests);
+}
+
+bool PositionalBlockDevice::copy(uint64_t source, uint64_t destination, uint64_t size) {
+    return copy_file_data(fd, source, destination, size);
+}
+
+void PositionalBlockDevice::discard(uint64_t offset, uint64_t size) {
+    fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, static_cast<off_t>(offset), static_cast<off_t>(size));
+}
+
+void PositionalBlockDevice::advise_sequential(uint64_t offset, size_t size) {
+    posix_fadvise(fd, static_cast<off_t>(offset), static_cast<off_t>(size), POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(fd, static_cast<off_t>(offset), static_cast<off_t>(size), POSIX_FADV_WILLNEED);
+}
+
+MmapBlockDevice::MmapBlockDevice() : fd{-1}, mapping{nullptr}, mapping_size{0} {}
+
+MmapBlockDevice::~MmapBlockDevice() {
+    sync();
+    if (mapping)
+        munmap(mapping, mapping_size);
+    if (fd >= 0)
+        close(fd);
+}
+
+void MmapBlockDevice::remap(uint64_t size) {
+    if (mapping) {
+        munmap(mapping, mapping_size);
+        mapping = nullptr;
+    }
+    if (ftruncate(fd, static_cast<off_t>(size)) != 0)
+        size = mapping_size;
+    mapping_size = size;
+    if (!mapping_size)
+        return;
+
+    void *result = mmap(nullptr, mapping_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    mapping = result == MAP_FAILED ? nullptr : static_cast<char *>(result);
+    if (!mapping)
+        mapping_size = 0;
+}
+
+bool MmapBlockDevice::open(const std::string &filepath) {
+    // Open the file (create it if it doesn't exist) and map all of it
+    fd = ::open(filepath.c_str(), O_RDWR);
+    bool existed = fd >= 0;
+    if (!existed)
+        fd = ::open(filepath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return false;
+
+    struct stat file_stat{};
+    fstat(fd, &file_stat);
+    mapping_size = static_cast<uint64_t>(file_stat.st_size);
+    remap(mapping_size);
+    return existed;
+}
+
+bool MmapBlockDevice::is_open() const {
+    return fd >= 0;
+}
+
+void MmapBlockDevice::create(uint64_t size) {
+    if (mapping) {
+        munmap(mapping, mapping_size);
+        mapping = nullptr;
+    }
+    // Truncating to zero first throws away the old content
+    if (ftruncate(fd, 0) == 0)
+        mapping_size = 0;
+    remap(size);
+}
+
+void MmapBlockDevice::read(uint64_t offset, char *buffer, size_t size) {
+    // Reading past the end of the image gives zeroes
+    size_t available = offset < mapping_size ? std::min<uint64_t>(size, mapping_size - offset) : 0;
+    if (available)
+        std::memcpy(buffer, mapping + offset, available);
+    std::memset(buffer + available, 0, size - available);
+}
+
+void MmapBlockDevice::write(uint64_t offset, const char *buffer, size_t size) {
+    // Writing past the end of the image grows it
+    if (offset + size > mapping_size)
+        remap(offset + size);
+    if (offset + size <= mapping_size)
+        std::memcpy(mapping + offset, buffer, size);
+}
+
+void MmapBlockDevice::sync() {
+    if (mapping)
+        msync(mapping, mapping_size, MS_SYNC);
+}
+
+bool MmapBlockDevice::copy(uint64_t source, uint64_t destination, uint64_t size) {
+    if (std::max(source, destination) + size > mapping_size)
+        return false;
+    std::memcpy(mapping + destination, mapping + source, size);
+    return true;
+}
+
+void MmapBlockDevice::discard(uint64_t offset, uint64_t size) {
+    if (offset + size > mapping_size)
+        return;
+    fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, static_cast<off_t>(offset), static_cast<off_t>(size));
+}
+
+const char *MmapBlockDevice::view(uint64_t offset, size_t size) {
+    if (offset + size > mapping_size)
+        return nullptr;
+    return mapping + offset;
+}
+
+void MmapBlockDevice::advise_sequential(uint64_t offset, size_t size) {
+    if (!mapping || offset >= mapping_size)
+        return;
+    // madvise needs a page aligned start
+    auto page_size = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+    auto aligned_offset = offset - offset % page_size;
+    auto length = std::min<uint64_t>(size + (offset - aligned_offset), mapping_size - aligned_offset);
+    madvise(mapping + aligned_offset, length, MADV_SEQUENTIAL);
+    madvise(mapping + aligned_offset, length, MADV_WILLNEED);
+}
+
+std::unique_ptr<BlockDevice> create_block_device(const std::string &type) {
+    if (type == "stream")
+        return std::make_unique<StreamBlockDevice>();
+    if (type == "pread")
+        return std::make_unique<PositionalBlockDevice>();
+    if (type == "mmap")
+        return std::make_unique<MmapBlockDevice>();
+    return nullptr;
+}
@@ -0,0 +1,268 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "async_io.h"
+
+/**
+ * Abstract block device the file system image is stored on
+ * All offsets are in bytes from the beginning of the image
+ * Reads and writes of different ranges can be called from multiple threads at once (as long as the image doesn't grow)
+ */
+class BlockDevice {
+public:
+    /**
+     * Destructor
+     */
+    virtual ~BlockDevice() = default;
+
+    /**
+     * Opens the image file, the file is created (empty) if it doesn't exist
+     * @param filepath Filepath of the image file
+     * @return True if the image file existed before, false if it was created (or couldn't be opened)
+     */
+    virtual bool open(const std::string &filepath) = 0;
+
+    /**
+     * Checks if the image file is open
+     * @return True if the image file is open, false otherwise
+     */
+    virtual bool is_open() const = 0;
+
+    /**
+     * Throws away the content of the image and resizes it to the given size (filled with zeroes)
+     * The image is resized sparsely, no data is written
+     * @param size New size of the image in bytes
+     */
+    virtual void create(uint64_t size) = 0;
+
+    /**
+     * Reads the data from the image
+     * @param offset Offset of the data in bytes
+     * @param buffer Buffer to be filled with data
+     * @param size Size of the data in bytes
+     */
+    virtual void read(uint64_t offset, char *buffer, size_t size) = 0;
+
+    /**
+     * Writes the data to the image
+     * @param offset Offset of the data in bytes
+     * @param buffer Buffer with data to be written
+     * @param size Size of the data in bytes
+     */
+    virtual void write(uint64_t offset, const char *buffer, size_t size) = 0;
+
+    /**
+     * Makes all the written data durable
+     */
+    virtual void sync() = 0;
+
+    /**
+     * Executes the batch of reads and writes, the device can have all of them in flight at once
+     * The requests must not overlap (they can be executed in any order)
+     * @param requests Requests to be executed
+     */
+    virtual void submit(const std::vector<IoRequest> &requests) {
+        for (const auto &request: requests) {
+            if (request.write)
+                write(request.offset, request.buffer, request.size);
+            else
+                read(request.offset, request.buffer, request.size);
+        }
+    }
+
+    /**
+     * Copies the data within the image without passing it through the caller
+     * @param source Offset of the data to be copied in bytes
+     * @param destination Offset the data is copied to in bytes (the ranges must not overlap)
+     * @param size Size of the data in bytes
+     * @return True if the data was copied, false if the device can't copy it (the destination can be partly written)
+     */
+    virtual bool copy(uint64_t, uint64_t, uint64_t) {
+        return false;
+    }
+
+    /**
+     * Gets a read-only view into the image without copying the data
+     * The view is valid until the next write or create call
+     * @param offset Offset of the data in bytes
+     * @param size Size of the data in bytes
+     * @return Pointer to the data, or nullptr if the device doesn't support views
+     */
+    virtual const char *view(uint64_t, size_t) {
+        return nullptr;
+    }
+
+    /**
+     * Gives the space of the range back to the host file system, the range reads as zeroes afterwards
+     * @param offset Offset of the range in bytes
+     * @param size Size of the range in bytes
+     */
+    virtual void discard(uint64_t offset, uint64_t size) = 0;
+
+    /**
+     * Hints the device that the given range is going to be read sequentially soon
+     * @param offset Offset of the range in bytes
+     * @param size Size of the range in bytes
+     */
+    virtual void advise_sequential(uint64_t, size_t) {}
+};
+
+/**
+ * Block device using a std::fstream with seek + read / write calls
+ * Batches go around the stream to an asynchronous engine (io_uring or a thread pool)
+ */
+class StreamBlockDevice : public BlockDevice {
+private:
+    /** Filepath of the image file */
+    std::string filepath;
+    /** Image file stream */
+    std::fstream file;
+    /** Lock of the stream (seek + read / write has to be done at once) */
+    std::mutex lock;
+    /** File descriptor of the image file used by the batches (the stream doesn't expose its own) */
+    int fd = -1;
+    /** Engine executing the batches (created with the first batch) */
+    std::unique_ptr<AsyncIoEngine> engine;
+    /** Lock of the engine (it executes one batch at a time, the batches of the other threads go around it) */
+    std::mutex engine_lock;
+
+    /**
+     * Writes the buffered data of the stream and opens the file descriptor used around the stream
+     * Has to be called with the lock held
+     * @return True if the file descriptor is open, false otherwise
+     */
+    bool prepare_descriptor();
+
+public:
+    /**
+     * Destructor
+     */
+    ~StreamBlockDevice() override;
+
+    bool open(const std::string &filepath) override;
+
+    bool is_open() const override;
+
+    void create(uint64_t size) override;
+
+    void read(uint64_t offset, char *buffer, size_t size) override;
+
+    void write(uint64_t offset, const char *buffer, size_t size) override;
+
+    void sync() override;
+
+    void submit(const std::vector<IoRequest> &requests) override;
+
+    bool copy(uint64_t source, uint64_t destination, uint64_t size) override;
+
+    void discard(uint64_t offset, uint64_t size) override;
+};
+
+/**
+ * Block device doing positional pread / pwrite calls on a file descriptor
+ * There is no shared cursor, so the reads and writes of multiple threads don't wait for each other
+ */
+class PositionalBlockDevice : public BlockDevice {
+private:
+    /** File descriptor of the image file */
+    int fd;
+    /** Engine executing the batches (created with the first batch) */
+    std::unique_ptr<AsyncIoEngine> engine;
+    /** Lock of the engine (it executes one batch at a time, the batches of the other threads go around it) */
+    std::mutex engine_lock;
+
+public:
+    /**
+     * Constructor
+     */
+    PositionalBlockDevice();
+
+    /**
+     * Destructor
+     */
+    ~PositionalBlockDevice() override;
+
+    bool open(const std::string &filepath) override;
+
+    bool is_open() const override;
+
+    void create(uint64_t size) override;
+
+    void read(uint64_t offset, char *buffer, size_t size) override;
+
+    void write(uint64_t offset, const char *buffer, size_t size) override;
+
+    void sync() override;
+
+    void submit(const std::vector<IoRequest> &requests) override;
+
+    bool copy(uint64_t source, uint64_t destination, uint64_t size) override;
+
+    void discard(uint64_t offset, uint64_t size) override;
+
+    void advise_sequential(uint64_t offset, size_t size) override;
+};
+
+/**
+ * Block device mapping the whole image to the memory
+ * Reads can be served as views directly into the mapping
+ */
+class MmapBlockDevice : public BlockDevice {
+private:
+    /** File descriptor of the image file */
+    int fd;
+    /** Start of the mapping (nullptr if nothing is mapped) */
+    char *mapping;
+    /** Size of the mapping (and the image) in bytes */
+    uint64_t mapping_size;
+
+    /**
+     * Resizes the image file and the mapping
+     * @param size New size of the image in bytes
+     */
+    void remap(uint64_t size);
+
+public:
+    /**
+     * Constructor
+     */
+    MmapBlockDevice();
+
+    /**
+     * Destructor, syncs and unmaps the image
+     */
+    ~MmapBlockDevice() override;
+
+    bool open(const std::string &filepath) override;
+
+    bool is_open() const override;
+
+    void create(uint64_t size) override;
+
+    void read(uint64_t offset, char *buffer, size_t size) override;
+
+    void write(uint64_t offset, const char *buffer, size_t size) override;
+
+    void sync() override;
+
+    bool copy(uint64_t source, uint64_t destination, uint64_t size) override;
+
+    void discard(uint64_t offset, uint64_t size) override;
+
+    const char *view(uint64_t offset, size_t size) override;
+
+    void advise_sequential(uint64_t offset, size_t size) override;
+};
+
+/**
+ * Creates the block device of the given type
+ * @param type Type of the device ("stream", "pread" or "mmap")
+ * @return Created block device, or nullptr if the type is unknown
+ */
+std::unique_ptr<BlockDevice> create_block_device(const std::string &type);
@@ -0,0 +1,240 @@
+#include "cluster_cache.h"
+
+#include <algorithm>
+#include <cstring>
+
+ClusterCache::ClusterCache(BlockDevice &device, uint32_t cluster_size, uint64_t data_start, uint64_t budget)
+        : device{device}, cluster_size{cluster_size}, data_start{data_start},
+          capacity{cluster_size ? budget / cluster_size : 0}, pinned_count{0}, stats{} {}
+
+uint64_t ClusterCache::get_cluster_start(uint64_t address) const {
+    return address - (address - data_start) % cluster_size;
+}
+
+bool ClusterCache::is_within_cluster(uint64_t address, size_t size) const {
+    return cluster_size && address >= data_start && (address - data_start) % cluster_size + size <= cluster_size;
+}
+
+bool ClusterCache::is_cached(uint64_t cluster_address) const {
+    return lookup.count(cluster_address);
+}
+
+ClusterCache::CachedCluster *ClusterCache::find(uint64_t cluster_address) {
+    auto found = lookup.find(cluster_address);
+    if (found == lookup.end())
+        return nullptr;
+    // Move the cluster to the front of the list (most recently used)
+    clusters.splice(clusters.begin(), clusters, found->second);
+    return &*found->second;
+}
+
+ClusterCache::CachedCluster &ClusterCache::insert(uint64_t cluster_address) {
+    // Evict the least recently used clusters, the dirty ones are written first (the pinned ones are skipped)
+    auto victim = clusters.end();
+    while (clusters.size() - pinned_count >= capacity && clusters.size() > pinned_count) {
+        do
+            victim--;
+        while (victim->pinned);
+        if (victim->dirty) {
+            device.write(victim->address, victim->data.data(), cluster_size);
+            stats.write_backs++;
+        }
+        lookup.erase(victim->address);
+        victim = clusters.erase(victim);
+        stats.evictions++;
+    }
+
+    clusters.push_front(CachedCluster{cluster_address, std::vector<char>(cluster_size), false, false});
+    lookup[cluster_address] = clusters.begin();
+    return clusters.front();
+}
+
+void ClusterCache::write_back(std::vector<CachedCluster *> &dirty) {
+    // Nothing is cached without a formatted file system (the cluster size is zero)
+    if (dirty.empty() || !cluster_size)
+        return;
+    std::sort(dirty.begin(), dirty.end(), [](const auto *a, const auto *b) { return a->address < b->address; });
+
+    // Gather the runs of clusters following each other to the batch and write each run in one go
+    std::vector<char> batch;
+    auto batch_clusters = std::max<uint32_t>(1, WRITE_BACK_BATCH_SIZE / cluster_size);
+    for (size_t i = 0; i < dirty.size();) {
+        size_t run = 1;
+        while (i + run < dirty.size() && run < batch_clusters &&
+               dirty[i + run]->address == dirty[i]->address + run * cluster_size)
+            run++;
+
+        if (run == 1) {
+            device.write(dirty[i]->address, dirty[i]->data.data(), cluster_size);
+        } else {
+            batch.resize(run * cluster_size);
+            for (size_t j = 0; j < run; j++)
+                std::memcpy(&batch[j * cluster_size], dirty[i + j]->data.data(), cluster_size);
+            device.write(dirty[i]->address, batch.data(), batch.size());
+        }
+        for (size_t j = 0; j < run; j++)
+            dirty[i + j]->dirty = false;
+        stats.write_backs += run;
+        i += run;
+    }
+}
+
+std::vector<std::list<ClusterCache::CachedCluster>::iterator> ClusterCache::find_range(uint64_t address,
+                                                                                       uint64_t size) {
+    std::vector<std::list<CachedCluster>::iterator> found;
+    if (clusters.empty() || !size)
+        return found;
+
+    // Look up the clusters of the range one by one, or go through the whole cache if it is smaller than the range
+    auto first = get_cluster_start(std::max(address, data_start));
+    auto end = address + size;
+    if ((end - first) / cluster_size < clusters.size()) {
+        for (auto cluster_address = first; cluster_address < end; cluster_address += cluster_size) {
+            auto cached = lookup.find(cluster_address);
+            if (cached != lookup.end())
+                found.push_back(cached->second);
+        }
+    } else {
+        for (auto it = clusters.begin(); it != clusters.end(); it++)
+            if (it->address + cluster_size > address && it->address < end)
+                found.push_back(it);
+    }
+    return found;
+}
+
+const char *ClusterCache::get(uint64_t cluster_address, const std::vector<uint64_t> &read_ahead) {
+    auto cached = find(cluster_address);
+    if (cached) {
+        stats.hits++;
+        return cached->data.data();
+    }
+    stats.misses++;
+
+    if (!capacity) {
+        scratch.resize(cluster_size);
+        device.read(cluster_address, scratch.data(), cluster_size);
+        return scratch.data();
+    }
+
+    // Load the cluster with the read-ahead clusters that are not cached yet (at most half of the cache)
+    std::vector<uint64_t> to_load;
+    auto max_read_ahead = capacity / 2;
+    for (auto address: read_ahead)
+        if (to_load.size() < max_read_ahead && address != cluster_address && !is_cached(address) &&
+            std::find(to_load.begin(), to_load.end(), address) == to_load.end())
+            to_load.push_back(address);
+    stats.read_ahead += to_load.size();
+    to_load.push_back(cluster_address);
+    std::sort(to_load.begin(), to_load.end());
+
+    // Read the runs of clusters following each other in one go
+    std::vector<char> batch;
+    for (size_t i = 0; i < to_load.size();) {
+        size_t run = 1;
+        while (i + run < to_load.size() && to_load[i + run] == to_load[i] + run * cluster_size)
+            run++;
+        batch.resize(run * cluster_size);
+        device.read(to_load[i], batch.data(), batch.size());
+        for (size_t j = 0; j < run; j++) {
+            // The requested cluster is inserted last, so it can't be evicted by the read-ahead ones
+            if (to_load[i + j] != cluster_address)
+                std::memcpy(insert(to_load[i + j]).data.data(), &batch[j * cluster_size], cluster_size);
+            else
+                scratch.assign(batch.begin() + static_cast<long>(j * cluster_size),
+                               batch.begin() + static_cast<long>((j + 1) * cluster_size));
+        }
+        i += run;
+    }
+    auto &loaded = insert(cluster_address);
+    loaded.data.swap(scratch);
+    return loaded.data.data();
+}
+
+void ClusterCache::read(uint64_t address, char *buffer, size_t size) {
+    auto cluster_address = get_cluster_start(address);
+    std::memcpy(buffer, get(cluster_address) + (address - cluster_address), size);
+}
+
+void ClusterCache::write(uint64_t address, const char *buffer, size_t size, bool pin) {
+    auto cluster_address = get_cluster_start(address);
+    auto cached = find(cluster_address);
+
+    // Partial write of a cluster that is not cached goes straight to the device (it would have to be read first)
+    if (!cached && !pin && (!capacity || size < cluster_size)) {
+        device.write(address, buffer, size);
+        return;
+    }
+
+    if (!cached) {
+        cached = &insert(cluster_address);
+        if (size < cluster_size)
+            device.read(cluster_address, cached->data.data(), cluster_size);
+    }
+    std::memcpy(cached->data.data() + (address - cluster_address), buffer, size);
+    cached->dirty = true;
+    if (pin && !cached->pinned) {
+        cached->pinned = true;
+        pinned_count++;
+    }
+}
+
+void ClusterCache::flush() {
+    std::vector<CachedCluster *> dirty;
+    for (auto &cluster: clusters)
+        if (cluster.dirty && !cluster.pinned)
+            dirty.push_back(&cluster);
+    write_back(dirty);
+}
+
+void ClusterCache::flush_range(uint64_t address, uint64_t size) {
+    std::vector<CachedCluster *> dirty;
+    for (auto it: find_range(address, size))
+        if (it->dirty && !it->pinned)
+            dirty.push_back(&*it);
+    write_back(dirty);
+}
+
+void ClusterCache::release_pinned() {
+    if (!pinned_count)
+        return;
+    for (auto &cluster: clusters) {
+        if (cluster.pinned) {
+            cluster.pinned = false;
+            cluster.dirty = false;
+        }
+    }
+    pinned_count = 0;
+
+    // The cache could have grown over its capacity with the pinned clusters
+    while (clusters.size() > capacity) {
+        auto &victim = clusters.back();
+        if (victim.dirty) {
+            device.write(victim.address, victim.data.data(), cluster_size);
+            stats.write_backs++;
+        }
+        lookup.erase(victim.address);
+        clusters.pop_back();
+        stats.evictions++;
+    }
+}
+
+void ClusterCache::invalidate(uint64_t address, uint64_t size) {
+    for (auto it: find_range(address, size)) {
+        if (it->pinned)
+            pinned_count--;
+        lookup.erase(it->address);
+        clusters.erase(it);
+    }
+}
+
+uint64_t ClusterCache::get_capacity() const {
+    return capacity;
+}
+
+uint64_t ClusterCache::get_size() const {
+    return clusters.size();
+}
+
+const CacheStats &ClusterCache::get_stats() const {
+    return stats;
+}
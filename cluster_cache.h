@@ -0,0 +1,201 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <list>
+#include <unordered_map>
+#include <vector>
+#include "block_device.h"
+
+/** Maximum size of one write when the dirty clusters are written back */
+constexpr uint32_t WRITE_BACK_BATCH_SIZE = 1024 * 1024;
+
+/**
+ * Statistics of the cluster cache
+ */
+struct CacheStats {
+    /** Number of cluster reads served from the cache */
+    uint64_t hits;
+    /** Number of cluster reads that had to go to the device */
+    uint64_t misses;
+    /** Number of clusters loaded ahead of their use */
+    uint64_t read_ahead;
+    /** Number of dirty clusters written back to the device */
+    uint64_t write_backs;
+    /** Number of clusters thrown out of the cache to make space */
+    uint64_t evictions;
+};
+
+/**
+ * Write-back cache of whole data clusters with LRU eviction
+ * Only accesses within one cluster go through the cache, the bigger ones go straight to the device
+ * (the caller has to keep them coherent with flush_range and invalidate)
+ * Pinned clusters are never evicted or written back, they stay in the cache (even if it is disabled) until they
+ * are released
+ */
+class ClusterCache {
+private:
+    /**
+     * One cached cluster
+     */
+    struct CachedCluster {
+        /** Cluster address of the cluster */
+        uint64_t address;
+        /** Data of the whole cluster */
+        std::vector<char> data;
+        /** True if the data was changed and not yet written to the device */
+        bool dirty;
+        /** True if the data must not be written to the device yet */
+        bool pinned;
+    };
+
+    /** Device the clusters are read from and written to */
+    BlockDevice &device;
+    /** Size of one cluster in bytes */
+    uint32_t cluster_size;
+    /** Address of the first data cluster (clusters are aligned to it) */
+    uint64_t data_start;
+    /** Maximum number of cached clusters (0 means the cache is disabled) */
+    uint64_t capacity;
+    /** Cached clusters, the most recently used one is at the front */
+    std::list<CachedCluster> clusters;
+    /** Cached clusters by their cluster address */
+    std::unordered_map<uint64_t, std::list<CachedCluster>::iterator> lookup;
+    /** Buffer used when the cache is disabled */
+    std::vector<char> scratch;
+    /** Number of the pinned clusters */
+    uint64_t pinned_count;
+    /** Statistics of the cache */
+    CacheStats stats;
+
+    /**
+     * Gets the cluster address of the cluster containing the given address
+     * @param address Address in bytes
+     * @return Cluster address of the cluster
+     */
+    uint64_t get_cluster_start(uint64_t address) const;
+
+    /**
+     * Finds the cached cluster and marks it as the most recently used
+     * @param cluster_address Cluster address of the cluster
+     * @return Cached cluster, or nullptr if the cluster is not cached
+     */
+    CachedCluster *find(uint64_t cluster_address);
+
+    /**
+     * Adds the cluster to the cache (as the most recently used), the least recently used ones are evicted
+     * @param cluster_address Cluster address of the cluster
+     * @return Added cluster (its data is not filled)
+     */
+    CachedCluster &insert(uint64_t cluster_address);
+
+    /**
+     * Writes the dirty clusters to the device, clusters following each other are written in one go
+     * @param dirty Dirty clusters to be written (they are marked as clean)
+     */
+    void write_back(std::vector<CachedCluster *> &dirty);
+
+    /**
+     * Gets the cached clusters in the range
+     * @param address Address of the range in bytes
+     * @param size Size of the range in bytes
+     * @return Iterators of the cached clusters in the range
+     */
+    std::vector<std::list<CachedCluster>::iterator> find_range(uint64_t address, uint64_t size);
+
+public:
+    /**
+     * Constructor
+     * @param device Device the clusters are stored on
+     * @param cluster_size Size of one cluster in bytes
+     * @param data_start Address of the first data cluster in bytes
+     * @param budget Maximum size of the cached data in bytes (0 disables the cache)
+     */
+    ClusterCache(BlockDevice &device, uint32_t cluster_size, uint64_t data_start, uint64_t budget);
+
+    /**
+     * Checks if the whole range lies within one cluster (and can go through the cache)
+     * @param address Address of the range in bytes
+     * @param size Size of the range in bytes
+     * @return True if the range lies within one cluster, false otherwise
+     */
+    bool is_within_cluster(uint64_t address, size_t size) const;
+
+    /**
+     * Checks if the cluster is cached
+     * @param cluster_address Cluster address of the cluster
+     * @return True if the cluster is cached, false otherwise
+     */
+    bool is_cached(uint64_t cluster_address) const;
+
+    /**
+     * Gets the data of the cluster, the cluster is read from the device if it is not cached
+     * On a miss, the read-ahead clusters that are not cached yet are loaded as well
+     * (clusters following each other are read in one go)
+     * @param cluster_address Cluster address of the cluster
+     * @param read_ahead Cluster addresses of the clusters that are likely to be needed next
+     * @return Pointer to the data of the whole cluster (valid until the next call of the cache)
+     */
+    const char *get(uint64_t cluster_address, const std::vector<uint64_t> &read_ahead = {});
+
+    /**
+     * Reads the data within one cluster
+     * @param address Address of the data in bytes
+     * @param buffer Buffer to be filled with data
+     * @param size Size of the data in bytes
+     */
+    void read(uint64_t address, char *buffer, size_t size);
+
+    /**
+     * Writes the data within one cluster, the data is written to the device later (write-back)
+     * Partial writes of clusters that are not cached go straight to the device (unless the cluster is pinned)
+     * @param address Address of the data in bytes
+     * @param buffer Buffer with data to be written
+     * @param size Size of the data in bytes
+     * @param pin True if the cluster is pinned (kept in the cache and not written until it is released)
+     */
+    void write(uint64_t address, const char *buffer, size_t size, bool pin = false);
+
+    /**
+     * Writes all the dirty clusters to the device (except the pinned ones)
+     */
+    void flush();
+
+    /**
+     * Releases all the pinned clusters as clean, their data was already written to the device some other way
+     */
+    void release_pinned();
+
+    /**
+     * Writes the dirty clusters in the range to the device (before the range is read around the cache)
+     * @param address Address of the range in bytes
+     * @param size Size of the range in bytes
+     */
+    void flush_range(uint64_t address, uint64_t size);
+
+    /**
+     * Throws away the cached clusters in the range without writing them (after the range was written around the
+     * cache or the clusters were freed)
+     * @param address Address of the range in bytes
+     * @param size Size of the range in bytes
+     */
+    void invalidate(uint64_t address, uint64_t size);
+
+    /**
+     * Gets the maximum number of cached clusters
+     * @return Maximum number of cached clusters
+     */
+    uint64_t get_capacity() const;
+
+    /**
+     * Gets the number of cached clusters
+     * @return Number of cached clusters
+     */
+    uint64_t get_size() const;
+
+    /**
+     * Gets the statistics of the cache
+     * @return Statistics of the cache
+     */
+    const CacheStats &get_stats() const;
+};
@@ -0,0 +1,156 @@
+#include "command_server.h"
+
+#include <cerrno>
+#include <cstring>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/**
+ * Sends all the data to the client (a client that is gone doesn't raise SIGPIPE)
+ * @param fd Socket of the client
+ * @param data Data to be sent
+ * @return True if all the data was sent, false otherwise
+ */
+static bool send_all(int fd, const std::string &data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+        auto result = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result <= 0)
+            return false;
+        sent += static_cast<size_t>(result);
+    }
+    return true;
+}
+
+/**
+ * Checks if more data of the client is already waiting on the socket
+ * @param fd Socket of the client
+ * @return True if there is data to be received, false otherwise
+ */
+static bool is_input_pending(int fd) {
+    pollfd input{fd, POLLIN, 0};
+    return poll(&input, 1, 0) > 0 && (input.revents & POLLIN);
+}
+
+CommandServer::CommandServer(PseudoFS &fs, const std::string &socket_path)
+        : fs{fs}, socket_path{socket_path}, listen_fd{-1} {}
+
+CommandServer::~CommandServer() {
+    // The clients are disconnected, their threads finish the command being executed and end
+    for (auto &client: clients)
+        shutdown(client.fd, SHUT_RDWR);
+    for (auto &client: clients) {
+        client.thread.join();
+        close(client.fd);
+    }
+    if (listen_fd >= 0) {
+        close(listen_fd);
+        unlink(socket_path.c_str());
+    }
+}
+
+bool CommandServer::start() {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (socket_path.empty() || socket_path.size() >= sizeof(address.sun_path))
+        return false;
+    std::memcpy(address.sun_path, socket_path.c_str(), socket_path.size());
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0)
+        return false;
+    unlink(socket_path.c_str());
+    if (bind(listen_fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 ||
+        listen(listen_fd, SERVER_BACKLOG) != 0) {
+        close(listen_fd);
+        listen_fd = -1;
+        return false;
+    }
+    return true;
+}
+
+void CommandServer::run(const volatile std::sig_atomic_t &stop_requested) {
+    while (!stop_requested) {
+        // Wait for a new client for a while, so the stop request is noticed
+        pollfd incoming{listen_fd, POLLIN, 0};
+        if (poll(&incoming, 1, SERVER_POLL_TIMEOUT) <= 0 || !(incoming.revents & POLLIN))
+            continue;
+        int fd = accept(listen_fd, nullptr, nullptr);
+        if (fd < 0)
+            continue;
+
+        remove_finished_clients();
+        auto &client = clients.emplace_back();
+        client.fd = fd;
+        client.thread = std::thread([this, &client]() {
+            // The client sees the end right away, the socket is closed when the thread is joined
+            serve(client);
+            shutdown(client.fd, SHUT_RDWR);
+            client.finished = true;
+        });
+    }
+}
+
+void CommandServer::serve(Client &client) {
+    Session session;
+    std::string received;
+    std::string token;
+    std::vector<std::string> tokens;
+    char buffer[SERVER_RECEIVE_SIZE];
+    if (!send_all(client.fd, fs.get_working_directory_path(session) + "$ >"))
+        return;
+
+    for (;;) {
+        auto line_end = received.find('\n');
+        if (line_end == std::string::npos) {
+            // Commands waiting on the socket are committed to the journal together, the rest before waiting
+            if (!is_input_pending(client.fd))
+                fs.commit_journal(session);
+            auto size = recv(client.fd, buffer, sizeof(buffer), 0);
+            if (size < 0 && errno == EINTR)
+                continue;
+            if (size <= 0)
+                break;
+            received.append(buffer, static_cast<size_t>(size));
+            continue;
+        }
+
+        std::string input = received.substr(0, line_end);
+        received.erase(0, line_end + 1);
+        if (!input.empty() && input.back() == '\r')
+            input.pop_back();
+        if (input == "exit")
+            break;
+
+        std::stringstream ss(input);
+        tokens.clear();
+        while (std::getline(ss, token, ' '))
+            tokens.push_back(token);
+        if (!tokens.empty())
+            fs.call_cmd(session, tokens[0], tokens);
+
+        // The output of the command goes to the client at once, followed by the prompt
+        session.output << fs.get_working_directory_path(session) << "$ >";
+        if (!send_all(client.fd, session.output.str()))
+            break;
+        session.output.str("");
+    }
+
+    fs.commit_journal(session);
+}
+
+void CommandServer::remove_finished_clients() {
+    for (auto client = clients.begin(); client != clients.end();) {
+        if (!client->finished) {
+            client++;
+            continue;
+        }
+        client->thread.join();
+        close(client->fd);
+        client = clients.erase(client);
+    }
+}
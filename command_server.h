@@ -0,0 +1,81 @@
+#pragma once
+
+#include <atomic>
+#include <csignal>
+#include <cstddef>
+#include <list>
+#include <string>
+#include <thread>
+#include "pseudofat.h"
+
+/** Maximum number of the clients waiting to be accepted by the server */
+constexpr int SERVER_BACKLOG = 16;
+/** Time the server waits for a new client before it checks if it should stop in milliseconds */
+constexpr int SERVER_POLL_TIMEOUT = 200;
+/** Size of the buffer the commands of a client are received into in bytes */
+constexpr size_t SERVER_RECEIVE_SIZE = 4 * 1024;
+
+/**
+ * Server executing the commands of the clients connected over a Unix socket
+ * Every client is served by its own thread in its own session (working directory and output), it sends one command
+ * per line and gets back the output of the command followed by the prompt (just like in the shell)
+ */
+class CommandServer {
+private:
+    /**
+     * Client connected to the server
+     */
+    struct Client {
+        /** Socket of the client */
+        int fd;
+        /** Thread serving the client */
+        std::thread thread;
+        /** True if the client is gone (the thread can be joined) */
+        std::atomic<bool> finished{false};
+    };
+
+    /** File system the commands are executed on */
+    PseudoFS &fs;
+    /** Filepath of the socket */
+    std::string socket_path;
+    /** Socket accepting the clients (-1 if the server isn't started) */
+    int listen_fd;
+    /** Connected clients (only the thread running the server adds and removes them) */
+    std::list<Client> clients;
+
+    /**
+     * Executes the commands of the client until it disconnects (or sends exit)
+     * @param client Client to be served
+     */
+    void serve(Client &client);
+
+    /**
+     * Joins the threads of the clients that are gone and closes their sockets
+     */
+    void remove_finished_clients();
+
+public:
+    /**
+     * Constructor
+     * @param fs File system the commands are executed on
+     * @param socket_path Filepath of the socket
+     */
+    CommandServer(PseudoFS &fs, const std::string &socket_path);
+
+    /**
+     * Destructor, disconnects the clients and removes the socket
+     */
+    ~CommandServer();
+
+    /**
+     * Creates the socket and starts listening on it (an old socket file is replaced)
+     * @return True if the server listens, false otherwise
+     */
+    bool start();
+
+    /**
+     * Accepts the clients until the stop is requested, then waits until the commands being executed are done
+     * @param stop_requested Flag set (by a signal handler) when the server should stop
+     */
+    void run(const volatile std::sig_atomic_t &stop_requested);
+};
@@ -0,0 +1,288 @@
+#include "fat_scanner.h"
+
+#include <algorithm>
+#include <bit>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+/**
+ * Adds the entries of one step of the search to the run being searched for
+ * @param mask Bits of the entries of the step that have the value (the first entry is the lowest bit)
+ * @param width Number of the entries of the step (at most 64)
+ * @param position Position of the first entry of the step
+ * @param length Smallest length of the run
+ * @param run Length of the run so far
+ * @param run_start Position of the start of the run
+ * @return True if the run is long enough, false otherwise
+ */
+static bool add_to_run(uint64_t mask, uint32_t width, size_t position, size_t length, size_t &run, size_t &run_start) {
+    // The lowest entries continue the run of the previous steps
+    auto low = static_cast<uint32_t>(std::countr_one(mask));
+    if (!run)
+        run_start = position;
+    if (run + low >= length)
+        return true;
+    if (low >= width) {
+        run += width;
+        return false;
+    }
+
+    // Runs inside the step - the bits that stay set after the mask is shifted over itself length - 1 times (in
+    // doubling steps) are the starts of the runs
+    if (length <= width) {
+        auto starts = mask;
+        size_t span = 1;
+        while (span * 2 <= length) {
+            starts &= starts >> span;
+            span *= 2;
+        }
+        starts &= starts >> (length - span);
+        if (starts) {
+            run_start = position + std::countr_zero(starts);
+            return true;
+        }
+    }
+
+    // The highest entries start the run continued by the next step
+    run = static_cast<uint32_t>(std::countl_one(mask << (64 - width)));
+    run_start = position + width - run;
+    return false;
+}
+
+uint64_t ScalarFatScanner::count(const uint32_t *entries, size_t size, uint32_t value) const {
+    uint64_t found = 0;
+    for (size_t i = 0; i < size; i++)
+        found += entries[i] == value;
+    return found;
+}
+
+void ScalarFatScanner::build_bitmap(const uint32_t *entries, size_t size, uint32_t value, uint64_t *bitmap) const {
+    std::fill(bitmap, bitmap + (size + 63) / 64, 0);
+    for (size_t i = 0; i < size; i++) {
+        if (entries[i] == value)
+            bitmap[i / 64] |= 1ULL << (i % 64);
+    }
+}
+
+size_t ScalarFatScanner::find_run(const uint32_t *entries, size_t size, uint32_t value, size_t length,
+                                  size_t start) const {
+    if (!length)
+        return std::min(start, size);
+    size_t run = 0;
+    size_t run_start = size;
+    for (size_t i = start; i < size; i++) {
+        if (entries[i] != value) {
+            run = 0;
+            continue;
+        }
+        if (!run++)
+            run_start = i;
+        if (run >= length)
+            return run_start;
+    }
+    return size;
+}
+
+void ScalarFatScanner::fill(uint32_t *entries, size_t size, uint32_t value) const {
+    std::fill(entries, entries + size, value);
+}
+
+const char *ScalarFatScanner::get_name() const {
+    return "scalar";
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+uint64_t Sse2FatScanner::count(const uint32_t *entries, size_t size, uint32_t value) const {
+    // Matching lanes are -1, subtracting them counts the matches of each lane (a lane can't overflow, the FAT has
+    // less than 2^32 entries)
+    auto target = _mm_set1_epi32(static_cast<int>(value));
+    auto counts = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 4 <= size; i += 4) {
+        auto block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(entries + i));
+        counts = _mm_sub_epi32(counts, _mm_cmpeq_epi32(block, target));
+    }
+    alignas(16) uint32_t lanes[4];
+    _mm_store_si128(reinterpret_cast<__m128i *>(lanes), counts);
+    uint64_t found = static_cast<uint64_t>(lanes[0]) + lanes[1] + lanes[2] + lanes[3];
+    for (; i < size; i++)
+        found += entries[i] == value;
+    return found;
+}
+
+__attribute__((target("sse2")))
+void Sse2FatScanner::build_bitmap(const uint32_t *entries, size_t size, uint32_t value, uint64_t *bitmap) const {
+    // Every word is put together from 16 masks of 4 entries
+    auto target = _mm_set1_epi32(static_cast<int>(value));
+    size_t i = 0;
+    for (; i + 64 <= size; i += 64) {
+        uint64_t word = 0;
+        for (uint32_t j = 0; j < 16; j++) {
+            auto block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(entries + i + j * 4));
+            auto mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(block, target)));
+            word |= static_cast<uint64_t>(mask) << (j * 4);
+        }
+        bitmap[i / 64] = word;
+    }
+    if (i < size) {
+        uint64_t word = 0;
+        for (size_t j = i; j < size; j++)
+            word |= static_cast<uint64_t>(entries[j] == value) << (j - i);
+        bitmap[i / 64] = word;
+    }
+}
+
+__attribute__((target("sse2")))
+size_t Sse2FatScanner::find_run(const uint32_t *entries, size_t size, uint32_t value, size_t length,
+                                size_t start) const {
+    if (!length)
+        return std::min(start, size);
+    auto target = _mm_set1_epi32(static_cast<int>(value));
+    size_t run = 0;
+    size_t run_start = size;
+    size_t i = start;
+    for (; i + 16 <= size; i += 16) {
+        uint64_t mask = 0;
+        for (uint32_t j = 0; j < 4; j++) {
+            auto block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(entries + i + j * 4));
+            mask |= static_cast<uint64_t>(_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(block, target)))) << (j * 4);
+        }
+        if (add_to_run(mask, 16, i, length, run, run_start))
+            return run_start;
+    }
+    for (; i < size; i++) {
+        if (add_to_run(entries[i] == value, 1, i, length, run, run_start))
+            return run_start;
+    }
+    return size;
+}
+
+__attribute__((target("sse2")))
+void Sse2FatScanner::fill(uint32_t *entries, size_t size, uint32_t value) const {
+    auto block = _mm_set1_epi32(static_cast<int>(value));
+    size_t i = 0;
+    for (; i + 4 <= size; i += 4)
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(entries + i), block);
+    for (; i < size; i++)
+        entries[i] = value;
+}
+
+const char *Sse2FatScanner::get_name() const {
+    return "sse2";
+}
+
+__attribute__((target("avx2")))
+uint64_t Avx2FatScanner::count(const uint32_t *entries, size_t size, uint32_t value) const {
+    // Four independent sums, so the comparisons of the neighbouring blocks don't wait for each other
+    auto target = _mm256_set1_epi32(static_cast<int>(value));
+    __m256i counts[4] = {_mm256_setzero_si256(), _mm256_setzero_si256(), _mm256_setzero_si256(),
+                         _mm256_setzero_si256()};
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        for (uint32_t j = 0; j < 4; j++) {
+            auto block = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(entries + i + j * 8));
+            counts[j] = _mm256_sub_epi32(counts[j], _mm256_cmpeq_epi32(block, target));
+        }
+    }
+    for (; i + 8 <= size; i += 8) {
+        auto block = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(entries + i));
+        counts[0] = _mm256_sub_epi32(counts[0], _mm256_cmpeq_epi32(block, target));
+    }
+    uint64_t found = 0;
+    alignas(32) uint32_t lanes[8];
+    for (const auto &sums: counts) {
+        _mm256_store_si256(reinterpret_cast<__m256i *>(lanes), sums);
+        for (auto lane: lanes)
+            found += lane;
+    }
+    for (; i < size; i++)
+        found += entries[i] == value;
+    return found;
+}
+
+__attribute__((target("avx2")))
+void Avx2FatScanner::build_bitmap(const uint32_t *entries, size_t size, uint32_t value, uint64_t *bitmap) const {
+    // Every word is put together from 8 masks of 8 entries
+    auto target = _mm256_set1_epi32(static_cast<int>(value));
+    size_t i = 0;
+    for (; i + 64 <= size; i += 64) {
+        uint64_t word = 0;
+        for (uint32_t j = 0; j < 8; j++) {
+            auto block = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(entries + i + j * 8));
+            auto mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(block, target)));
+            word |= static_cast<uint64_t>(mask) << (j * 8);
+        }
+        bitmap[i / 64] = word;
+    }
+    if (i < size) {
+        uint64_t word = 0;
+        for (size_t j = i; j < size; j++)
+            word |= static_cast<uint64_t>(entries[j] == value) << (j - i);
+        bitmap[i / 64] = word;
+    }
+}
+
+__attribute__((target("avx2")))
+size_t Avx2FatScanner::find_run(const uint32_t *entries, size_t size, uint32_t value, size_t length,
+                                size_t start) const {
+    if (!length)
+        return std::min(start, size);
+    auto target = _mm256_set1_epi32(static_cast<int>(value));
+    size_t run = 0;
+    size_t run_start = size;
+    size_t i = start;
+    for (; i + 32 <= size; i += 32) {
+        uint64_t mask = 0;
+        for (uint32_t j = 0; j < 4; j++) {
+            auto block = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(entries + i + j * 8));
+            mask |= static_cast<uint64_t>(_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(block, target))))
+                    << (j * 8);
+        }
+        if (add_to_run(mask, 32, i, length, run, run_start))
+            return run_start;
+    }
+    for (; i < size; i++) {
+        if (add_to_run(entries[i] == value, 1, i, length, run, run_start))
+            return run_start;
+    }
+    return size;
+}
+
+__attribute__((target("avx2")))
+void Avx2FatScanner::fill(uint32_t *entries, size_t size, uint32_t value) const {
+    auto block = _mm256_set1_epi32(static_cast<int>(value));
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8)
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(entries + i), block);
+    for (; i < size; i++)
+        entries[i] = value;
+}
+
+const char *Avx2FatScanner::get_name() const {
+    return "avx2";
+}
+#endif
+
+std::unique_ptr<FatScanner> create_fat_scanner(const std::string &type) {
+    if (type == "scalar")
+        return std::make_unique<ScalarFatScanner>();
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (type == "sse2" && __builtin_cpu_supports("sse2"))
+        return std::make_unique<Sse2FatScanner>();
+    if (type == "avx2" && __builtin_cpu_supports("avx2"))
+        return std::make_unique<Avx2FatScanner>();
+#endif
+    return nullptr;
+}
+
+std::unique_ptr<FatScanner> create_fat_scanner() {
+    for (const auto *type: {"avx2", "sse2"}) {
+        if (auto scanner = create_fat_scanner(type))
+            return scanner;
+    }
+    return std::make_unique<ScalarFatScanner>();
+}
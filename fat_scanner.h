@@ -0,0 +1,124 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <string>
+
+/**
+ * Linear scans of the in-memory FAT table (32-bit entries, the index of the next cluster or a special value)
+ * The implementations using the vector instructions are picked at runtime by what the processor supports
+ */
+class FatScanner {
+public:
+    /**
+     * Destructor
+     */
+    virtual ~FatScanner() = default;
+
+    /**
+     * Counts the entries with the given value
+     * @param entries Entries of the FAT table
+     * @param size Number of the entries
+     * @param value Value to be counted (FAT_FREE, FAT_EOF, FAT_BAD or a cluster)
+     * @return Number of the entries with the value
+     */
+    virtual uint64_t count(const uint32_t *entries, size_t size, uint32_t value) const = 0;
+
+    /**
+     * Builds the bitmap of the entries with the given value (bit set = the entry has the value), 64 entries per word
+     * @param entries Entries of the FAT table
+     * @param size Number of the entries
+     * @param value Value to be found
+     * @param bitmap Bitmap of (size + 63) / 64 words to be filled, the bits after the last entry are cleared
+     */
+    virtual void build_bitmap(const uint32_t *entries, size_t size, uint32_t value, uint64_t *bitmap) const = 0;
+
+    /**
+     * Finds the first run of consecutive entries with the given value
+     * @param entries Entries of the FAT table
+     * @param size Number of the entries
+     * @param value Value of the entries of the run
+     * @param length Smallest length of the run
+     * @param start Position where the search starts
+     * @return Position of the start of the run, or size if there is no such run
+     */
+    virtual size_t find_run(const uint32_t *entries, size_t size, uint32_t value, size_t length, size_t start) const = 0;
+
+    /**
+     * Sets all the entries to the given value
+     * @param entries Entries of the FAT table
+     * @param size Number of the entries
+     * @param value Value to be set
+     */
+    virtual void fill(uint32_t *entries, size_t size, uint32_t value) const = 0;
+
+    /**
+     * Gets the name of the scanner
+     * @return Name of the scanner
+     */
+    virtual const char *get_name() const = 0;
+};
+
+/**
+ * Scanner going through the entries one at a time (works everywhere)
+ */
+class ScalarFatScanner : public FatScanner {
+public:
+    uint64_t count(const uint32_t *entries, size_t size, uint32_t value) const override;
+
+    void build_bitmap(const uint32_t *entries, size_t size, uint32_t value, uint64_t *bitmap) const override;
+
+    size_t find_run(const uint32_t *entries, size_t size, uint32_t value, size_t length, size_t start) const override;
+
+    void fill(uint32_t *entries, size_t size, uint32_t value) const override;
+
+    const char *get_name() const override;
+};
+
+#if defined(__x86_64__) || defined(__i386__)
+/**
+ * Scanner comparing 4 entries at a time (SSE2)
+ */
+class Sse2FatScanner : public FatScanner {
+public:
+    uint64_t count(const uint32_t *entries, size_t size, uint32_t value) const override;
+
+    void build_bitmap(const uint32_t *entries, size_t size, uint32_t value, uint64_t *bitmap) const override;
+
+    size_t find_run(const uint32_t *entries, size_t size, uint32_t value, size_t length, size_t start) const override;
+
+    void fill(uint32_t *entries, size_t size, uint32_t value) const override;
+
+    const char *get_name() const override;
+};
+
+/**
+ * Scanner comparing 8 entries at a time (AVX2), only usable if the processor supports it
+ */
+class Avx2FatScanner : public FatScanner {
+public:
+    uint64_t count(const uint32_t *entries, size_t size, uint32_t value) const override;
+
+    void build_bitmap(const uint32_t *entries, size_t size, uint32_t value, uint64_t *bitmap) const override;
+
+    size_t find_run(const uint32_t *entries, size_t size, uint32_t value, size_t length, size_t start) const override;
+
+    void fill(uint32_t *entries, size_t size, uint32_t value) const override;
+
+    const char *get_name() const override;
+};
+#endif
+
+/**
+ * Creates the scanner of the given type
+ * @param type Type of the scanner ("scalar", "sse2" or "avx2")
+ * @return Created scanner, or nullptr if the type is unknown or the processor doesn't support it
+ */
+std::unique_ptr<FatScanner> create_fat_scanner(const std::string &type);
+
+/**
+ * Creates the fastest scanner the processor supports - AVX2, SSE2, or the scalar one
+ * @return Created scanner
+ */
+std::unique_ptr<FatScanner> create_fat_scanner();
@@ -1,23 +1,96 @@
 #include <memory>
 #include <iostream>
+#include <csignal>
+#include <cstdlib>
+#include <poll.h>
+#include <unistd.h>
 #include "pseudofat.h"
+#include "command_server.h"
+
+/** Set by SIGINT / SIGTERM when the server should stop */
+static volatile std::sig_atomic_t stop_requested = 0;
+
+/**
+ * Requests the stop of the server (the number of the signal isn't needed)
+ */
+static void request_stop(int) {
+    stop_requested = 1;
+}
+
+/**
+ * Checks if the next command is already waiting on the standard input (buffered or not read yet)
+ * @return True if there is input to be read, false otherwise
+ */
+static bool is_input_pending() {
+    if (std::cin.rdbuf()->in_avail() > 0)
+        return true;
+    pollfd input{STDIN_FILENO, POLLIN, 0};
+    return poll(&input, 1, 0) > 0 && (input.revents & POLLIN);
+}
 
 int main(int argc, char **argv) {
-    if (argc != 2) {
-        std::cout << "Usage: " << argv[0] << " <file system name>" << std::endl;
+    // Parse the optional arguments
+    MountOptions options;
+    std::string socket_path;
+    bool device_given = false;
+    bool valid_args = argc >= 2;
+    for (int i = 2; i < argc && valid_args; i++) {
+        std::string arg = argv[i];
+        if (arg == "--device" && i + 1 < argc) {
+            options.device_type = argv[++i];
+            device_given = true;
+        } else if (arg == "--server" && i + 1 < argc)
+            socket_path = argv[++i];
+        else if (arg == "--discard")
+            options.discard = true;
+        else if (arg == "--fsck")
+            options.check = true;
+        else if (arg == "--cache" && i + 1 < argc)
+            options.cache_size = std::strtoull(argv[++i], nullptr, 10) * MB;
+        else
+            valid_args = false;
+    }
+
+    if (!valid_args || !create_block_device(options.device_type)) {
+        std::cout << "Usage: " << argv[0] << " <file system name> [--device stream|pread|mmap] [--discard] [--cache <MB>] [--fsck] [--server <socket>]" << std::endl;
         return EXIT_FAILURE;
     }
 
-    std::unique_ptr<PseudoFS> fs = std::make_unique<PseudoFS>(argv[1]);
+    // The clients of the server read at the same time, so they shouldn't share the cursor of a stream
+    if (!socket_path.empty()) {
+        if (!device_given)
+            options.device_type = "pread";
+        std::unique_ptr<PseudoFS> fs = std::make_unique<PseudoFS>(argv[1], options);
+        CommandServer server(*fs, socket_path);
+        if (!server.start()) {
+            std::cerr << "Error listening on " << socket_path << std::endl;
+            return EXIT_FAILURE;
+        }
+
+        struct sigaction action{};
+        action.sa_handler = request_stop;
+        sigaction(SIGINT, &action, nullptr);
+        sigaction(SIGTERM, &action, nullptr);
+        std::cout << "Listening on " << socket_path << std::endl;
+        server.run(stop_requested);
+        std::cout << "Exiting..." << std::endl;
+        return EXIT_SUCCESS;
+    }
+
+    // The input is buffered by the stream itself, so the waiting commands can be seen
+    std::ios::sync_with_stdio(false);
+    std::unique_ptr<PseudoFS> fs = std::make_unique<PseudoFS>(argv[1], options);
 
     std::string token;
     std::vector<std::string> tokens;
     for (;;) {
+        // Commands waiting in the input are committed to the journal together, the rest is committed before waiting
+        if (!is_input_pending())
+            fs->commit_journal();
         std::cout << fs->get_working_directory_path() << "$ >" << std::flush;
         std::string input;
-        std::getline(std::cin, input);
-
-        if (input == "exit")
+        // The end of the input ends the shell just like exit
+        if (!std::getline(std::cin, input) || input == "exit")
             break;
 
         std::stringstream ss(input);
@@ -25,7 +98,8 @@ int main(int argc, char **argv) {
         while (std::getline(ss, token, ' '))
             tokens.push_back(token);
 
-        fs->call_cmd(tokens[0], tokens);
+        if (!tokens.empty())
+            fs->call_cmd(tokens[0], tokens);
     }
 
     std::cout << "Exiting..." << std::endl;
@@ -1,36 +1,72 @@
 #include "pseudofat.h"
 
-PseudoFS::PseudoFS(const std::string &filepath) : file_system_filepath{filepath}, meta_data{}, working_directory{},
-                                                  ROOT_DIRECTORY{} {
-    // Open the file system file
-    file_system.open(filepath, std::ios::binary | std::ios::in | std::ios::out);
-
-    // If the file doesn't exist, create it
-    if (!file_system.is_open())
-        file_system.open(filepath, std::ios::binary | std::ios::in | std::ios::out | std::ios::trunc);
-
-        // If the file existed, read the metadata
-    else {
-        file_system.read(reinterpret_cast<char *>(&meta_data), sizeof(MetaData));
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <functional>
+#include <limits>
+
+/** Session the command of the current thread runs in (nullptr in the shell) */
+static thread_local Session *current_session = nullptr;
+
+PseudoFS::PseudoFS(const std::string &filepath, const MountOptions &options)
+        : file_system_filepath{filepath}, device{create_block_device(options.device_type)}, options{options},
+          meta_data{}, working_directory{},
+          ROOT_DIRECTORY{}, fat_scanner{create_fat_scanner()}, fat_entry_size{sizeof(uint32_t)}, directory_entry_size{sizeof(DirectoryEntry)},
+          fat_dirty_low{1}, fat_dirty_high{0}, next_free_hint{0}, free_cluster_count{0},
+          refs_dirty_low{1}, refs_dirty_high{0}, journal_head{0}, journal_sequence{1}, journal_group_size{0},
+          journal_fat_low{1}, journal_fat_high{0}, journal_meta_dirty{false} {
+    // Open the file system file (it is created if it doesn't exist)
+    if (!device)
+        device = create_block_device("stream");
+    bool existed = device->open(filepath);
+
+    // If the file existed, read the metadata (again if the journal changed it)
+    if (existed && read_meta_data()) {
+        if (replay_journal())
+            read_meta_data();
+        load_fat();
         ROOT_DIRECTORY = WorkingDirectory{
                 meta_data.data_start_address,
-                "/",
-                get_directory_entries(meta_data.data_start_address)
+                "/"
         };
         working_directory = ROOT_DIRECTORY;
         EMPTY_CLUSTER = std::string(meta_data.cluster_size, '\0');
     }
 
+    // Put the cluster cache in front of the device (it stays disabled until the file system is formatted)
+    cache = std::make_unique<ClusterCache>(*device, meta_data.cluster_size, meta_data.data_start_address,
+                                           options.cache_size);
+    load_refcounts();
+    load_snapshots();
+
     // If the file still isn't open, print an error
-    if (!file_system.is_open())
-        std::cerr << "Error opening file system file" << std::endl;
+    if (!device->is_open())
+        errors() << "Error opening file system file" << std::endl;
 
     // Initialize the command map for the shell
     initialize_command_map();
+
+    // Check the file system before it is used, the repairs are committed right away
+    if (options.check && !fat_table.empty()) {
+        check_file_system(true);
+        flush_refcounts();
+        commit_transaction();
+        commit_journal();
+    }
 }
 
 PseudoFS::~PseudoFS() {
-    file_system.close();
+    // Nothing to write without a formatted file system
+    if (fat_table.empty())
+        return;
+
+    // Everything is written to its place, so the journal is empty for the next start
+    flush_refcounts();
+    commit_transaction();
+    commit_journal();
+    reset_journal();
+    device->sync();
 }
 
 void PseudoFS::initialize_command_map() {
@@ -52,57 +88,1368 @@ void PseudoFS::initialize_command_map() {
     commands["load"] = &PseudoFS::load;
     commands["format"] = &PseudoFS::format;
     commands["defrag"] = &PseudoFS::defrag;
+    commands["sync"] = &PseudoFS::sync;
+    commands["cache"] = &PseudoFS::cache_stats;
+    commands["fragstat"] = &PseudoFS::fragstat;
+    commands["snapshot"] = &PseudoFS::snapshot;
+    commands["fsck"] = &PseudoFS::fsck;
+    commands["upgrade"] = &PseudoFS::upgrade;
+
+    // Commands that only read, anything they fill on the way is guarded by cache_lock
+    read_only_commands = {"help", "meta", "fat", "ls", "cat", "cd", "pwd", "info", "outcp", "cache", "fragstat"};
+
+    // Commands reading their arguments without checking them (the others have only optional ones)
+    required_arguments = {{"cp", 3}, {"mv", 3}, {"rm", 2}, {"mkdir", 2}, {"rmdir", 2}, {"cat", 2}, {"info", 2},
+                          {"incp", 3}, {"outcp", 3}, {"load", 2}, {"format", 2}, {"defrag", 2}};
 }
 
-uint32_t PseudoFS::get_cluster_address(uint32_t cluster_index) const {
-    auto index = (cluster_index - meta_data.fat_start_address) / sizeof(uint32_t);
-    return meta_data.data_start_address + index * meta_data.cluster_size;
+bool PseudoFS::has_required_arguments(const std::string &cmd, const std::vector<std::string> &args) const {
+    auto required = required_arguments.find(cmd);
+    if (required == required_arguments.end() || args.size() >= required->second)
+        return true;
+    errors() << MISSING_ARGUMENTS << std::endl;
+    errors() << "Type 'help' for the arguments of the commands" << std::endl;
+    return false;
 }
 
-uint32_t PseudoFS::get_cluster_index(uint32_t cluster_address) const {
+WorkingDirectory &PseudoFS::current_directory() {
+    return current_session ? current_session->working_directory : working_directory;
+}
+
+const WorkingDirectory &PseudoFS::current_directory() const {
+    return current_session ? current_session->working_directory : working_directory;
+}
+
+std::ostream &PseudoFS::output() {
+    return current_session ? static_cast<std::ostream &>(current_session->output) : std::cout;
+}
+
+std::ostream &PseudoFS::errors() {
+    return current_session ? static_cast<std::ostream &>(current_session->output) : std::cerr;
+}
+
+uint64_t PseudoFS::get_cluster_address(uint64_t cluster_index) const {
+    auto index = (cluster_index - meta_data.fat_start_address) / fat_entry_size;
+    return get_data_address(index);
+}
+
+uint64_t PseudoFS::get_cluster_index(uint64_t cluster_address) const {
     auto index = (cluster_address - meta_data.data_start_address) / meta_data.cluster_size;
-    return meta_data.fat_start_address + index * sizeof(uint32_t);
+    return get_fat_index(index);
+}
+
+uint64_t PseudoFS::get_data_address(uint32_t cluster) const {
+    return meta_data.data_start_address + static_cast<uint64_t>(cluster) * meta_data.cluster_size;
+}
+
+uint64_t PseudoFS::get_fat_index(uint32_t cluster) const {
+    return meta_data.fat_start_address + static_cast<uint64_t>(cluster) * fat_entry_size;
+}
+
+uint32_t PseudoFS::get_fat_entry(uint64_t cluster_index) const {
+    return static_cast<uint32_t>((cluster_index - meta_data.fat_start_address) / fat_entry_size);
 }
 
 uint32_t PseudoFS::find_free_cluster() {
-    // Seek to the data start address and read the FAT, looking for a first free cluster
-    for (int i = 0; i < meta_data.cluster_count; i++) {
-        auto cluster = read_from_fat(meta_data.fat_start_address + i * sizeof(uint32_t));
-        if (cluster == FAT_FREE)
-            return i;
+    if (!free_cluster_count)
+        return 0;
+
+    // Scan the bitmap a word at a time, starting at the hint and wrapping around to the beginning
+    auto word_count = static_cast<uint32_t>(free_bitmap.size());
+    auto start_word = next_free_hint / 64;
+    // Ignore the clusters before the hint in the first word
+    uint64_t word = free_bitmap[start_word] & (~0ULL << (next_free_hint % 64));
+    for (uint32_t i = 0; i <= word_count; i++) {
+        auto word_index = (start_word + i) % word_count;
+        if (i)
+            word = free_bitmap[word_index];
+        if (word) {
+            auto cluster = word_index * 64 + std::countr_zero(word);
+            next_free_hint = cluster;
+            return cluster;
+        }
     }
     return 0;
 }
 
-void PseudoFS::read_from_cluster(uint32_t cluster_address, char *buffer, int size) {
-    file_system.seekp(cluster_address);
-    file_system.read(buffer, size);
+void PseudoFS::build_free_bitmap() {
+    free_bitmap.resize((fat_table.size() + 63) / 64);
+    fat_scanner->build_bitmap(fat_table.data(), fat_table.size(), FAT_FREE, free_bitmap.data());
+    free_cluster_count = 0;
+    next_free_hint = 0;
+    for (auto word: free_bitmap)
+        free_cluster_count += std::popcount(word);
 }
 
-void PseudoFS::write_to_cluster(uint32_t cluster_address, char *buffer, int size) {
-    file_system.seekp(cluster_address);
-    file_system.write(buffer, size);
+void PseudoFS::update_free_bitmap(uint32_t entry, uint32_t old_value, uint32_t new_value) {
+    if (old_value == FAT_FREE && new_value != FAT_FREE) {
+        // Clusters freed by a transaction that isn't committed yet aren't in the bitmap
+        if (free_bitmap[entry / 64] & 1ULL << (entry % 64)) {
+            free_bitmap[entry / 64] &= ~(1ULL << (entry % 64));
+            free_cluster_count--;
+        }
+    } else if (old_value != FAT_FREE && new_value == FAT_FREE) {
+        // With the journal, the old data is needed until the free is committed (the command could be lost)
+        if (has_journal()) {
+            journal_freed.push_back(entry);
+            return;
+        }
+        free_bitmap[entry / 64] |= 1ULL << (entry % 64);
+        free_cluster_count++;
+    }
 }
 
-uint32_t PseudoFS::read_from_fat(uint32_t cluster_index) {
-    uint32_t result;
-    file_system.seekp(cluster_index);
-    file_system.read(reinterpret_cast<char *>(&result), sizeof(uint32_t));
-    return result;
+std::vector<Extent> PseudoFS::find_free_runs() const {
+    std::vector<Extent> runs;
+    auto cluster_count = static_cast<uint32_t>(fat_table.size());
+    uint32_t i = 0;
+    while (i < cluster_count) {
+        // Skip the used clusters a word at a time
+        uint64_t word = free_bitmap[i / 64] >> (i % 64);
+        if (!word) {
+            i = (i / 64 + 1) * 64;
+            continue;
+        }
+        i += std::countr_zero(word);
+        if (i >= cluster_count)
+            break;
+
+        // Count the free clusters a word at a time
+        auto start = i;
+        for (;;) {
+            auto bit = i % 64;
+            auto run = static_cast<uint32_t>(std::countr_one(free_bitmap[i / 64] >> bit));
+            i += run;
+            // The run continues in the next word only if it reached the end of this one
+            if (bit + run < 64 || i >= cluster_count)
+                break;
+        }
+        runs.push_back(Extent{start, i - start});
+    }
+    return runs;
+}
+
+bool PseudoFS::allocate_clusters(uint32_t count, std::vector<Extent> &extents, bool contiguous) {
+    extents.clear();
+    if (!count || count > free_cluster_count)
+        return false;
+
+    // Best fit - the smallest run that holds all the clusters
+    auto runs = find_free_runs();
+    const Extent *best = nullptr;
+    for (const auto &run: runs) {
+        if (run.length >= count && (!best || run.length < best->length))
+            best = &run;
+    }
+
+    if (best)
+        extents.push_back(Extent{best->start, count});
+    else if (contiguous)
+        return false;
+    else {
+        // No run is big enough, take the largest runs first so the file has the fewest extents
+        std::sort(runs.begin(), runs.end(), [](const Extent &a, const Extent &b) {
+            return a.length > b.length || (a.length == b.length && a.start < b.start);
+        });
+        auto remaining = count;
+        for (const auto &run: runs) {
+            auto length = std::min(run.length, remaining);
+            extents.push_back(Extent{run.start, length});
+            remaining -= length;
+            if (!remaining)
+                break;
+        }
+        // Keep the extents in the disk order, so reading the file goes forward
+        std::sort(extents.begin(), extents.end(), [](const Extent &a, const Extent &b) {
+            return a.start < b.start;
+        });
+    }
+
+    // Chain the clusters in the FAT table
+    bool first = true;
+    uint32_t previous_cluster = 0;
+    for (const auto &extent: extents) {
+        for (uint32_t i = extent.start; i < extent.start + extent.length; i++) {
+            if (!first)
+                set_fat_entry(previous_cluster, i);
+            set_fat_entry(i, FAT_EOF);
+            previous_cluster = i;
+            first = false;
+        }
+    }
+    next_free_hint = extents.back().start + extents.back().length;
+    if (next_free_hint >= fat_table.size())
+        next_free_hint = 0;
+    return true;
+}
+
+void PseudoFS::release_clusters(const std::vector<Extent> &extents, bool secure) {
+    std::vector<char> zeroes(secure ? COPY_BUFFER_SIZE : 0, '\0');
+    for (const auto &extent: extents) {
+        auto address = get_data_address(extent.start);
+        auto extent_bytes = static_cast<uint64_t>(extent.length) * meta_data.cluster_size;
+        // Overwrite the whole extent in big chunks (the zeroes go to the device right away)
+        if (secure) {
+            for (uint64_t offset = 0; offset < extent_bytes; offset += zeroes.size())
+                write_to_cluster(address + offset, zeroes.data(),
+                                 std::min<uint64_t>(zeroes.size(), extent_bytes - offset));
+            cache->flush_range(address, extent_bytes);
+        }
+        // Cached data of the freed clusters is never needed again (with the journal, the space is given back after
+        // the commit)
+        cache->invalidate(address, extent_bytes);
+        if (options.discard && !has_journal())
+            device->discard(address, extent_bytes);
+    }
+}
+
+void PseudoFS::free_allocated_clusters(const std::vector<Extent> &extents) {
+    for (const auto &extent: extents) {
+        for (uint32_t i = extent.start; i < extent.start + extent.length; i++)
+            write_to_fat(get_fat_index(i), FAT_FREE);
+    }
+    release_clusters(extents, false);
+}
+
+bool PseudoFS::has_space_for(uint64_t size, uint64_t directory) {
+    // Files always take one more cluster than the whole clusters of data, the directory has to be checked before it
+    // grows (a directory grown for a file that doesn't fit would keep the cluster)
+    uint64_t needed = size / meta_data.cluster_size + 1;
+    if (directory && get_directory_index(directory).free_slots.empty())
+        needed++;
+    if (needed > free_cluster_count) {
+        errors() << NO_SPACE << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void PseudoFS::read_from_cluster(uint64_t cluster_address, char *buffer, size_t size) {
+    // Reads within one cluster go through the cache, bigger ones go straight to the device
+    std::lock_guard<std::recursive_mutex> guard(cache_lock);
+    if (cache->is_within_cluster(cluster_address, size)) {
+        cache->read(cluster_address, buffer, size);
+        return;
+    }
+    cache->flush_range(cluster_address, size);
+    device->read(cluster_address, buffer, size);
+}
+
+void PseudoFS::write_to_cluster(uint64_t cluster_address, char *buffer, size_t size) {
+    // Writes within one cluster go through the cache, bigger ones go straight to the device
+    if (cache->is_within_cluster(cluster_address, size)) {
+        cache->write(cluster_address, buffer, size);
+        return;
+    }
+    device->write(cluster_address, buffer, size);
+    cache->invalidate(cluster_address, size);
+}
+
+void PseudoFS::write_metadata(uint64_t address, char *buffer, size_t size) {
+    if (!has_journal()) {
+        write_to_cluster(address, buffer, size);
+        return;
+    }
+    cache->write(address, buffer, size, true);
+    journal_clusters.insert(address - (address - meta_data.data_start_address) % meta_data.cluster_size);
+}
+
+const char *PseudoFS::view_file_cluster(uint64_t cluster_address) {
+    // Follow the FAT chain only if the cluster has to be read anyway
+    std::vector<uint64_t> read_ahead;
+    if (!cache->is_cached(cluster_address)) {
+        auto next = fat_table[get_fat_entry(get_cluster_index(cluster_address))];
+        while (read_ahead.size() < READ_AHEAD_CLUSTERS && next < fat_table.size()) {
+            read_ahead.push_back(get_data_address(next));
+            next = fat_table[next];
+        }
+    }
+    return cache->get(cluster_address, read_ahead);
+}
+
+const char *PseudoFS::view_data(uint64_t address, size_t size) {
+    auto data = device->view(address, size);
+    if (data) {
+        std::lock_guard<std::recursive_mutex> guard(cache_lock);
+        cache->flush_range(address, size);
+    }
+    return data;
+}
+
+void PseudoFS::submit_cluster_io(const std::vector<IoRequest> &requests) {
+    // Only the cache is locked, the batches of the sessions are in flight at the same time
+    {
+        std::lock_guard<std::recursive_mutex> guard(cache_lock);
+        for (const auto &request: requests) {
+            if (!request.write)
+                cache->flush_range(request.offset, request.size);
+        }
+    }
+    device->submit(requests);
+    std::lock_guard<std::recursive_mutex> guard(cache_lock);
+    for (const auto &request: requests) {
+        if (request.write)
+            cache->invalidate(request.offset, request.size);
+    }
+}
+
+bool PseudoFS::copy_clusters(const std::vector<ClusterCopy> &copies) {
+    auto cluster_size = meta_data.cluster_size;
+    for (const auto &copy: copies)
+        cache->flush_range(get_data_address(copy.source), static_cast<uint64_t>(copy.length) * cluster_size);
+
+    // The copies the device can't do by itself go through the buffer - the pieces filling the buffer are read in one
+    // batch and written in another one (the buffer is allocated only if it is needed)
+    std::unique_ptr<char, decltype(&std::free)> buffer(nullptr, &std::free);
+    auto buffer_clusters = std::max<uint32_t>(1, COPY_BUFFER_SIZE / cluster_size);
+    std::vector<IoRequest> reads;
+    std::vector<IoRequest> writes;
+    uint32_t buffered = 0;
+    auto write_buffer = [&]() {
+        device->submit(reads);
+        device->submit(writes);
+        reads.clear();
+        writes.clear();
+        buffered = 0;
+    };
+    for (const auto &copy: copies) {
+        if (device->copy(get_data_address(copy.source), get_data_address(copy.destination),
+                         static_cast<uint64_t>(copy.length) * cluster_size))
+            continue;
+        if (!buffer) {
+            buffer.reset(static_cast<char *>(std::aligned_alloc(COPY_BUFFER_ALIGNMENT, buffer_clusters * cluster_size)));
+            if (!buffer) {
+                errors() << NO_MEMORY << std::endl;
+                return false;
+            }
+        }
+        for (uint32_t done = 0; done < copy.length;) {
+            auto length = std::min(copy.length - done, buffer_clusters - buffered);
+            auto data = buffer.get() + static_cast<uint64_t>(buffered) * cluster_size;
+            auto size = static_cast<size_t>(length) * cluster_size;
+            reads.push_back(IoRequest{false, get_data_address(copy.source + done), data, size});
+            writes.push_back(IoRequest{true, get_data_address(copy.destination + done), data, size});
+            buffered += length;
+            done += length;
+            if (buffered == buffer_clusters)
+                write_buffer();
+        }
+    }
+    if (buffered)
+        write_buffer();
+
+    for (const auto &copy: copies)
+        cache->invalidate(get_data_address(copy.destination), static_cast<uint64_t>(copy.length) * cluster_size);
+    return true;
+}
+
+uint64_t PseudoFS::read_from_fat(uint64_t cluster_index) {
+    return get_value_address(fat_table[get_fat_entry(cluster_index)]);
+}
+
+void PseudoFS::write_to_fat(uint64_t cluster_index, uint64_t value) {
+    set_fat_entry(get_fat_entry(cluster_index), get_fat_value(value));
+}
+
+uint32_t PseudoFS::get_fat_value(uint64_t cluster_address) const {
+    // Special values are negative, as 64-bit values they are the highest ones
+    if (cluster_address >= static_cast<uint64_t>(static_cast<int64_t>(FAT_BAD)))
+        return static_cast<uint32_t>(cluster_address);
+    if (cluster_address < meta_data.data_start_address ||
+        (cluster_address - meta_data.data_start_address) % meta_data.cluster_size)
+        return meta_data.cluster_count;
+    return static_cast<uint32_t>(std::min<uint64_t>((cluster_address - meta_data.data_start_address) / meta_data.cluster_size,
+                                                    meta_data.cluster_count));
+}
+
+uint64_t PseudoFS::get_value_address(uint32_t value) const {
+    if (value >= static_cast<uint32_t>(FAT_BAD))
+        return static_cast<uint64_t>(static_cast<int64_t>(static_cast<int32_t>(value)));
+    return get_data_address(value);
+}
+
+void PseudoFS::set_fat_entry(uint32_t entry, uint32_t value) {
+    if (fat_table[entry] == value)
+        return;
+    update_free_bitmap(entry, fat_table[entry], value);
+    fat_table[entry] = value;
+
+    // Remember the change, it will be written to the disk with the next flush (or with the next transaction)
+    auto &dirty = has_journal() ? journal_fat_dirty : fat_dirty;
+    auto &dirty_low = has_journal() ? journal_fat_low : fat_dirty_low;
+    auto &dirty_high = has_journal() ? journal_fat_high : fat_dirty_high;
+    dirty[entry] = true;
+    if (dirty_low > dirty_high) {
+        dirty_low = entry;
+        dirty_high = entry;
+    } else {
+        dirty_low = std::min(dirty_low, entry);
+        dirty_high = std::max(dirty_high, entry);
+    }
+}
+
+bool PseudoFS::read_meta_data() {
+    char buffer[METADATA_SIZE]{};
+    device->read(0, buffer, METADATA_SIZE);
+
+    // Versioned layout
+    if (std::strncmp(buffer, SIGNATURE, sizeof(MetaData::signature)) == 0) {
+        std::memcpy(&meta_data, buffer, sizeof(MetaData));
+        fat_entry_size = meta_data.version >= 3 ? sizeof(uint32_t) : sizeof(uint64_t);
+        directory_entry_size = sizeof(DirectoryEntry);
+        return true;
+    }
+
+    // Original layout, widen the values
+    if (std::strncmp(buffer, SIGNATURE_V1, sizeof(MetaDataV1::signature)) == 0) {
+        MetaDataV1 old_meta_data{};
+        std::memcpy(&old_meta_data, buffer, sizeof(MetaDataV1));
+        meta_data = MetaData{
+                "",
+                1,
+                old_meta_data.disk_size,
+                old_meta_data.cluster_size,
+                old_meta_data.cluster_count,
+                old_meta_data.fat_start_address,
+                old_meta_data.fat_size,
+                old_meta_data.data_start_address
+        };
+        std::memcpy(meta_data.signature, old_meta_data.signature, sizeof(MetaData::signature));
+        fat_entry_size = sizeof(uint32_t);
+        directory_entry_size = sizeof(DirectoryEntryV1);
+        return true;
+    }
+
+    return false;
+}
+
+void PseudoFS::write_meta_data() {
+    if (meta_data.version == 1) {
+        MetaDataV1 old_meta_data{
+                "",
+                static_cast<uint32_t>(meta_data.disk_size),
+                meta_data.cluster_size,
+                meta_data.cluster_count,
+                static_cast<uint32_t>(meta_data.fat_start_address),
+                static_cast<uint32_t>(meta_data.fat_size),
+                static_cast<uint32_t>(meta_data.data_start_address)
+        };
+        std::memcpy(old_meta_data.signature, SIGNATURE_V1, sizeof(MetaDataV1::signature));
+        device->write(0, reinterpret_cast<const char *>(&old_meta_data), sizeof(MetaDataV1));
+        return;
+    }
+
+    if (has_journal()) {
+        journal_meta_dirty = true;
+        return;
+    }
+
+    // The rest of the meta data block is reserved (zeroes)
+    char buffer[METADATA_SIZE]{};
+    std::memcpy(buffer, &meta_data, sizeof(MetaData));
+    device->write(0, buffer, METADATA_SIZE);
+}
+
+DirectoryEntry PseudoFS::decode_directory_entry(const char *data) const {
+    DirectoryEntry entry{};
+    if (meta_data.version == 1) {
+        DirectoryEntryV1 old_entry{};
+        std::memcpy(&old_entry, data, sizeof(DirectoryEntryV1));
+        std::memcpy(entry.item_name, old_entry.item_name, DEFAULT_FILE_NAME_LENGTH);
+        entry.is_directory = old_entry.is_directory;
+        entry.size = old_entry.size;
+        entry.start_cluster = old_entry.start_cluster;
+    } else
+        std::memcpy(&entry, data, sizeof(DirectoryEntry));
+
+    // Since the version 3 the entry points to the cluster index (the root directory is the cluster 0, so the
+    // empty slots are the ones without a name)
+    if (meta_data.version >= 3)
+        entry.start_cluster = entry.item_name[0] ? meta_data.data_start_address +
+                                                   entry.start_cluster * meta_data.cluster_size : 0;
+    return entry;
+}
+
+void PseudoFS::encode_directory_entry(const DirectoryEntry &entry, char *data) const {
+    if (meta_data.version == 1) {
+        DirectoryEntryV1 old_entry{};
+        std::memcpy(old_entry.item_name, entry.item_name, DEFAULT_FILE_NAME_LENGTH);
+        old_entry.is_directory = entry.is_directory;
+        old_entry.size = static_cast<uint32_t>(entry.size);
+        old_entry.start_cluster = static_cast<uint32_t>(entry.start_cluster);
+        std::memcpy(data, &old_entry, sizeof(DirectoryEntryV1));
+    } else if (meta_data.version >= 3) {
+        auto stored_entry = entry;
+        if (entry.start_cluster)
+            stored_entry.start_cluster = (entry.start_cluster - meta_data.data_start_address) / meta_data.cluster_size;
+        std::memcpy(data, &stored_entry, sizeof(DirectoryEntry));
+    } else
+        std::memcpy(data, &entry, sizeof(DirectoryEntry));
+}
+
+uint64_t PseudoFS::parse_size(const std::string &text) {
+    // Text that isn't a number gives zero (rejected by the callers) instead of throwing
+    uint64_t size = std::strtoull(text.c_str(), nullptr, 10);
+    if (text.find('K') != std::string::npos)
+        size *= KB;
+    else if (text.find('M') != std::string::npos)
+        size *= MB;
+    else if (text.find('G') != std::string::npos)
+        size *= GB;
+    return size;
+}
+
+void PseudoFS::load_fat() {
+    // Only the entries that fit into the FAT on the disk are backed by it (older images could have more clusters)
+    auto stored_entries = static_cast<uint32_t>(std::min<uint64_t>(meta_data.cluster_count,
+                                                                   meta_data.fat_size / fat_entry_size));
+    fat_table.resize(meta_data.cluster_count);
+    fat_scanner->fill(fat_table.data(), fat_table.size(), FAT_BAD);
+    fat_dirty.assign(meta_data.cluster_count, false);
+    fat_dirty_low = 1;
+    fat_dirty_high = 0;
+    journal_fat_dirty.assign(meta_data.cluster_count, false);
+    journal_fat_low = 1;
+    journal_fat_high = 0;
+
+    // Read the whole FAT in one go, since the version 3 it is stored just like it is kept in the memory
+    if (meta_data.version >= 3)
+        device->read(meta_data.fat_start_address, reinterpret_cast<char *>(fat_table.data()),
+                     stored_entries * sizeof(uint32_t));
+    else if (fat_entry_size == sizeof(uint64_t)) {
+        // Version 2 has the 64-bit cluster addresses
+        std::vector<uint64_t> stored_table(stored_entries);
+        device->read(meta_data.fat_start_address, reinterpret_cast<char *>(stored_table.data()),
+                     stored_entries * sizeof(uint64_t));
+        for (uint32_t i = 0; i < stored_entries; i++)
+            fat_table[i] = get_fat_value(stored_table[i]);
+    } else {
+        // Original layout has 32-bit cluster addresses, the special values (free, EOF, bad) are negative
+        std::vector<uint32_t> stored_table(stored_entries);
+        device->read(meta_data.fat_start_address, reinterpret_cast<char *>(stored_table.data()),
+                     stored_entries * sizeof(uint32_t));
+        for (uint32_t i = 0; i < stored_entries; i++)
+            fat_table[i] = get_fat_value(static_cast<uint64_t>(static_cast<int64_t>(static_cast<int32_t>(stored_table[i]))));
+    }
+
+    build_free_bitmap();
+}
+
+void PseudoFS::flush_fat() {
+    if (fat_dirty_low > fat_dirty_high || !device->is_open())
+        return;
+
+    // Write runs of dirty entries, runs separated by only a few clean entries are merged into one write
+    std::vector<char> encoded;
+    uint32_t i = fat_dirty_low;
+    while (i <= fat_dirty_high) {
+        if (!fat_dirty[i]) {
+            i++;
+            continue;
+        }
+        uint32_t run_start = i;
+        uint32_t run_end = i;
+        for (uint32_t j = i + 1; j <= fat_dirty_high && j - run_end <= FAT_FLUSH_GAP; j++) {
+            if (fat_dirty[j])
+                run_end = j;
+        }
+        for (uint32_t j = run_start; j <= run_end; j++)
+            fat_dirty[j] = false;
+
+        encode_fat_entries(run_start, run_end - run_start + 1, encoded);
+        device->write(get_fat_index(run_start), encoded.data(), encoded.size());
+        i = run_end + 1;
+    }
+
+    fat_dirty_low = 1;
+    fat_dirty_high = 0;
+}
+
+void PseudoFS::encode_fat_entries(uint32_t first, uint32_t count, std::vector<char> &data) const {
+    data.resize(static_cast<uint64_t>(count) * fat_entry_size);
+    if (meta_data.version >= 3) {
+        std::memcpy(data.data(), &fat_table[first], data.size());
+        return;
+    }
+
+    // Older layouts store the cluster addresses (the original one only their lower 32 bits)
+    for (uint32_t i = 0; i < count; i++) {
+        auto address = get_value_address(fat_table[first + i]);
+        if (fat_entry_size == sizeof(uint64_t))
+            std::memcpy(&data[i * sizeof(uint64_t)], &address, sizeof(uint64_t));
+        else {
+            auto narrow_address = static_cast<uint32_t>(address);
+            std::memcpy(&data[i * sizeof(uint32_t)], &narrow_address, sizeof(uint32_t));
+        }
+    }
+}
+
+bool PseudoFS::has_journal() const {
+    return meta_data.version != 1 && meta_data.journal_size > JOURNAL_HEADER_SIZE;
+}
+
+uint64_t PseudoFS::compute_checksum(const char *data, size_t size) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= static_cast<unsigned char>(data[i]);
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+bool PseudoFS::replay_journal() {
+    journal_head = 0;
+    journal_sequence = 1;
+    journal_group.clear();
+    journal_group_size = 0;
+    journal_freed.clear();
+    journal_logged.clear();
+    if (!has_journal())
+        return false;
+
+    // A journal without a valid header was never used
+    JournalHeader header{};
+    device->read(meta_data.journal_address, reinterpret_cast<char *>(&header), sizeof(JournalHeader));
+    if (std::strncmp(header.signature, JOURNAL_SIGNATURE, sizeof(JournalHeader::signature)) != 0) {
+        reset_journal();
+        return false;
+    }
+
+    // Replay the transactions one after another, the first one that is torn (or left from before the journal was
+    // last emptied) ends the journal
+    std::vector<char> journal(meta_data.journal_size - JOURNAL_HEADER_SIZE);
+    device->read(meta_data.journal_address + JOURNAL_HEADER_SIZE, journal.data(), journal.size());
+    auto sequence = header.sequence;
+    uint64_t offset = 0;
+    uint32_t replayed = 0;
+    while (offset + sizeof(JournalTransaction) <= journal.size()) {
+        JournalTransaction transaction{};
+        std::memcpy(&transaction, &journal[offset], sizeof(JournalTransaction));
+        if ((transaction.magic != JOURNAL_TRANSACTION_MAGIC && transaction.magic != JOURNAL_STAGED_MAGIC) ||
+            transaction.sequence != sequence || transaction.size < sizeof(JournalTransaction) ||
+            transaction.size > journal.size() - offset)
+            break;
+        std::memset(&journal[offset + offsetof(JournalTransaction, checksum)], 0, sizeof(uint64_t));
+        if (compute_checksum(&journal[offset], transaction.size) != transaction.checksum)
+            break;
+        if (transaction.magic == JOURNAL_STAGED_MAGIC) {
+            std::vector<char> staged;
+            if (!read_staged_transaction(&journal[offset], staged))
+                break;
+            apply_journal_transactions(staged.data(), staged.size());
+        } else
+            apply_journal_transactions(&journal[offset], transaction.size);
+        offset += transaction.size;
+        sequence++;
+        replayed++;
+    }
+
+    // New transactions continue after the replayed ones
+    journal_head = offset;
+    journal_sequence = sequence;
+    if (!replayed)
+        return false;
+    device->sync();
+    output() << "Journal: " << replayed << " transaction(s) replayed" << std::endl;
+    return true;
+}
+
+void PseudoFS::apply_journal_transactions(const char *data, uint64_t size) {
+    uint64_t offset = 0;
+    while (offset < size) {
+        JournalTransaction transaction{};
+        std::memcpy(&transaction, data + offset, sizeof(JournalTransaction));
+        auto block_offset = offset + sizeof(JournalTransaction);
+        for (uint32_t i = 0; i < transaction.block_count; i++) {
+            JournalBlock block{};
+            std::memcpy(&block, data + block_offset, sizeof(JournalBlock));
+            device->write(block.address, data + block_offset + sizeof(JournalBlock), block.size);
+            block_offset += sizeof(JournalBlock) + block.size;
+        }
+        offset += transaction.size;
+    }
+}
+
+bool PseudoFS::read_staged_transaction(const char *record, std::vector<char> &transaction) {
+    JournalTransaction header{};
+    std::memcpy(&header, record, sizeof(JournalTransaction));
+    if (header.size < sizeof(JournalTransaction) + static_cast<uint64_t>(header.block_count) * sizeof(JournalBlock))
+        return false;
+
+    // Parts of the transaction one after another
+    transaction.clear();
+    auto block_offset = sizeof(JournalTransaction);
+    for (uint32_t i = 0; i < header.block_count; i++) {
+        JournalBlock block{};
+        std::memcpy(&block, record + block_offset, sizeof(JournalBlock));
+        if (block.address + block.size > meta_data.disk_size)
+            return false;
+        auto offset = transaction.size();
+        transaction.resize(offset + block.size);
+        device->read(block.address, &transaction[offset], block.size);
+        block_offset += sizeof(JournalBlock);
+    }
+
+    // The record is written together with the transaction, a crash can leave it without the whole transaction
+    JournalTransaction staged{};
+    if (transaction.size() < sizeof(JournalTransaction))
+        return false;
+    std::memcpy(&staged, transaction.data(), sizeof(JournalTransaction));
+    if (staged.magic != JOURNAL_TRANSACTION_MAGIC || staged.sequence + 1 != header.sequence ||
+        staged.size != transaction.size())
+        return false;
+    std::memset(&transaction[offsetof(JournalTransaction, checksum)], 0, sizeof(uint64_t));
+    return compute_checksum(transaction.data(), transaction.size()) == staged.checksum;
+}
+
+bool PseudoFS::plan_staging(uint64_t size, std::vector<char> &record) const {
+    // The transaction goes to the clusters free before and after it (a lost transaction overwrites nothing needed),
+    // only the record of where its parts are goes to the journal
+    record.assign(sizeof(JournalTransaction), 0);
+    uint64_t staged = 0;
+    for (const auto &run: find_free_runs()) {
+        if (staged == size)
+            break;
+        JournalBlock block{get_data_address(run.start),
+                           std::min<uint64_t>(static_cast<uint64_t>(run.length) * meta_data.cluster_size, size - staged)};
+        auto offset = record.size();
+        record.resize(offset + sizeof(JournalBlock));
+        std::memcpy(&record[offset], &block, sizeof(JournalBlock));
+        staged += block.size;
+    }
+    return staged == size && record.size() <= meta_data.journal_size - JOURNAL_HEADER_SIZE;
+}
+
+bool PseudoFS::stage_transaction(const std::vector<char> &transaction) {
+    std::vector<char> record;
+    if (!plan_staging(transaction.size(), record))
+        return false;
+    auto block_count = static_cast<uint32_t>((record.size() - sizeof(JournalTransaction)) / sizeof(JournalBlock));
+
+    // The transaction got the sequence number before the journal was emptied, the record gets the next one
+    JournalTransaction header{JOURNAL_STAGED_MAGIC, block_count, journal_sequence++, record.size(), 0};
+    std::memcpy(record.data(), &header, sizeof(JournalTransaction));
+    header.checksum = compute_checksum(record.data(), record.size());
+    std::memcpy(record.data(), &header, sizeof(JournalTransaction));
+
+    // The parts and the record with one sync (the replay checks the parts were written whole)
+    uint64_t staged = 0;
+    for (uint32_t i = 0; i < block_count; i++) {
+        JournalBlock block{};
+        std::memcpy(&block, &record[sizeof(JournalTransaction) + i * sizeof(JournalBlock)], sizeof(JournalBlock));
+        device->write(block.address, transaction.data() + staged, block.size);
+        staged += block.size;
+    }
+    device->write(meta_data.journal_address + JOURNAL_HEADER_SIZE + journal_head, record.data(), record.size());
+    device->sync();
+    journal_head += record.size();
+    return true;
+}
+
+std::vector<char> PseudoFS::build_transaction() {
+    std::vector<char> transaction(sizeof(JournalTransaction));
+    uint32_t block_count = 0;
+    auto add_block = [&](uint64_t address, const char *data, uint64_t size) {
+        JournalBlock block{address, size};
+        auto offset = transaction.size();
+        transaction.resize(offset + sizeof(JournalBlock) + size);
+        std::memcpy(&transaction[offset], &block, sizeof(JournalBlock));
+        std::memcpy(&transaction[offset + sizeof(JournalBlock)], data, size);
+        block_count++;
+    };
+
+    // Runs of the changed FAT entries, runs separated by only a few unchanged entries are merged into one block
+    std::vector<char> encoded;
+    uint32_t i = journal_fat_low;
+    while (i <= journal_fat_high) {
+        if (!journal_fat_dirty[i]) {
+            i++;
+            continue;
+        }
+        uint32_t run_start = i;
+        uint32_t run_end = i;
+        for (uint32_t j = i + 1; j <= journal_fat_high && j - run_end <= FAT_FLUSH_GAP; j++) {
+            if (journal_fat_dirty[j])
+                run_end = j;
+        }
+        for (uint32_t j = run_start; j <= run_end; j++)
+            journal_fat_dirty[j] = false;
+        encode_fat_entries(run_start, run_end - run_start + 1, encoded);
+        add_block(get_fat_index(run_start), encoded.data(), encoded.size());
+        i = run_end + 1;
+    }
+    journal_fat_low = 1;
+    journal_fat_high = 0;
+
+    // Whole metadata clusters (the freed ones were thrown out of the cache and aren't needed)
+    for (auto cluster_address: journal_clusters) {
+        if (!cache->is_cached(cluster_address))
+            continue;
+        add_block(cluster_address, cache->get(cluster_address), meta_data.cluster_size);
+        journal_logged.insert(get_fat_entry(get_cluster_index(cluster_address)));
+    }
+    journal_clusters.clear();
+
+    if (journal_meta_dirty) {
+        char buffer[METADATA_SIZE]{};
+        std::memcpy(buffer, &meta_data, sizeof(MetaData));
+        add_block(0, buffer, METADATA_SIZE);
+        journal_meta_dirty = false;
+    }
+
+    if (!block_count)
+        return {};
+    JournalTransaction header{JOURNAL_TRANSACTION_MAGIC, block_count, journal_sequence++, transaction.size(), 0};
+    std::memcpy(transaction.data(), &header, sizeof(JournalTransaction));
+    header.checksum = compute_checksum(transaction.data(), transaction.size());
+    std::memcpy(transaction.data(), &header, sizeof(JournalTransaction));
+    return transaction;
+}
+
+void PseudoFS::commit_transaction() {
+    if (!has_journal()) {
+        // Write back the data and FAT changes made by the command (the data first, so the FAT never points to
+        // clusters that weren't written yet)
+        cache->flush();
+        flush_fat();
+        return;
+    }
+
+    auto transaction = build_transaction();
+    auto capacity = meta_data.journal_size - JOURNAL_HEADER_SIZE;
+    if (transaction.size() > capacity) {
+        // The transaction doesn't fit into the journal at all, it is staged in the free clusters (after the
+        // transactions before it are in their places) and written to its place right away
+        write_journal_group();
+        reset_journal();
+        cache->flush();
+        if (!stage_transaction(transaction))
+            errors() << NOT_ATOMIC << std::endl;
+        apply_journal_transactions(transaction.data(), transaction.size());
+        reset_journal();
+    } else if (!transaction.empty()) {
+        // The journal is full, the transactions in it are written to their places and it starts from the beginning
+        if (journal_head + journal_group.size() + transaction.size() > capacity) {
+            write_journal_group();
+            reset_journal();
+        }
+        journal_group.insert(journal_group.end(), transaction.begin(), transaction.end());
+        journal_group_size++;
+    }
+
+    // Freed clusters can be reused only after the commit, so the commands freeing clusters aren't kept waiting
+    if (!journal_freed.empty() || journal_group_size >= JOURNAL_GROUP_COMMANDS)
+        commit_journal();
+}
+
+void PseudoFS::write_journal_group() {
+    if (journal_group.empty())
+        return;
+
+    // The file data goes first, then all the transactions with one sync, then the changes to their places (they
+    // are made durable by the sync before the journal is emptied)
+    cache->flush();
+    device->write(meta_data.journal_address + JOURNAL_HEADER_SIZE + journal_head, journal_group.data(),
+                  journal_group.size());
+    device->sync();
+    apply_journal_transactions(journal_group.data(), journal_group.size());
+    journal_head += journal_group.size();
+    journal_group.clear();
+    journal_group_size = 0;
+}
+
+void PseudoFS::commit_journal() {
+    if (!has_journal())
+        return;
+    write_journal_group();
+
+    // All the changes are in their places, the metadata clusters don't have to stay in the cache anymore
+    cache->release_pinned();
+
+    // Freed metadata clusters could be reused for file data, replaying their old content would overwrite it
+    bool logged_freed = false;
+    for (auto cluster: journal_freed)
+        logged_freed = logged_freed || journal_logged.count(cluster);
+    if (logged_freed)
+        reset_journal();
+
+    // The frees are durable, the clusters can be reused (and their space given back)
+    std::vector<Extent> released;
+    for (auto cluster: journal_freed) {
+        if (fat_table[cluster] != FAT_FREE || free_bitmap[cluster / 64] & 1ULL << (cluster % 64))
+            continue;
+        free_bitmap[cluster / 64] |= 1ULL << (cluster % 64);
+        free_cluster_count++;
+        if (!released.empty() && released.back().start + released.back().length == cluster)
+            released.back().length++;
+        else
+            released.push_back(Extent{cluster, 1});
+    }
+    journal_freed.clear();
+    if (options.discard) {
+        for (const auto &extent: released)
+            device->discard(get_data_address(extent.start), static_cast<uint64_t>(extent.length) * meta_data.cluster_size);
+    }
+}
+
+void PseudoFS::reset_journal() {
+    if (!has_journal())
+        return;
+    device->sync();
+    char buffer[JOURNAL_HEADER_SIZE]{};
+    JournalHeader header{"", journal_sequence};
+    std::memcpy(header.signature, JOURNAL_SIGNATURE, sizeof(JournalHeader::signature));
+    std::memcpy(buffer, &header, sizeof(JournalHeader));
+    device->write(meta_data.journal_address, buffer, JOURNAL_HEADER_SIZE);
+    device->sync();
+    journal_head = 0;
+    journal_logged.clear();
+}
+
+void PseudoFS::load_refcounts() {
+    cluster_refs.clear();
+    refcount_clusters.clear();
+    refs_dirty_low = 1;
+    refs_dirty_high = 0;
+    if (meta_data.version == 1 || !meta_data.refcount_address)
+        return;
+
+    // Follow the hidden chain of the table and read it cluster by cluster
+    cluster_refs.assign(meta_data.cluster_count, 0);
+    auto table = reinterpret_cast<char *>(cluster_refs.data());
+    auto table_size = cluster_refs.size() * sizeof(uint16_t);
+    auto cluster_address = meta_data.refcount_address;
+    for (uint64_t offset = 0; offset < table_size; offset += meta_data.cluster_size) {
+        if (cluster_address == FAT_EOF || cluster_address == FAT_FREE || cluster_address == FAT_BAD)
+            break;
+        refcount_clusters.push_back(get_fat_entry(get_cluster_index(cluster_address)));
+        read_from_cluster(cluster_address, table + offset, std::min<uint64_t>(meta_data.cluster_size, table_size - offset));
+        cluster_address = read_from_fat(get_cluster_index(cluster_address));
+    }
+}
+
+void PseudoFS::flush_refcounts() {
+    if (refs_dirty_low > refs_dirty_high || refcount_clusters.empty())
+        return;
+
+    // Write the part of each cluster of the table that covers the dirty counts
+    auto table = reinterpret_cast<char *>(cluster_refs.data());
+    auto offset = static_cast<uint64_t>(refs_dirty_low) * sizeof(uint16_t);
+    auto end = (static_cast<uint64_t>(refs_dirty_high) + 1) * sizeof(uint16_t);
+    while (offset < end) {
+        auto cluster_offset = offset % meta_data.cluster_size;
+        auto size = std::min<uint64_t>(meta_data.cluster_size - cluster_offset, end - offset);
+        write_metadata(get_data_address(refcount_clusters[offset / meta_data.cluster_size]) + cluster_offset,
+                         table + offset, size);
+        offset += size;
+    }
+
+    refs_dirty_low = 1;
+    refs_dirty_high = 0;
+}
+
+void PseudoFS::mark_refcounts_dirty(uint32_t first, uint32_t last) {
+    if (refs_dirty_low > refs_dirty_high) {
+        refs_dirty_low = first;
+        refs_dirty_high = last;
+        return;
+    }
+    refs_dirty_low = std::min(refs_dirty_low, first);
+    refs_dirty_high = std::max(refs_dirty_high, last);
+}
+
+bool PseudoFS::create_refcount_table() {
+    if (!refcount_clusters.empty())
+        return true;
+    if (meta_data.version == 1) {
+        errors() << NOT_SUPPORTED << std::endl;
+        return false;
+    }
+
+    // Two bytes per cluster, the chain doesn't have to be contiguous
+    auto table_size = static_cast<uint64_t>(meta_data.cluster_count) * sizeof(uint16_t);
+    auto count = static_cast<uint32_t>((table_size + meta_data.cluster_size - 1) / meta_data.cluster_size);
+    std::vector<Extent> extents;
+    if (!allocate_clusters(count, extents)) {
+        errors() << NO_SPACE << std::endl;
+        return false;
+    }
+    for (const auto &extent: extents) {
+        for (uint32_t i = extent.start; i < extent.start + extent.length; i++)
+            refcount_clusters.push_back(i);
+    }
+
+    // All the counts are zero, the whole table is written with the next flush
+    cluster_refs.assign(meta_data.cluster_count, 0);
+    refs_dirty_low = 0;
+    refs_dirty_high = meta_data.cluster_count - 1;
+    meta_data.refcount_address = get_data_address(refcount_clusters[0]);
+    write_meta_data();
+    return true;
+}
+
+bool PseudoFS::share_clusters(const std::vector<Extent> &extents) {
+    if (!create_refcount_table())
+        return false;
+
+    // Check all the counts first, so nothing is changed if one of them is full
+    for (const auto &extent: extents) {
+        for (uint32_t i = extent.start; i < extent.start + extent.length; i++) {
+            if (cluster_refs[i] == std::numeric_limits<uint16_t>::max()) {
+                errors() << TOO_MANY_REFERENCES << std::endl;
+                return false;
+            }
+        }
+    }
+    for (const auto &extent: extents) {
+        for (uint32_t i = extent.start; i < extent.start + extent.length; i++)
+            cluster_refs[i]++;
+        mark_refcounts_dirty(extent.start, extent.start + extent.length - 1);
+    }
+    return true;
+}
+
+std::vector<Extent> PseudoFS::drop_cluster_references(const std::vector<Extent> &extents) {
+    if (cluster_refs.empty())
+        return extents;
+
+    // Shared clusters lose one reference, the rest is not used by anyone anymore
+    std::vector<Extent> unused;
+    for (const auto &extent: extents) {
+        for (uint32_t i = extent.start; i < extent.start + extent.length; i++) {
+            if (cluster_refs[i]) {
+                cluster_refs[i]--;
+                mark_refcounts_dirty(i, i);
+            } else if (!unused.empty() && unused.back().start + unused.back().length == i)
+                unused.back().length++;
+            else
+                unused.push_back(Extent{i, 1});
+        }
+    }
+    return unused;
+}
+
+uint64_t PseudoFS::write_system_chain(const std::vector<char> &data) {
+    auto count = std::max<uint64_t>(1, (data.size() + meta_data.cluster_size - 1) / meta_data.cluster_size);
+    std::vector<Extent> extents;
+    if (count > UINT32_MAX || !allocate_clusters(static_cast<uint32_t>(count), extents))
+        return 0;
+
+    // The last cluster is padded with zeroes
+    std::vector<char> buffer(meta_data.cluster_size);
+    uint64_t offset = 0;
+    for (const auto &extent: extents) {
+        for (uint32_t i = extent.start; i < extent.start + extent.length; i++) {
+            auto size = std::min<uint64_t>(meta_data.cluster_size, data.size() - std::min<uint64_t>(offset, data.size()));
+            std::fill(buffer.begin(), buffer.end(), '\0');
+            if (size)
+                std::memcpy(buffer.data(), &data[offset], size);
+            write_metadata(get_data_address(i), buffer.data(), meta_data.cluster_size);
+            offset += meta_data.cluster_size;
+        }
+    }
+    return get_data_address(extents[0].start);
+}
+
+std::vector<char> PseudoFS::read_system_chain(uint64_t cluster_address, uint64_t size) {
+    std::vector<char> data(size, '\0');
+    for (uint64_t offset = 0; offset < size; offset += meta_data.cluster_size) {
+        if (cluster_address == FAT_EOF || cluster_address == FAT_FREE || cluster_address == FAT_BAD)
+            break;
+        read_from_cluster(cluster_address, &data[offset], std::min<uint64_t>(meta_data.cluster_size, size - offset));
+        cluster_address = read_from_fat(get_cluster_index(cluster_address));
+    }
+    return data;
+}
+
+void PseudoFS::free_system_chain(uint64_t cluster_address) {
+    std::vector<Extent> extents;
+    while (cluster_address != FAT_EOF && cluster_address != FAT_FREE && cluster_address != FAT_BAD) {
+        auto cluster_index = get_cluster_index(cluster_address);
+        auto cluster = get_fat_entry(cluster_index);
+        cluster_address = read_from_fat(cluster_index);
+        write_to_fat(cluster_index, FAT_FREE);
+        if (!extents.empty() && extents.back().start + extents.back().length == cluster)
+            extents.back().length++;
+        else
+            extents.push_back(Extent{cluster, 1});
+    }
+    release_clusters(extents, false);
+}
+
+void PseudoFS::load_snapshots() {
+    snapshots.clear();
+    if (meta_data.version == 1 || !meta_data.snapshot_address)
+        return;
+
+    // The catalog is the number of the snapshots followed by their records
+    uint32_t count;
+    auto header = read_system_chain(meta_data.snapshot_address, sizeof(uint32_t));
+    std::memcpy(&count, header.data(), sizeof(uint32_t));
+    auto data = read_system_chain(meta_data.snapshot_address, sizeof(uint32_t) + count * sizeof(SnapshotInfo));
+    snapshots.resize(count);
+    if (count)
+        std::memcpy(snapshots.data(), &data[sizeof(uint32_t)], count * sizeof(SnapshotInfo));
+}
+
+bool PseudoFS::write_snapshot_catalog() {
+    // The new catalog is written before the old one is freed, so a failure leaves the old one in place
+    uint64_t address = 0;
+    if (!snapshots.empty()) {
+        auto count = static_cast<uint32_t>(snapshots.size());
+        std::vector<char> data(sizeof(uint32_t) + count * sizeof(SnapshotInfo));
+        std::memcpy(data.data(), &count, sizeof(uint32_t));
+        std::memcpy(&data[sizeof(uint32_t)], snapshots.data(), count * sizeof(SnapshotInfo));
+        address = write_system_chain(data);
+        if (!address) {
+            errors() << NO_SPACE << std::endl;
+            return false;
+        }
+    }
+    if (meta_data.snapshot_address)
+        free_system_chain(meta_data.snapshot_address);
+    meta_data.snapshot_address = address;
+    write_meta_data();
+    return true;
+}
+
+size_t PseudoFS::find_snapshot(const std::string &name) const {
+    for (size_t i = 0; i < snapshots.size(); i++) {
+        if (!strncmp(snapshots[i].name, name.c_str(), DEFAULT_FILE_NAME_LENGTH - 1))
+            return i;
+    }
+    return snapshots.size();
+}
+
+bool PseudoFS::create_snapshot(const std::string &name) {
+    if (meta_data.version == 1) {
+        errors() << NOT_SUPPORTED << std::endl;
+        return false;
+    }
+    if (find_snapshot(name) != snapshots.size()) {
+        errors() << SNAPSHOT_ALREADY_EXISTS << std::endl;
+        return false;
+    }
+
+    // Count the files and directories using each cluster of the tree (reflink copies share the clusters)
+    auto cluster_count = static_cast<uint32_t>(fat_table.size());
+    std::vector<uint32_t> users(cluster_count, 0);
+    std::vector<uint32_t> directory_clusters;
+    for (const auto &item: collect_layout_items()) {
+        for (auto cluster: item.clusters) {
+            if (item.is_directory && !users[cluster])
+                directory_clusters.push_back(cluster);
+            users[cluster]++;
+        }
+    }
+
+    // The record is the FAT entries of the clusters and the content of the directories (the only clusters
+    // that are ever changed in place), the data of the files stays where it is
+    std::vector<SnapshotCluster> clusters;
+    std::vector<Extent> extents;
+    for (uint32_t cluster = 0; cluster < cluster_count; cluster++) {
+        if (!users[cluster])
+            continue;
+        clusters.push_back(SnapshotCluster{get_value_address(fat_table[cluster]), cluster, users[cluster]});
+        if (!extents.empty() && extents.back().start + extents.back().length == cluster)
+            extents.back().length++;
+        else
+            extents.push_back(Extent{cluster, 1});
+    }
+    auto clusters_size = clusters.size() * sizeof(SnapshotCluster);
+    auto directories_size = directory_clusters.size() * sizeof(uint32_t);
+    std::vector<char> record(clusters_size + directories_size +
+                             directory_clusters.size() * static_cast<uint64_t>(meta_data.cluster_size));
+    std::memcpy(record.data(), clusters.data(), clusters_size);
+    std::memcpy(&record[clusters_size], directory_clusters.data(), directories_size);
+    auto directory_data = &record[clusters_size + directories_size];
+    for (size_t i = 0; i < directory_clusters.size(); i++)
+        read_from_cluster(get_data_address(directory_clusters[i]), directory_data + i * meta_data.cluster_size,
+                          meta_data.cluster_size);
+
+    // The snapshot holds one more reference to every cluster, so nothing it uses is freed by the live tree
+    SnapshotInfo info{};
+    std::strncpy(info.name, name.c_str(), DEFAULT_FILE_NAME_LENGTH - 1);
+    info.created = static_cast<int64_t>(std::time(nullptr));
+    info.cluster_count = static_cast<uint32_t>(clusters.size());
+    info.directory_count = static_cast<uint32_t>(directory_clusters.size());
+    info.address = write_system_chain(record);
+    if (!info.address) {
+        errors() << NO_SPACE << std::endl;
+        return false;
+    }
+    if (!share_clusters(extents)) {
+        free_system_chain(info.address);
+        return false;
+    }
+    snapshots.push_back(info);
+    if (!write_snapshot_catalog()) {
+        snapshots.pop_back();
+        drop_cluster_references(extents);
+        free_system_chain(info.address);
+        return false;
+    }
+    return true;
 }
 
-void PseudoFS::write_to_fat(uint32_t cluster_index, uint32_t value) {
-    file_system.seekp(cluster_index);
-    file_system.write(reinterpret_cast<char *>(&value), sizeof(uint32_t));
+bool PseudoFS::restore_snapshot(const std::string &name) {
+    auto index = find_snapshot(name);
+    if (index == snapshots.size()) {
+        errors() << SNAPSHOT_NOT_FOUND << std::endl;
+        return false;
+    }
+    const auto &info = snapshots[index];
+
+    // Read the record of the snapshot
+    auto clusters_size = info.cluster_count * sizeof(SnapshotCluster);
+    auto directories_size = info.directory_count * sizeof(uint32_t);
+    auto record = read_system_chain(info.address, clusters_size + directories_size +
+                                                  info.directory_count * static_cast<uint64_t>(meta_data.cluster_size));
+    std::vector<SnapshotCluster> clusters(info.cluster_count);
+    std::vector<uint32_t> directory_clusters(info.directory_count);
+    std::memcpy(clusters.data(), record.data(), clusters_size);
+    std::memcpy(directory_clusters.data(), &record[clusters_size], directories_size);
+
+    // The counts of the restored tree are added to the counts the clusters have now, check they fit first
+    for (const auto &cluster: clusters) {
+        if (cluster_refs[cluster.cluster] + cluster.users > std::numeric_limits<uint16_t>::max()) {
+            errors() << TOO_MANY_REFERENCES << std::endl;
+            return false;
+        }
+    }
+
+    // The live tree lets go of its clusters, the ones not held by any snapshot are freed
+    std::vector<Extent> unused;
+    for (const auto &item: collect_layout_items()) {
+        std::vector<Extent> extents;
+        for (auto cluster: item.clusters)
+            extents.push_back(Extent{cluster, 1});
+        for (const auto &extent: drop_cluster_references(extents))
+            unused.push_back(extent);
+    }
+    for (const auto &extent: unused) {
+        for (uint32_t i = extent.start; i < extent.start + extent.length; i++)
+            write_to_fat(get_fat_index(i), FAT_FREE);
+    }
+    release_clusters(unused, false);
+
+    // The saved tree takes its clusters back (the snapshot keeps its own reference), with their FAT chains
+    // and the content of the directories
+    for (const auto &cluster: clusters) {
+        cluster_refs[cluster.cluster] += cluster.users;
+        mark_refcounts_dirty(cluster.cluster, cluster.cluster);
+        write_to_fat(get_fat_index(cluster.cluster), cluster.value);
+    }
+    auto directory_data = &record[clusters_size + directories_size];
+    for (size_t i = 0; i < directory_clusters.size(); i++)
+        write_metadata(get_data_address(directory_clusters[i]), directory_data + i * meta_data.cluster_size,
+                         meta_data.cluster_size);
+
+    // Everything known about the directories changed, find the working directory again by its path
+    directory_indexes.clear();
+    path_cache.clear();
+    uint64_t working_directory_address;
+    if (find_directory(current_directory().path, working_directory_address))
+        current_directory().cluster_address = working_directory_address;
+    else
+        current_directory() = ROOT_DIRECTORY;
+    return true;
 }
 
-std::vector<DirectoryEntry> PseudoFS::get_directory_entries(uint32_t cluster) {
-    // Seek to the cluster in the file system and read the directory entries
+bool PseudoFS::delete_snapshot(const std::string &name) {
+    auto index = find_snapshot(name);
+    if (index == snapshots.size()) {
+        errors() << SNAPSHOT_NOT_FOUND << std::endl;
+        return false;
+    }
+    auto info = snapshots[index];
+
+    // The snapshot lets go of its clusters, the ones not used by the live tree or other snapshots are freed
+    std::vector<SnapshotCluster> clusters(info.cluster_count);
+    auto record = read_system_chain(info.address, info.cluster_count * sizeof(SnapshotCluster));
+    std::memcpy(clusters.data(), record.data(), record.size());
+    std::vector<Extent> extents;
+    for (const auto &cluster: clusters)
+        extents.push_back(Extent{cluster.cluster, 1});
+    auto unused = drop_cluster_references(extents);
+    for (const auto &extent: unused) {
+        for (uint32_t i = extent.start; i < extent.start + extent.length; i++)
+            write_to_fat(get_fat_index(i), FAT_FREE);
+    }
+    release_clusters(unused, false);
+
+    free_system_chain(info.address);
+    snapshots.erase(snapshots.begin() + static_cast<std::ptrdiff_t>(index));
+    return write_snapshot_catalog();
+}
+
+DirectoryIndex &PseudoFS::get_directory_index(uint64_t cluster_address) {
+    // The index is filled before the lock is released, the other sessions never see it half done (and the
+    // references stay valid, only the commands changing the file system remove the indexes)
+    std::lock_guard<std::recursive_mutex> guard(cache_lock);
+    auto found = directory_indexes.find(cluster_address);
+    if (found != directory_indexes.end())
+        return found->second;
+
+    // Read all the clusters of the directory (its FAT chain) and index the directory entries by their names
+    auto &index = directory_indexes[cluster_address];
+    auto slots_per_cluster = meta_data.cluster_size / directory_entry_size;
+    auto address = cluster_address;
+    while (address != FAT_EOF && address != FAT_FREE && address != FAT_BAD &&
+           index.clusters.size() < meta_data.cluster_count) {
+        index.clusters.push_back(address);
+        auto data = view_file_cluster(address);
+        for (uint32_t i = 0; i < slots_per_cluster; i++) {
+            auto slot = static_cast<uint32_t>(index.slots.size());
+            index.slots.push_back(decode_directory_entry(data + i * directory_entry_size));
+            if (index.slots[slot].start_cluster != 0)
+                index.names[index.slots[slot].item_name] = slot;
+            else
+                index.free_slots.push_back(slot);
+        }
+        address = read_from_fat(get_cluster_index(address));
+    }
+    std::make_heap(index.free_slots.begin(), index.free_slots.end(), std::greater<>());
+    return index;
+}
+
+uint64_t PseudoFS::get_slot_address(const DirectoryIndex &index, uint32_t slot) const {
+    auto slots_per_cluster = meta_data.cluster_size / directory_entry_size;
+    return index.clusters[slot / slots_per_cluster] + static_cast<uint64_t>(slot % slots_per_cluster) * directory_entry_size;
+}
+
+bool PseudoFS::reserve_directory_slot(uint64_t cluster_address) {
+    auto &index = get_directory_index(cluster_address);
+    if (!index.free_slots.empty())
+        return true;
+
+    // The directory is full, append a new cluster to its FAT chain (cleared, free clusters can contain old data)
+    auto cluster = find_free_cluster();
+    if (!cluster) {
+        errors() << NO_SPACE << std::endl;
+        return false;
+    }
+    auto new_cluster_address = get_data_address(cluster);
+    write_to_fat(get_fat_index(cluster), FAT_EOF);
+    write_to_fat(get_cluster_index(index.clusters.back()), new_cluster_address);
+    write_metadata(new_cluster_address, &EMPTY_CLUSTER[0], meta_data.cluster_size);
+
+    // All the slots of the new cluster are empty
+    auto slots_per_cluster = meta_data.cluster_size / directory_entry_size;
+    auto first_slot = static_cast<uint32_t>(index.slots.size());
+    index.clusters.push_back(new_cluster_address);
+    index.slots.resize(first_slot + slots_per_cluster);
+    for (uint32_t slot = first_slot; slot < index.slots.size(); slot++) {
+        index.free_slots.push_back(slot);
+        std::push_heap(index.free_slots.begin(), index.free_slots.end(), std::greater<>());
+    }
+    return true;
+}
+
+std::vector<DirectoryEntry> PseudoFS::get_directory_entries(uint64_t cluster) {
+    // Go through the indexed directory entries in the order of their slots
     std::vector<DirectoryEntry> entries;
-    file_system.seekp(cluster);
-    for (int i = 0; i < meta_data.cluster_size / sizeof(DirectoryEntry); i++) {
-        DirectoryEntry entry{};
-        file_system.read(reinterpret_cast<char *>(&entry), sizeof(DirectoryEntry));
+    for (const auto &entry: get_directory_index(cluster).slots) {
         // If the entry is not empty, add it to the vector
         if (entry.start_cluster != 0)
             entries.push_back(entry);
@@ -110,229 +1457,1166 @@ std::vector<DirectoryEntry> PseudoFS::get_directory_entries(uint32_t cluster) {
     return entries;
 }
 
-void PseudoFS::write_directory_entry(uint32_t cluster_address, const DirectoryEntry &entry) {
-    // Seek to the cluster and write to the first empty directory entry
-    file_system.seekp(cluster_address);
-    for (int i = 0; i < meta_data.cluster_size / sizeof(DirectoryEntry); i++) {
-        auto tmp = DirectoryEntry{};
-        file_system.read(reinterpret_cast<char *>(&tmp), sizeof(DirectoryEntry));
-        if (tmp.start_cluster != 0)
+bool PseudoFS::write_directory_entry(uint64_t cluster_address, const DirectoryEntry &entry) {
+    // Write to the lowest empty slot of the directory (the directory grows if it is full)
+    if (!reserve_directory_slot(cluster_address))
+        return false;
+    auto &index = get_directory_index(cluster_address);
+    std::pop_heap(index.free_slots.begin(), index.free_slots.end(), std::greater<>());
+    auto slot = index.free_slots.back();
+    index.free_slots.pop_back();
+    std::vector<char> encoded(directory_entry_size);
+    encode_directory_entry(entry, encoded.data());
+    write_metadata(get_slot_address(index, slot), encoded.data(), directory_entry_size);
+    index.slots[slot] = entry;
+    index.names[index.slots[slot].item_name] = slot;
+    return true;
+}
+
+void PseudoFS::remove_directory_entry(uint64_t cluster_address, const DirectoryEntry &entry) {
+    // Find the slot of the entry by its name
+    auto &index = get_directory_index(cluster_address);
+    auto found = index.names.find(entry.item_name);
+    if (found == index.names.end())
+        return;
+    auto slot = found->second;
+    index.names.erase(found);
+
+    // Move the last entry of the directory to the freed slot, the slot of the last entry is emptied instead
+    auto last = static_cast<uint32_t>(index.slots.size()) - 1;
+    while (last > slot && index.slots[last].start_cluster == 0)
+        last--;
+    std::vector<char> encoded(directory_entry_size, '\0');
+    if (last != slot) {
+        index.slots[slot] = index.slots[last];
+        index.names[index.slots[slot].item_name] = slot;
+        encode_directory_entry(index.slots[slot], encoded.data());
+        write_metadata(get_slot_address(index, slot), encoded.data(), directory_entry_size);
+        std::fill(encoded.begin(), encoded.end(), '\0');
+    }
+    write_metadata(get_slot_address(index, last), encoded.data(), directory_entry_size);
+    index.slots[last] = DirectoryEntry{};
+    index.free_slots.push_back(last);
+    std::push_heap(index.free_slots.begin(), index.free_slots.end(), std::greater<>());
+
+    // All the slots from the emptied one are empty, free the clusters after it (the first cluster is always kept)
+    auto slots_per_cluster = meta_data.cluster_size / directory_entry_size;
+    auto needed_clusters = std::max<size_t>(1, (last + slots_per_cluster - 1) / slots_per_cluster);
+    if (index.clusters.size() <= needed_clusters)
+        return;
+    // (clusters kept by a snapshot just lose a reference)
+    std::vector<Extent> freed;
+    while (index.clusters.size() > needed_clusters) {
+        freed.push_back(Extent{get_fat_entry(get_cluster_index(index.clusters.back())), 1});
+        index.clusters.pop_back();
+    }
+    freed = drop_cluster_references(freed);
+    for (const auto &extent: freed) {
+        for (uint32_t i = extent.start; i < extent.start + extent.length; i++)
+            write_to_fat(get_fat_index(i), FAT_FREE);
+    }
+    write_to_fat(get_cluster_index(index.clusters.back()), FAT_EOF);
+    release_clusters(freed, false);
+
+    // Forget the slots of the freed clusters
+    index.slots.resize(index.clusters.size() * slots_per_cluster);
+    std::erase_if(index.free_slots, [&index](uint32_t free_slot) { return free_slot >= index.slots.size(); });
+    std::make_heap(index.free_slots.begin(), index.free_slots.end(), std::greater<>());
+}
+
+bool PseudoFS::does_entry_exist(uint64_t directory, const std::string &name, DirectoryEntry &entry) {
+    auto &index = get_directory_index(directory);
+    auto found = index.names.find(name);
+    if (found == index.names.end())
+        return false;
+    entry = index.slots[found->second];
+    return true;
+}
+
+void PseudoFS::update_directory_entry(uint64_t cluster_address, const DirectoryEntry &entry) {
+    // Find the slot of the entry by its name and overwrite it
+    auto &index = get_directory_index(cluster_address);
+    auto found = index.names.find(entry.item_name);
+    if (found == index.names.end())
+        return;
+    std::vector<char> encoded(directory_entry_size);
+    encode_directory_entry(entry, encoded.data());
+    write_metadata(get_slot_address(index, found->second), encoded.data(), directory_entry_size);
+    index.slots[found->second] = entry;
+}
+
+void PseudoFS::rename_directory_entry(uint64_t cluster_address, const std::string &name, const DirectoryEntry &entry) {
+    // The entry keeps its slot, only the name it is found by changes
+    auto &index = get_directory_index(cluster_address);
+    auto found = index.names.find(name);
+    if (found == index.names.end())
+        return;
+    auto slot = found->second;
+    index.names.erase(found);
+    std::vector<char> encoded(directory_entry_size);
+    encode_directory_entry(entry, encoded.data());
+    write_metadata(get_slot_address(index, slot), encoded.data(), directory_entry_size);
+    index.slots[slot] = entry;
+    index.names[index.slots[slot].item_name] = slot;
+}
+
+std::string PseudoFS::normalize_path(const std::string &path) const {
+    // Go through the components of the path, ".." removes the last component (the parent of the root is the root)
+    std::stringstream ss(path.starts_with('/') ? path : current_directory().path + path);
+    std::string token;
+    std::vector<std::string> components;
+    while (std::getline(ss, token, '/')) {
+        if (token.empty() || token == ".")
+            continue;
+        if (token == "..") {
+            if (!components.empty())
+                components.pop_back();
+        } else
+            components.push_back(token);
+    }
+
+    std::string normalized = "/";
+    for (const auto &component: components)
+        normalized += component + "/";
+    return normalized;
+}
+
+bool PseudoFS::find_directory(const std::string &path, uint64_t &cluster_address) {
+    if (path == "/") {
+        cluster_address = ROOT_DIRECTORY.cluster_address;
+        return true;
+    }
+
+    // Hot paths are resolved by one lookup
+    std::lock_guard<std::recursive_mutex> guard(cache_lock);
+    auto cached = path_cache.find(path);
+    if (cached != path_cache.end()) {
+        cluster_address = cached->second;
+        return true;
+    }
+
+    // Find the parent directory first (all of its prefixes get cached too) and the last component in it
+    auto parent_end = path.find_last_of('/', path.size() - 2);
+    std::string name = path.substr(parent_end + 1, path.size() - parent_end - 2);
+    uint64_t parent_address;
+    if (!find_directory(path.substr(0, parent_end + 1), parent_address))
+        return false;
+    auto &index = get_directory_index(parent_address);
+    auto found = index.names.find(name);
+    if (found == index.names.end() || !index.slots[found->second].is_directory)
+        return false;
+
+    cluster_address = index.slots[found->second].start_cluster;
+    path_cache[path] = cluster_address;
+    return true;
+}
+
+bool PseudoFS::resolve_path(const std::string &path, PathHandle &handle) {
+    // Split the path to the directory part and the name of the entry (last component)
+    auto separator = path.find_last_of('/');
+    handle.name = separator == std::string::npos ? path : path.substr(separator + 1);
+    auto directory_path = separator == std::string::npos ? std::string() : path.substr(0, separator + 1);
+
+    // Find the directory and the entry in it, the working directory stays untouched
+    if (!find_directory(normalize_path(directory_path), handle.directory)) {
+        errors() << PATH_NOT_FOUND << std::endl;
+        return false;
+    }
+    handle.entry = DirectoryEntry{};
+    does_entry_exist(handle.directory, handle.name, handle.entry);
+    return true;
+}
+
+void PseudoFS::invalidate_path_cache(const std::string &path) {
+    std::erase_if(path_cache, [&path](const auto &item) { return item.first.starts_with(path); });
+}
+
+std::vector<Extent> PseudoFS::get_file_extents(const DirectoryEntry &entry) {
+    std::vector<Extent> extents;
+    auto cluster = static_cast<uint32_t>((entry.start_cluster - meta_data.data_start_address) / meta_data.cluster_size);
+    while (cluster != static_cast<uint32_t>(FAT_EOF)) {
+        // Extend the current extent if the cluster follows it, otherwise start a new one
+        if (!extents.empty() && extents.back().start + extents.back().length == cluster)
+            extents.back().length++;
+        else
+            extents.push_back(Extent{cluster, 1});
+        cluster = fat_table[cluster];
+    }
+    return extents;
+}
+
+bool PseudoFS::is_file_defragmented(const DirectoryEntry &entry, std::vector<uint32_t> &clusters) {
+    // Get the first cluster of the file
+    auto cluster_address = entry.start_cluster;
+    auto cluster_index = get_cluster_index(cluster_address);
+
+    // Get all the clusters of the file
+    while (cluster_address != FAT_EOF) {
+        clusters.push_back(get_fat_entry(cluster_index));
+        cluster_address = read_from_fat(cluster_index);
+        cluster_index = get_cluster_index(cluster_address);
+    }
+
+    // If the clusters are consecutive in the file system, the file is defragmented
+    for (int i = 0; i < clusters.size() - 1; i++) {
+        if (clusters[i] + 1 != clusters[i + 1])
+            return false;
+    }
+
+    return true;
+}
+
+std::vector<LayoutItem> PseudoFS::collect_layout_items() {
+    std::vector<LayoutItem> directories;
+    std::vector<LayoutItem> files;
+    auto cluster_count = static_cast<uint32_t>(fat_table.size());
+
+    // Follows the FAT chain of the item starting at the given cluster address
+    auto walk_chain = [&](uint64_t cluster_address, bool is_directory) {
+        LayoutItem item{{}, is_directory};
+        auto cluster = get_fat_value(cluster_address);
+        while (cluster < cluster_count && item.clusters.size() < cluster_count) {
+            item.clusters.push_back(cluster);
+            cluster = fat_table[cluster];
+        }
+        return item;
+    };
+
+    // Go through the directory tree breadth first, every directory is visited once
+    std::vector<uint64_t> queue{ROOT_DIRECTORY.cluster_address};
+    std::unordered_map<uint64_t, bool> visited{{ROOT_DIRECTORY.cluster_address, true}};
+    for (size_t i = 0; i < queue.size(); i++) {
+        directories.push_back(walk_chain(queue[i], true));
+        for (const auto &entry: get_directory_entries(queue[i])) {
+            if (!strcmp(entry.item_name, ".") || !strcmp(entry.item_name, ".."))
+                continue;
+            if (!entry.is_directory)
+                files.push_back(walk_chain(entry.start_cluster, false));
+            else if (!visited[entry.start_cluster]) {
+                visited[entry.start_cluster] = true;
+                queue.push_back(entry.start_cluster);
+            }
+        }
+    }
+
+    directories.insert(directories.end(), std::make_move_iterator(files.begin()),
+                       std::make_move_iterator(files.end()));
+    return directories;
+}
+
+void PseudoFS::print_fragmentation(const std::string &label, const std::vector<LayoutItem> &items) const {
+    uint64_t fragmented = 0;
+    uint64_t extents = 0;
+    for (const auto &item: items) {
+        uint64_t item_extents = item.clusters.empty() ? 0 : 1;
+        for (size_t i = 1; i < item.clusters.size(); i++) {
+            if (item.clusters[i - 1] + 1 != item.clusters[i])
+                item_extents++;
+        }
+        extents += item_extents;
+        if (item_extents > 1)
+            fragmented++;
+    }
+    output() << label << ": " << items.size() << " files and directories, " << fragmented << " fragmented, "
+             << extents << " extents, " << find_free_runs().size() << " free runs" << std::endl;
+}
+
+void PseudoFS::execute_moves(std::vector<ClusterMove> &moves) {
+    // The data is kept in the order of the destinations, so the runs of destinations are written in one go
+    std::sort(moves.begin(), moves.end(), [](const ClusterMove &a, const ClusterMove &b) {
+        return a.destination < b.destination;
+    });
+    auto cluster_size = meta_data.cluster_size;
+    std::vector<char> data(moves.size() * cluster_size);
+
+    // Runs of the moves (their start and length), reading consecutive sources or writing consecutive destinations
+    std::vector<Extent> read_runs;
+    std::vector<Extent> write_runs;
+    for (uint32_t i = 0; i < moves.size(); i++) {
+        if (i && moves[i - 1].source + 1 == moves[i].source)
+            read_runs.back().length++;
+        else
+            read_runs.push_back(Extent{i, 1});
+        if (i && moves[i - 1].destination + 1 == moves[i].destination)
+            write_runs.back().length++;
+        else
+            write_runs.push_back(Extent{i, 1});
+    }
+
+    // Read all the data first, all the runs are in flight
+    std::vector<IoRequest> requests;
+    for (const auto &run: read_runs)
+        requests.push_back(IoRequest{false, get_data_address(moves[run.start].source), &data[run.start * cluster_size],
+                                     static_cast<size_t>(run.length) * cluster_size});
+    device->submit(requests);
+    requests.clear();
+    for (const auto &run: write_runs)
+        requests.push_back(IoRequest{true, get_data_address(moves[run.start].destination),
+                                     &data[run.start * cluster_size], static_cast<size_t>(run.length) * cluster_size});
+    device->submit(requests);
+}
+
+bool PseudoFS::defrag_all() {
+    // The data is moved around the cache, so everything cached has to be on the device first
+    commit_journal();
+    cache->flush();
+    auto items = collect_layout_items();
+    print_fragmentation("Before", items);
+
+    // The clusters are moved in passes, the data is copied only into the clusters free under the committed FAT and
+    // the new places (FAT, directories and the reference count table) are committed as one transaction before the
+    // old ones are reused, so a crash leaves every file and directory either in its old or in its new place
+    auto cluster_count = static_cast<uint32_t>(fat_table.size());
+    auto unused = cluster_count;
+    auto batch_limit = std::max<uint64_t>(1, DEFRAG_BATCH_SIZE / meta_data.cluster_size);
+    auto is_free = [&](uint32_t cluster) {
+        return static_cast<bool>(free_bitmap[cluster / 64] & 1ULL << (cluster % 64));
+    };
+    uint64_t pending;
+    bool damaged = false;
+    for (;;) {
+        // Hidden chain of the reference count table is laid out right after the root directory
+        if (!refcount_clusters.empty())
+            items.insert(items.begin() + 1, LayoutItem{refcount_clusters, false});
+
+        // Lay the items out one after another from the start of the data (the bad clusters are skipped)
+        // Files sharing their clusters (reflink copies) share the new clusters as well
+        std::vector<uint32_t> target(cluster_count, unused);
+        uint32_t next_target = 0;
+        for (const auto &item: items) {
+            for (auto cluster: item.clusters) {
+                // Cluster shared by more items stays where the first item put it
+                if (target[cluster] != unused)
+                    continue;
+                while (next_target < cluster_count && fat_table[next_target] == FAT_BAD)
+                    next_target++;
+                if (next_target == cluster_count) {
+                    damaged = true;
+                    break;
+                }
+                target[cluster] = next_target++;
+            }
+            if (damaged)
+                break;
+        }
+
+        // The chains hold more clusters than there are good ones (the FAT is damaged), nothing more is moved
+        if (damaged)
+            break;
+
+        // The clusters go to their places that are free, the ones in the places of the others go after the laid out
+        // items (they get to their own places in the next passes)
+        std::vector<uint32_t> destination(cluster_count, unused);
+        std::vector<ClusterMove> moves;
+        pending = 0;
+        for (uint32_t cluster = 0; cluster < cluster_count; cluster++) {
+            if (target[cluster] == unused || target[cluster] == cluster)
+                continue;
+            pending++;
+            if (is_free(target[cluster])) {
+                destination[cluster] = target[cluster];
+                moves.push_back(ClusterMove{cluster, target[cluster]});
+            }
+        }
+        auto spare = next_target;
+        for (uint32_t cluster = 0; cluster < next_target; cluster++) {
+            if (target[cluster] == unused || target[cluster] == cluster || destination[cluster] != unused)
+                continue;
+            while (spare < cluster_count && !is_free(spare))
+                spare++;
+            if (spare == cluster_count)
+                break;
+            destination[cluster] = spare;
+            moves.push_back(ClusterMove{cluster, spare++});
+        }
+        for (size_t i = 0; i < moves.size(); i += batch_limit) {
+            std::vector<ClusterMove> batch(moves.begin() + i, moves.begin() + std::min<size_t>(i + batch_limit, moves.size()));
+            execute_moves(batch);
+        }
+        cache->invalidate(meta_data.data_start_address, static_cast<uint64_t>(cluster_count) * meta_data.cluster_size);
+        auto place = [&](uint32_t cluster) {
+            return destination[cluster] == unused ? cluster : destination[cluster];
+        };
+
+        // Chain the clusters of the items in their new places, the rest of the clusters (except the bad ones) is free
+        std::vector<uint32_t> new_fat(cluster_count);
+        for (uint32_t cluster = 0; cluster < cluster_count; cluster++)
+            new_fat[cluster] = fat_table[cluster] == FAT_BAD ? FAT_BAD : FAT_FREE;
+        for (const auto &item: items) {
+            for (size_t i = 0; i < item.clusters.size(); i++)
+                new_fat[place(item.clusters[i])] = i + 1 < item.clusters.size() ? place(item.clusters[i + 1]) : FAT_EOF;
+        }
+        std::vector<Extent> freed;
+        bool changed = false;
+        for (uint32_t cluster = 0; cluster < cluster_count; cluster++) {
+            if (fat_table[cluster] == new_fat[cluster])
+                continue;
+            changed = true;
+            if (fat_table[cluster] != FAT_FREE && new_fat[cluster] == FAT_FREE)
+                freed.push_back(Extent{cluster, 1});
+            set_fat_entry(cluster, new_fat[cluster]);
+        }
+        release_clusters(freed, false);
+
+        // Point the directory entries (including '.' and '..') to the new places of the items, through the journal
+        std::unordered_map<uint64_t, uint64_t> new_addresses;
+        for (const auto &item: items) {
+            if (!item.clusters.empty() && place(item.clusters[0]) != item.clusters[0])
+                new_addresses[get_data_address(item.clusters[0])] = get_data_address(place(item.clusters[0]));
+        }
+        std::vector<char> data(meta_data.cluster_size);
+        auto slots_per_cluster = meta_data.cluster_size / directory_entry_size;
+        for (const auto &item: items) {
+            if (!item.is_directory || new_addresses.empty())
+                continue;
+            for (auto cluster: item.clusters) {
+                auto cluster_address = get_data_address(place(cluster));
+                device->read(cluster_address, data.data(), meta_data.cluster_size);
+                bool modified = false;
+                for (uint32_t i = 0; i < slots_per_cluster; i++) {
+                    auto entry = decode_directory_entry(&data[i * directory_entry_size]);
+                    auto new_address = new_addresses.find(entry.start_cluster);
+                    if (entry.start_cluster == 0 || new_address == new_addresses.end())
+                        continue;
+                    entry.start_cluster = new_address->second;
+                    encode_directory_entry(entry, &data[i * directory_entry_size]);
+                    modified = true;
+                }
+                if (modified)
+                    write_metadata(cluster_address, data.data(), meta_data.cluster_size);
+            }
+        }
+
+        // The reference count table moved with its clusters, and the counts follow the clusters they belong to
+        if (!refcount_clusters.empty() && !moves.empty()) {
+            auto moved_refs = cluster_refs;
+            for (const auto &move: moves) {
+                moved_refs[move.destination] = cluster_refs[move.source];
+                moved_refs[move.source] = 0;
+            }
+            cluster_refs.swap(moved_refs);
+            for (auto &cluster: refcount_clusters)
+                cluster = place(cluster);
+            meta_data.refcount_address = get_data_address(refcount_clusters[0]);
+            write_meta_data();
+            mark_refcounts_dirty(0, cluster_count - 1);
+        }
+
+        // The pass is committed, the freed clusters can be reused by the next one
+        directory_indexes.clear();
+        path_cache.clear();
+        flush_refcounts();
+        commit_transaction();
+        commit_journal();
+        if (moves.empty() && !changed)
+            break;
+        items = collect_layout_items();
+    }
+
+    // Everything known about the directories moved, find the working directory again by its path
+    uint64_t working_directory_address;
+    if (find_directory(current_directory().path, working_directory_address))
+        current_directory().cluster_address = working_directory_address;
+    else
+        current_directory() = ROOT_DIRECTORY;
+
+    print_fragmentation("After", collect_layout_items());
+
+    if (damaged) {
+        errors() << FILE_SYSTEM_DAMAGED << std::endl;
+        return false;
+    }
+
+    // Without any free cluster, the clusters in the places of each other can't be moved safely
+    if (pending) {
+        errors() << NO_SPACE << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool PseudoFS::check_file_system(bool repair) {
+    // Changes waiting for the commit go to the disk first, the frees of the last commands count as done
+    flush_refcounts();
+    commit_transaction();
+    commit_journal();
+
+    auto cluster_count = static_cast<uint32_t>(fat_table.size());
+    auto cluster_size = meta_data.cluster_size;
+    uint64_t problems = 0;
+    bool unrepaired = false;
+    auto report = [&](const std::string &item, const std::string &problem) {
+        output() << item << ": " << problem << std::endl;
+        problems++;
+    };
+
+    // Number of the chains and of the snapshots holding each cluster, the last walk that reached it finds the cycles
+    std::vector<uint32_t> holders(cluster_count, 0);
+    std::vector<uint32_t> snapshot_holders(cluster_count, 0);
+    std::vector<uint32_t> walk_stamps(cluster_count, 0);
+    uint32_t walk = 0;
+
+    // Cluster of the cluster address (cluster_count if it isn't the start of a data cluster)
+    auto to_cluster = [&](uint64_t cluster_address) {
+        if (cluster_address < meta_data.data_start_address ||
+            (cluster_address - meta_data.data_start_address) % cluster_size)
+            return cluster_count;
+        return static_cast<uint32_t>(std::min<uint64_t>(
+                (cluster_address - meta_data.data_start_address) / cluster_size, cluster_count));
+    };
+
+    // Walks the FAT chain and counts its clusters, at most max_clusters are taken - the chain is cut after them,
+    // at a cycle or at an invalid entry when repairing (the caller reports the chains that don't even start)
+    auto walk_chain = [&](uint64_t cluster_address, uint64_t max_clusters, const std::string &item,
+                          std::vector<uint32_t> *clusters) {
+        walk++;
+        uint64_t count = 0;
+        auto previous = cluster_count;
+        auto cluster = to_cluster(cluster_address);
+        auto cut = [&](uint32_t last, const std::string &problem) {
+            if (last == cluster_count)
+                return;
+            report(item, problem);
+            if (repair)
+                write_to_fat(get_fat_index(last), FAT_EOF);
+        };
+        for (;;) {
+            if (cluster == cluster_count) {
+                cut(previous, "chain points outside of the data");
+                break;
+            }
+            if (fat_table[cluster] == FAT_FREE || fat_table[cluster] == FAT_BAD) {
+                cut(previous, "chain reaches a free cluster");
+                break;
+            }
+            if (walk_stamps[cluster] == walk) {
+                cut(previous, "chain has a cycle");
+                break;
+            }
+            walk_stamps[cluster] = walk;
+            holders[cluster]++;
+            if (clusters)
+                clusters->push_back(cluster);
+            count++;
+            if (fat_table[cluster] == FAT_EOF)
+                break;
+            if (count == max_clusters) {
+                cut(cluster, "chain is longer than the size");
+                break;
+            }
+            previous = cluster;
+            cluster = std::min(fat_table[cluster], cluster_count);
+        }
+        return count;
+    };
+
+    // Hidden chain of the reference count table, a broken table is thrown away (the counts are found again)
+    if (meta_data.refcount_address) {
+        auto table_clusters = (static_cast<uint64_t>(meta_data.cluster_count) * sizeof(uint16_t) + cluster_size - 1) /
+                              cluster_size;
+        std::vector<uint32_t> clusters;
+        if (walk_chain(meta_data.refcount_address, table_clusters, "Reference count table", &clusters) <
+            table_clusters) {
+            report("Reference count table", "chain is too short");
+            for (auto cluster: clusters)
+                holders[cluster]--;
+            if (repair) {
+                cluster_refs.clear();
+                refcount_clusters.clear();
+                refs_dirty_low = 1;
+                refs_dirty_high = 0;
+                meta_data.refcount_address = 0;
+                write_meta_data();
+            }
+        }
+    }
+
+    // Hidden chains of the snapshot catalog and the snapshot records, every snapshot holds its clusters once
+    bool catalog_damaged = false;
+    if (meta_data.snapshot_address) {
+        auto catalog_size = sizeof(uint32_t) + snapshots.size() * sizeof(SnapshotInfo);
+        auto catalog_clusters = std::max<uint64_t>(1, (catalog_size + cluster_size - 1) / cluster_size);
+        auto count = walk_chain(meta_data.snapshot_address, catalog_clusters, "Snapshot catalog", nullptr);
+        if (count < catalog_clusters) {
+            report("Snapshot catalog", "chain is too short");
+            catalog_damaged = true;
+            if (repair && !count)
+                meta_data.snapshot_address = 0;
+        }
+    }
+    std::vector<size_t> damaged_snapshots;
+    for (size_t i = 0; i < snapshots.size(); i++) {
+        const auto &info = snapshots[i];
+        auto item = "Snapshot " + std::string(info.name, strnlen(info.name, DEFAULT_FILE_NAME_LENGTH));
+        auto clusters_size = static_cast<uint64_t>(info.cluster_count) * sizeof(SnapshotCluster);
+        auto record_size = clusters_size + info.directory_count * (sizeof(uint32_t) + static_cast<uint64_t>(cluster_size));
+        auto record_clusters = std::max<uint64_t>(1, (record_size + cluster_size - 1) / cluster_size);
+        std::vector<uint32_t> chain;
+        bool valid = record_clusters <= cluster_count &&
+                     walk_chain(info.address, record_clusters, item, &chain) == record_clusters;
+        std::vector<SnapshotCluster> saved;
+        if (valid) {
+            saved.resize(info.cluster_count);
+            auto record = read_system_chain(info.address, clusters_size);
+            std::memcpy(saved.data(), record.data(), clusters_size);
+            for (const auto &cluster: saved)
+                valid = valid && cluster.cluster < cluster_count && fat_table[cluster.cluster] != FAT_BAD;
+        }
+        if (!valid) {
+            report(item, "record is damaged");
+            for (auto cluster: chain)
+                holders[cluster]--;
+            damaged_snapshots.push_back(i);
             continue;
-        file_system.seekp(cluster_address + i * sizeof(DirectoryEntry));
-        file_system.write(reinterpret_cast<const char *>(&entry), sizeof(DirectoryEntry));
-        break;
-    }
-}
-
-void PseudoFS::remove_directory_entry(uint32_t cluster_address, const DirectoryEntry &entry) {
-    // Seek to the cluster and write an empty directory entry to the one with the same starting cluster
-    for (int i = 0; i < meta_data.cluster_size / sizeof(DirectoryEntry); i++) {
-        auto tmp = DirectoryEntry{};
-        file_system.seekp(cluster_address + i * sizeof(DirectoryEntry));
-        file_system.read(reinterpret_cast<char *>(&tmp), sizeof(DirectoryEntry));
-        if (tmp.start_cluster == entry.start_cluster) {
-            file_system.seekp(cluster_address + i * sizeof(DirectoryEntry));
-            DirectoryEntry empty_entry{};
-            file_system.write(reinterpret_cast<const char *>(&empty_entry), sizeof(DirectoryEntry));
-            break;
         }
-    }
-}
 
-bool PseudoFS::does_entry_exist(const std::string &name, DirectoryEntry &entry) {
-    for (const auto &entry_for: working_directory.entries) {
-        if (entry_for.item_name == name) {
-            entry = entry_for;
-            break;
+        // The freed clusters of the snapshot get their saved FAT entries back (nothing else can use them)
+        uint64_t freed = 0;
+        for (const auto &cluster: saved) {
+            snapshot_holders[cluster.cluster]++;
+            if (fat_table[cluster.cluster] != FAT_FREE)
+                continue;
+            freed++;
+            if (repair)
+                write_to_fat(get_fat_index(cluster.cluster), cluster.value);
         }
+        if (freed)
+            report(item, std::to_string(freed) + " of its clusters are free");
     }
-    if (!entry.start_cluster)
-        return false;
-    return true;
-}
 
-bool PseudoFS::change_directory(const std::string &dir_name) {
-    // If the dir_name is empty or "/", change to the root directory
-    if (dir_name.empty() || dir_name == "/") {
-        ROOT_DIRECTORY.entries = get_directory_entries(ROOT_DIRECTORY.cluster_address);
-        working_directory = ROOT_DIRECTORY;
-        return true;
+    // Go through the directory tree breadth first, every directory is walked once
+    std::vector<bool> seen_directories(cluster_count, false);
+    std::vector<CheckedDirectory> queue{{ROOT_DIRECTORY.cluster_address, ROOT_DIRECTORY.cluster_address, "/", {}}};
+    if (!walk_chain(ROOT_DIRECTORY.cluster_address, cluster_count, "/", &queue[0].clusters)) {
+        report("/", "root directory is lost");
+        return false;
     }
+    seen_directories[queue[0].clusters[0]] = true;
+    uint64_t file_count = 0;
+    std::vector<LongFile> long_files;
+    std::vector<char> data(cluster_size);
+    std::vector<char> encoded(directory_entry_size);
+    auto slots_per_cluster = cluster_size / directory_entry_size;
+    for (size_t i = 0; i < queue.size(); i++) {
+        auto directory = std::move(queue[i]);
+        for (auto cluster: directory.clusters) {
+            read_from_cluster(get_data_address(cluster), data.data(), cluster_size);
+            for (uint32_t slot = 0; slot < slots_per_cluster; slot++) {
+                auto entry = decode_directory_entry(&data[slot * directory_entry_size]);
+                if (!entry.start_cluster)
+                    continue;
+                std::string name(entry.item_name, strnlen(entry.item_name, DEFAULT_FILE_NAME_LENGTH));
+                auto path = directory.path + name;
+
+                // Writes the repaired entry to its slot (the empty entry removes it)
+                auto rewrite = [&](const DirectoryEntry &repaired) {
+                    if (!repair)
+                        return;
+                    std::fill(encoded.begin(), encoded.end(), '\0');
+                    if (repaired.start_cluster)
+                        encode_directory_entry(repaired, encoded.data());
+                    write_metadata(get_data_address(cluster) + static_cast<uint64_t>(slot) * directory_entry_size,
+                                   encoded.data(), directory_entry_size);
+                };
+                auto lost_start = [&]() {
+                    report(path, to_cluster(entry.start_cluster) == cluster_count ? "entry points outside of the data"
+                                                                                  : "entry points to a free cluster");
+                    rewrite(DirectoryEntry{});
+                };
+
+                if (name == "." || name == "..") {
+                    auto expected = name == "." ? directory.cluster_address : directory.parent_address;
+                    if (entry.start_cluster != expected || !entry.is_directory) {
+                        report(path, "entry points to the wrong directory");
+                        entry.start_cluster = expected;
+                        entry.is_directory = true;
+                        rewrite(entry);
+                    }
+                    continue;
+                }
 
-    // If the dir_name is ".", nothing needs to be done
-    if (dir_name == ".")
-        return true;
+                if (entry.is_directory) {
+                    auto first = to_cluster(entry.start_cluster);
+                    if (first < cluster_count && seen_directories[first]) {
+                        report(path, "directory is linked more than once");
+                        rewrite(DirectoryEntry{});
+                        continue;
+                    }
+                    CheckedDirectory child{entry.start_cluster, directory.cluster_address, path + "/", {}};
+                    if (!walk_chain(entry.start_cluster, cluster_count, path, &child.clusters)) {
+                        lost_start();
+                        continue;
+                    }
+                    seen_directories[first] = true;
+                    queue.push_back(std::move(child));
+                    continue;
+                }
 
-    // If the dir_name is "..", change path to the parent directory
-    if (dir_name == "..") {
-        working_directory.path = working_directory.path.substr(0, working_directory.path.find_last_of('/'));
-        working_directory.path = working_directory.path.substr(0, working_directory.path.find_last_of('/'));
-        working_directory.path += "/";
+                // Files always take one more cluster than the whole clusters of data
+                file_count++;
+                auto needed = entry.size / cluster_size + 1;
+                auto count = walk_chain(entry.start_cluster, cluster_count, path, nullptr);
+                if (!count) {
+                    lost_start();
+                    continue;
+                }
+                if (count < needed) {
+                    report(path, "size is bigger than the chain");
+                    entry.size = count * cluster_size - 1;
+                    rewrite(entry);
+                } else if (count > needed) {
+                    report(path, "chain is longer than the size");
+                    long_files.push_back(LongFile{entry.start_cluster, needed,
+                                                  get_data_address(cluster) + static_cast<uint64_t>(slot) * directory_entry_size,
+                                                  entry});
+                }
+            }
+        }
     }
 
-    // Find the directory entry for the directory
-    auto entries = get_directory_entries(working_directory.cluster_address);
-    for (const auto &entry: entries) {
-        // If the entry is a directory and the name matches, change the working directory
-        if (entry.item_name == dir_name && entry.is_directory) {
-            if (dir_name != "..")
-                working_directory.path += dir_name + "/";
-            working_directory.cluster_address = entry.start_cluster;
-            working_directory.entries = get_directory_entries(entry.start_cluster);
-            return true;
+    // Files with longer chains are cut after their size - the files sharing the chain (reflink copies) are cut
+    // together, if another chain goes through the last cluster too, the files get their own copy of the clusters
+    std::sort(long_files.begin(), long_files.end(), [](const LongFile &a, const LongFile &b) {
+        return a.start_cluster < b.start_cluster || (a.start_cluster == b.start_cluster && a.needed < b.needed);
+    });
+    for (size_t first = 0; first < long_files.size() && repair;) {
+        auto last_file = first + 1;
+        while (last_file < long_files.size() && long_files[last_file].start_cluster == long_files[first].start_cluster &&
+               long_files[last_file].needed == long_files[first].needed)
+            last_file++;
+        auto group_size = static_cast<uint32_t>(last_file - first);
+        std::vector<uint32_t> kept{to_cluster(long_files[first].start_cluster)};
+        for (uint64_t i = 1; i < long_files[first].needed; i++)
+            kept.push_back(fat_table[kept.back()]);
+
+        // The files let go of the whole chain, the kept clusters are taken again by the cut chain or by the copy
+        for (auto cluster = kept.front(); cluster != static_cast<uint32_t>(FAT_EOF); cluster = fat_table[cluster])
+            holders[cluster] -= group_size;
+        if (holders[kept.back()] == 0)
+            write_to_fat(get_fat_index(kept.back()), FAT_EOF);
+        else {
+            std::vector<Extent> extents;
+            if (!allocate_clusters(static_cast<uint32_t>(kept.size()), extents)) {
+                errors() << NO_SPACE << std::endl;
+                unrepaired = true;
+                for (auto cluster: kept)
+                    holders[cluster] += group_size;
+                first = last_file;
+                continue;
+            }
+            std::vector<ClusterCopy> copies;
+            for (const auto &extent: extents) {
+                for (uint32_t i = extent.start; i < extent.start + extent.length; i++)
+                    copies.push_back(ClusterCopy{kept[copies.size()], i, 1});
+            }
+            if (!copy_clusters(copies)) {
+                free_allocated_clusters(extents);
+                unrepaired = true;
+                for (auto cluster: kept)
+                    holders[cluster] += group_size;
+                first = last_file;
+                continue;
+            }
+            for (auto i = first; i < last_file; i++) {
+                long_files[i].entry.start_cluster = get_data_address(extents[0].start);
+                encode_directory_entry(long_files[i].entry, encoded.data());
+                write_metadata(long_files[i].slot_address, encoded.data(), directory_entry_size);
+            }
+            kept.clear();
+            for (const auto &copy: copies)
+                kept.push_back(copy.destination);
+        }
+        for (auto cluster: kept)
+            holders[cluster] += group_size;
+        first = last_file;
+    }
+
+    // One pass over the FAT - clusters no chain reaches are leaked, clusters reached by more chains than their
+    // reference count says are cross-linked (removing one of the files would free data still in use)
+    uint64_t used = 0;
+    uint64_t leaked = 0;
+    uint64_t cross_linked = 0;
+    uint64_t wrong_counts = 0;
+    std::vector<Extent> leaked_extents;
+    std::vector<uint32_t> shared;
+    bool has_table = !cluster_refs.empty();
+    for (uint32_t cluster = 0; cluster < cluster_count; cluster++) {
+        auto cluster_holders = holders[cluster] + snapshot_holders[cluster];
+        auto expected = cluster_holders ? std::min<uint32_t>(cluster_holders - 1, UINT16_MAX) : 0;
+        if (fat_table[cluster] != FAT_FREE && fat_table[cluster] != FAT_BAD) {
+            if (cluster_holders)
+                used++;
+            else {
+                leaked++;
+                if (!leaked_extents.empty() && leaked_extents.back().start + leaked_extents.back().length == cluster)
+                    leaked_extents.back().length++;
+                else
+                    leaked_extents.push_back(Extent{cluster, 1});
+            }
+        }
+        if (has_table && cluster_refs[cluster] != expected) {
+            if (cluster_refs[cluster] < expected)
+                cross_linked++;
+            else
+                wrong_counts++;
+            if (repair) {
+                cluster_refs[cluster] = static_cast<uint16_t>(expected);
+                mark_refcounts_dirty(cluster, cluster);
+            }
+        } else if (!has_table && expected) {
+            cross_linked++;
+            shared.push_back(cluster);
         }
     }
+    if (leaked)
+        output() << "Leaked clusters: " << leaked << std::endl;
+    if (cross_linked)
+        output() << "Cross-linked clusters: " << cross_linked << std::endl;
+    if (wrong_counts)
+        output() << "Wrong reference counts: " << wrong_counts << std::endl;
+    problems += leaked + cross_linked + wrong_counts;
+
+    if (repair) {
+        // Leaked clusters are freed
+        for (const auto &extent: leaked_extents) {
+            for (uint32_t i = extent.start; i < extent.start + extent.length; i++)
+                write_to_fat(get_fat_index(i), FAT_FREE);
+        }
+        release_clusters(leaked_extents, false);
+
+        // Cross-linked clusters become shared (copy-on-write), like the clusters of the reflink copies
+        if (!shared.empty()) {
+            if (create_refcount_table()) {
+                for (auto cluster: shared)
+                    cluster_refs[cluster] = static_cast<uint16_t>(
+                            std::min<uint32_t>(holders[cluster] + snapshot_holders[cluster] - 1, UINT16_MAX));
+                mark_refcounts_dirty(shared.front(), shared.back());
+            } else
+                unrepaired = true;
+        }
 
-    // If the directory wasn't found, return false
-    return false;
-}
+        // Damaged snapshots are dropped (the clusters only they held were found leaked)
+        for (auto i = damaged_snapshots.rbegin(); i != damaged_snapshots.rend(); i++)
+            snapshots.erase(snapshots.begin() + static_cast<std::ptrdiff_t>(*i));
+        if ((catalog_damaged || !damaged_snapshots.empty()) && !write_snapshot_catalog())
+            unrepaired = true;
+
+        // Everything known about the directories could have changed, find the working directory again by its path
+        directory_indexes.clear();
+        path_cache.clear();
+        uint64_t working_directory_address;
+        if (find_directory(current_directory().path, working_directory_address))
+            current_directory().cluster_address = working_directory_address;
+        else
+            current_directory() = ROOT_DIRECTORY;
+    }
 
-bool PseudoFS::is_file_defragmented(const DirectoryEntry &entry, std::vector<uint32_t> &clusters) {
-    // Get the first cluster of the file
-    auto cluster_address = entry.start_cluster;
-    auto cluster_index = get_cluster_index(cluster_address);
+    output() << "Files: " << file_count << ", directories: " << queue.size() << ", clusters in use: " << used
+             << std::endl;
+    if (!problems)
+        output() << "No problems found" << std::endl;
+    else if (!repair)
+        output() << "Problems found: " << problems << " (fsck --repair repairs them)" << std::endl;
+    else
+        output() << "Problems found: " << problems << (unrepaired ? " (some could not be repaired)" : " (repaired)")
+                 << std::endl;
+    return !problems || (repair && !unrepaired);
+}
 
-    // Get all the clusters of the file
-    while (cluster_address != FAT_EOF) {
-        clusters.push_back((cluster_index - meta_data.fat_start_address) / sizeof(uint32_t));
-        cluster_address = read_from_fat(cluster_index);
-        cluster_index = get_cluster_index(cluster_address);
+bool PseudoFS::upgrade_layout() {
+    if (meta_data.version >= CURRENT_VERSION) {
+        errors() << ALREADY_CURRENT_VERSION << std::endl;
+        return false;
+    }
+    // The FAT of the original layout starts right after its short meta data, there is no room for the meta data
+    // block of the versioned layout
+    if (meta_data.version == 1) {
+        errors() << NOT_SUPPORTED << std::endl;
+        return false;
     }
 
-    // If the clusters are consecutive in the file system, the file is defragmented
-    for (int i = 0; i < clusters.size() - 1; i++) {
-        if (clusters[i] + 1 != clusters[i + 1])
+    // Everything waiting goes to its place and the journal is emptied, so no transaction of the old layout is
+    // ever replayed over the new one
+    flush_refcounts();
+    commit_transaction();
+    commit_journal();
+    reset_journal();
+
+    // Read the directories (of the live tree and the ones saved by the snapshots) while they are in the old layout
+    auto cluster_count = static_cast<uint32_t>(fat_table.size());
+    auto cluster_size = meta_data.cluster_size;
+    auto slots_per_cluster = cluster_size / directory_entry_size;
+    std::vector<bool> seen(cluster_count, false);
+    std::vector<uint32_t> directory_clusters;
+    for (const auto &item: collect_layout_items()) {
+        for (auto cluster: item.clusters) {
+            if (item.is_directory && !seen[cluster]) {
+                seen[cluster] = true;
+                directory_clusters.push_back(cluster);
+            }
+        }
+    }
+    std::vector<char> directories(directory_clusters.size() * static_cast<uint64_t>(cluster_size));
+    for (size_t i = 0; i < directory_clusters.size(); i++)
+        read_from_cluster(get_data_address(directory_clusters[i]), &directories[i * cluster_size], cluster_size);
+    std::vector<std::vector<char>> records;
+    std::vector<char *> directory_data{directories.data()};
+    std::vector<size_t> directory_counts{directory_clusters.size()};
+    for (const auto &info: snapshots) {
+        auto clusters_size = info.cluster_count * sizeof(SnapshotCluster);
+        auto directories_size = info.directory_count * sizeof(uint32_t);
+        records.push_back(read_system_chain(info.address, clusters_size + directories_size +
+                                                          info.directory_count * static_cast<uint64_t>(cluster_size)));
+        directory_data.push_back(&records.back()[clusters_size + directories_size]);
+        directory_counts.push_back(info.directory_count);
+    }
+    std::vector<DirectoryEntry> entries;
+    for (size_t i = 0; i < directory_data.size(); i++) {
+        for (uint64_t slot = 0; slot < directory_counts[i] * slots_per_cluster; slot++)
+            entries.push_back(decode_directory_entry(directory_data[i] + (slot / slots_per_cluster) * cluster_size +
+                                                     (slot % slots_per_cluster) * directory_entry_size));
+    }
+
+    // The new FAT overwrites the start of the old one, so the upgrade has to be one transaction (a crash can't leave
+    // the file system in both layouts), it either fits into the journal or it is staged in the free clusters
+    if (has_journal()) {
+        uint64_t record_clusters = 0;
+        for (const auto &record: records)
+            record_clusters += (record.size() + cluster_size - 1) / cluster_size;
+        auto blocks = directory_clusters.size() + record_clusters;
+        auto transaction_size = sizeof(JournalTransaction) + (blocks + 2) * sizeof(JournalBlock) +
+                                blocks * cluster_size + static_cast<uint64_t>(cluster_count) * sizeof(uint32_t) +
+                                METADATA_SIZE;
+        std::vector<char> staging;
+        if (transaction_size > meta_data.journal_size - JOURNAL_HEADER_SIZE && !plan_staging(transaction_size, staging)) {
+            errors() << NO_SPACE << std::endl;
             return false;
+        }
+    }
+
+    // Switch to the new layout, the FAT takes only the start of its old place (the data doesn't move)
+    meta_data.version = CURRENT_VERSION;
+    meta_data.fat_size = static_cast<uint64_t>(cluster_count) * sizeof(uint32_t);
+    fat_entry_size = sizeof(uint32_t);
+
+    // Write the directories back in the new layout
+    size_t next_entry = 0;
+    for (size_t i = 0; i < directory_data.size(); i++) {
+        for (uint64_t slot = 0; slot < directory_counts[i] * slots_per_cluster; slot++)
+            encode_directory_entry(entries[next_entry++], directory_data[i] + (slot / slots_per_cluster) * cluster_size +
+                                                          (slot % slots_per_cluster) * directory_entry_size);
+    }
+    for (size_t i = 0; i < directory_clusters.size(); i++)
+        write_metadata(get_data_address(directory_clusters[i]), &directories[i * cluster_size], cluster_size);
+    for (size_t i = 0; i < records.size(); i++) {
+        // The record stays in its own chain
+        auto cluster_address = snapshots[i].address;
+        for (uint64_t offset = 0; offset < records[i].size(); offset += cluster_size) {
+            write_metadata(cluster_address, &records[i][offset], std::min<uint64_t>(cluster_size, records[i].size() - offset));
+            cluster_address = read_from_fat(get_cluster_index(cluster_address));
+        }
     }
 
+    // The whole FAT is written again in the new layout
+    auto &dirty = has_journal() ? journal_fat_dirty : fat_dirty;
+    auto &dirty_low = has_journal() ? journal_fat_low : fat_dirty_low;
+    auto &dirty_high = has_journal() ? journal_fat_high : fat_dirty_high;
+    std::fill(dirty.begin(), dirty.end(), true);
+    dirty_low = 0;
+    dirty_high = cluster_count - 1;
+
+    // Everything known about the directories is thrown away, the upgrade is committed right away (without the
+    // journal, the meta data of the new layout is written only after the rest is on the disk)
+    directory_indexes.clear();
+    path_cache.clear();
+    if (!has_journal()) {
+        commit_transaction();
+        device->sync();
+    }
+    write_meta_data();
+    commit_transaction();
+    commit_journal();
+
+    // The rest of the old FAT isn't used anymore
+    if (options.discard)
+        device->discard(meta_data.fat_start_address + meta_data.fat_size, meta_data.fat_size);
     return true;
 }
 
 void PseudoFS::call_cmd(const std::string &cmd, const std::vector<std::string> &args) {
-    if (commands.count(cmd))
+    if (commands.count(cmd)) {
+        if (!has_required_arguments(cmd, args))
+            return;
         (this->*commands[cmd])(args);
-    else {
-        std::cerr << "Unknown command: " << cmd << std::endl;
-        std::cerr << "Type 'help' for a list of commands" << std::endl;
+        // The changes made by the command are one transaction
+        flush_refcounts();
+        commit_transaction();
+    } else {
+        errors() << "Unknown command: " << cmd << std::endl;
+        errors() << "Type 'help' for a list of commands" << std::endl;
+    }
+}
+
+void PseudoFS::call_cmd(Session &session, const std::string &cmd, const std::vector<std::string> &args) {
+    bool read_only = read_only_commands.count(cmd) != 0;
+    std::shared_lock<std::shared_mutex> shared_guard(fs_lock, std::defer_lock);
+    std::unique_lock<std::shared_mutex> exclusive_guard(fs_lock, std::defer_lock);
+    if (read_only)
+        shared_guard.lock();
+    else
+        exclusive_guard.lock();
+    current_session = &session;
+
+    // The working directory could have been removed by another session, or moved by a restore or defrag
+    auto &directory = session.working_directory;
+    uint64_t working_directory_address;
+    if (!directory.path.empty() && find_directory(directory.path, working_directory_address))
+        directory.cluster_address = working_directory_address;
+    else
+        directory = ROOT_DIRECTORY;
+
+    // The read-only commands have nothing to commit (and the commit isn't safe next to the other sessions)
+    if (read_only) {
+        if (has_required_arguments(cmd, args))
+            (this->*commands.at(cmd))(args);
+    } else {
+        call_cmd(cmd, args);
+        session.uncommitted = true;
     }
+    current_session = nullptr;
+}
+
+void PseudoFS::commit_journal(Session &session) {
+    if (!session.uncommitted)
+        return;
+    std::unique_lock<std::shared_mutex> guard(fs_lock);
+    commit_journal();
+    session.uncommitted = false;
 }
 
 std::string PseudoFS::get_working_directory_path() const {
     return working_directory.path;
 }
 
+std::string PseudoFS::get_working_directory_path(const Session &session) {
+    // The session starts in the root directory (the root is changed by format)
+    std::shared_lock<std::shared_mutex> guard(fs_lock);
+    return session.working_directory.path.empty() ? ROOT_DIRECTORY.path : session.working_directory.path;
+}
+
 
 bool PseudoFS::help(const std::vector<std::string> &args) {
-    std::cout << "-------------------------------------------------------------------------------" << std::endl;
-    std::cout << "| help              | display this message                                    |" << std::endl;
-    std::cout << "| exit              | exit the program                                        |" << std::endl;
-    std::cout << "| meta              | display meta information about the file system          |" << std::endl;
-    std::cout << "| fat               | display the FAT                                         |" << std::endl;
-    std::cout << "| cp <src> <dst>    | copy file from <src> to <dst>                           |" << std::endl;
-    std::cout << "| mv <src> <dst>    | move file from <src> to <dst>                           |" << std::endl;
-    std::cout << "| rm <file>         | remove file <file>                                      |" << std::endl;
-    std::cout << "| mkdir <dir>       | create directory <dir>                                  |" << std::endl;
-    std::cout << "| rmdir <dir>       | remove directory <dir>                                  |" << std::endl;
-    std::cout << "| ls <dir>          | list directory <dir> contents                           |" << std::endl;
-    std::cout << "| cat <file>        | display file <file> contents                            |" << std::endl;
-    std::cout << "| cd <dir>          | change current directory to <dir>                       |" << std::endl;
-    std::cout << "| pwd               | print working directory                                 |" << std::endl;
-    std::cout << "| info <dir/file>   | display information about directory <dir> / file <file> |" << std::endl;
-    std::cout << "| incp <src> <dst>  | copy file from disk <src> to <dst> in the file system   |" << std::endl;
-    std::cout << "| outcp <src> <dst> | copy file from <src> in the file system to disk <dst>   |" << std::endl;
-    std::cout << "| load <file>       | load file <file> from disk and execute commands from it |" << std::endl;
-    std::cout << "| format <size>     | format the file system with size <size>                 |" << std::endl;
-    std::cout << "| defrag <file>     | defragment the file <file>                              |" << std::endl;
-    std::cout << "-------------------------------------------------------------------------------" << std::endl;
+    output() << "-------------------------------------------------------------------------------" << std::endl;
+    output() << "| help              | display this message                                    |" << std::endl;
+    output() << "| exit              | exit the program                                        |" << std::endl;
+    output() << "| meta              | display meta information about the file system          |" << std::endl;
+    output() << "| fat               | display the FAT                                         |" << std::endl;
+    output() << "| cp <src> <dst>    | copy file from <src> to <dst>                           |" << std::endl;
+    output() << "|   [--reflink]     | (--reflink shares the clusters instead of copying them) |" << std::endl;
+    output() << "| mv <src> <dst>    | move file from <src> to <dst>                           |" << std::endl;
+    output() << "| rm [--secure] <f> | remove file <f> (--secure also overwrites its data)     |" << std::endl;
+    output() << "| mkdir <dir>       | create directory <dir>                                  |" << std::endl;
+    output() << "| rmdir <dir>       | remove directory <dir>                                  |" << std::endl;
+    output() << "| ls <dir>          | list directory <dir> contents                           |" << std::endl;
+    output() << "| cat <file>        | display file <file> contents                            |" << std::endl;
+    output() << "| cd <dir>          | change current directory to <dir>                       |" << std::endl;
+    output() << "| pwd               | print working directory                                 |" << std::endl;
+    output() << "| info <dir/file>   | display information about directory <dir> / file <file> |" << std::endl;
+    output() << "| incp <src> <dst>  | copy file from disk <src> to <dst> in the file system   |" << std::endl;
+    output() << "| outcp <src> <dst> | copy file from <src> in the file system to disk <dst>   |" << std::endl;
+    output() << "| load <file>       | load file <file> from disk and execute commands from it |" << std::endl;
+    output() << "| format <sz> [cs]  | format the file system, size <sz>, cluster size [cs]    |" << std::endl;
+    output() << "|   [--full]        | (--full also writes zeroes to all the data clusters)    |" << std::endl;
+    output() << "| defrag <file>     | defragment the file <file>                              |" << std::endl;
+    output() << "| defrag -a         | defragment the whole file system                        |" << std::endl;
+    output() << "| fragstat          | display the fragmentation of the whole file system      |" << std::endl;
+    output() << "| snapshot <cmd>    | create / list / restore / delete file system snapshots  |" << std::endl;
+    output() << "|   [name]          | (create, restore and delete take the snapshot [name])   |" << std::endl;
+    output() << "| fsck [--repair]   | check the file system (--repair also repairs it)        |" << std::endl;
+    output() << "| upgrade           | convert the file system to the current layout version   |" << std::endl;
+    output() << "| sync              | write all cached changes to the disk                    |" << std::endl;
+    output() << "| cache             | display the cluster cache statistics                    |" << std::endl;
+    output() << "-------------------------------------------------------------------------------" << std::endl;
     return true;
 }
 
 bool PseudoFS::meta(const std::vector<std::string> &args) {
-    std::cout << "-------------------------------------------------------------------------------" << std::endl;
-    std::cout << "Signature:          " << meta_data.signature << std::endl;
-    std::cout << "Disk size:          " << meta_data.disk_size << std::endl;
-    std::cout << "Cluster size:       " << meta_data.cluster_size << std::endl;
-    std::cout << "Cluster count:      " << meta_data.cluster_count << std::endl;
-    std::cout << "Fat start address:  " << meta_data.fat_start_address << std::endl;
-    std::cout << "Fat size:           " << meta_data.fat_size << std::endl;
-    std::cout << "Data start address: " << meta_data.data_start_address << std::endl;
-    std::cout << "-------------------------------------------------------------------------------" << std::endl;
+    output() << "-------------------------------------------------------------------------------" << std::endl;
+    output() << "Signature:          " << meta_data.signature << std::endl;
+    output() << "Version:            " << meta_data.version << std::endl;
+    output() << "Disk size:          " << meta_data.disk_size << std::endl;
+    output() << "Cluster size:       " << meta_data.cluster_size << std::endl;
+    output() << "Cluster count:      " << meta_data.cluster_count << std::endl;
+    output() << "Fat start address:  " << meta_data.fat_start_address << std::endl;
+    output() << "Fat size:           " << meta_data.fat_size << std::endl;
+    output() << "Data start address: " << meta_data.data_start_address << std::endl;
+    output() << "-------------------------------------------------------------------------------" << std::endl;
     return true;
 }
 
 bool PseudoFS::fat(const std::vector<std::string> &args) {
-    std::cout << "-------------------------------------------------------------------------------" << std::endl;
-    file_system.seekp(meta_data.fat_start_address);
-    for (int i = 0; i < meta_data.cluster_count; i++) {
-        uint32_t cluster{};
-        file_system.read(reinterpret_cast<char *>(&cluster), sizeof(uint32_t));
+    output() << "-------------------------------------------------------------------------------" << std::endl;
+    // The next clusters are shown the way the layout stores them (cluster indices since the version 3, addresses before)
+    for (int i = 0; i < fat_table.size(); i++) {
+        auto cluster = fat_table[i];
         if (cluster == FAT_FREE)
-            std::cout << i << ": " << "FREE" << std::endl;
+            output() << i << ": " << "FREE" << std::endl;
         else if (cluster == FAT_EOF)
-            std::cout << i << ": " << "EOF" << std::endl;
+            output() << i << ": " << "EOF" << std::endl;
         else if (cluster == FAT_BAD)
-            std::cout << i << ": " << "BAD" << std::endl;
+            output() << i << ": " << "BAD" << std::endl;
         else
-            std::cout << i << ": " << cluster << std::endl;
+            output() << i << ": " << (meta_data.version >= 3 ? cluster : get_value_address(cluster)) << std::endl;
     }
-    std::cout << "-------------------------------------------------------------------------------" << std::endl;
+
+    // Summary of the special entries
+    output() << "-------------------------------------------------------------------------------" << std::endl;
+    output() << "Free: " << fat_scanner->count(fat_table.data(), fat_table.size(), FAT_FREE)
+             << ", EOF: " << fat_scanner->count(fat_table.data(), fat_table.size(), FAT_EOF)
+             << ", bad: " << fat_scanner->count(fat_table.data(), fat_table.size(), FAT_BAD) << std::endl;
+    output() << "-------------------------------------------------------------------------------" << std::endl;
     return true;
 }
 
 bool PseudoFS::cp(const std::vector<std::string> &args) {
-    // First check if the source file exists
-    auto saved_working_directory = working_directory;
-    std::string file_name = args[1].substr(args[1].find_last_of('/') + 1, args[1].size());
-    std::string file_path = args[1].substr(0, args[1].find_last_of('/'));
-    std::vector<std::string> cd_args_file = {"cd", file_path, "don't print ok"};
-    bool result_cd_file = true;
-    // If directory path is not empty, change working directory
-    if (args[1].find('/') != std::string::npos)
-        result_cd_file = this->cd(cd_args_file);
+    // The --reflink flag can be given before the paths
+    bool reflink = args.size() > 3 && args[1] == "--reflink";
+    const auto &source_path = reflink ? args[2] : args[1];
+    const auto &destination_path = reflink ? args[3] : args[2];
 
-    // Error could have occurred while changing working directory
-    if (!result_cd_file) {
-        working_directory = saved_working_directory;
+    // First check if the source file exists
+    PathHandle source;
+    if (!resolve_path(source_path, source))
         return false;
-    }
 
     // Check if file with the given name exists
-    auto source_entry = DirectoryEntry{};
-    if (!does_entry_exist(file_name, source_entry)) {
-        std::cerr << FILE_NOT_FOUND << std::endl;
-        working_directory = saved_working_directory;
+    auto source_entry = source.entry;
+    if (!source_entry.start_cluster) {
+        errors() << FILE_NOT_FOUND << std::endl;
         return false;
     }
 
     // Check if the source file is a directory
     if (source_entry.is_directory) {
-        std::cerr << FILE_IS_DIRECTORY << std::endl;
-        working_directory = saved_working_directory;
+        errors() << FILE_IS_DIRECTORY << std::endl;
         return false;
     }
 
     // Second check that the destination directory exists
-    working_directory = saved_working_directory;
-
-    std::string new_file_name = args[2].substr(args[2].find_last_of('/') + 1, args[2].size());
-    std::string dir_path = args[2].substr(0, args[2].find_last_of('/'));
-    std::vector<std::string> cd_args_dir = {"cd", dir_path, "don't print ok"};
-    bool result_cd_dir = true;
-    // If directory path is not empty, change working directory
-    if (args[2].find('/') != std::string::npos)
-        result_cd_dir = this->cd(cd_args_dir);
+    PathHandle destination;
+    if (!resolve_path(destination_path, destination))
+        return false;
+    const auto &new_file_name = destination.name;
 
-    // Error could have occurred while changing working directory
-    if (!result_cd_dir) {
-        working_directory = saved_working_directory;
+    // Check if file with the given name exists
+    if (destination.entry.start_cluster) {
+        errors() << FILE_ALREADY_EXISTS << std::endl;
         return false;
     }
 
-    // Check if file with the given name exists
-    auto existence_check = DirectoryEntry{};
-    if (does_entry_exist(new_file_name, existence_check)) {
-        std::cerr << FILE_ALREADY_EXISTS << std::endl;
-        working_directory = saved_working_directory;
+    // Make sure the destination directory has space for the new entry (and the data fits before it grows)
+    if ((!reflink && !has_space_for(source_entry.size, destination.directory)) ||
+        !reserve_directory_slot(destination.directory)) {
         return false;
     }
 
@@ -347,249 +2631,188 @@ bool PseudoFS::cp(const std::vector<std::string> &args) {
         new_entry.item_name[i] = new_file_name[i];
     new_entry.item_name[DEFAULT_FILE_NAME_LENGTH - 1] = '\0';
 
-    // Find free cluster
-    auto index = find_free_cluster();
-    if (index == FAT_EOF) {
-        std::cerr << NO_SPACE << std::endl;
-        working_directory = saved_working_directory;
-        return false;
+    // Reflink copy shares all the clusters of the source, the clusters are freed only when both files are removed
+    if (reflink) {
+        if (!share_clusters(get_file_extents(source_entry)))
+            return false;
+        new_entry.start_cluster = source_entry.start_cluster;
+        write_directory_entry(destination.directory, new_entry);
+        output() << OK << std::endl;
+        return true;
     }
-    auto write_cluster_address = meta_data.data_start_address + index * meta_data.cluster_size;
-    auto write_cluster_index = get_cluster_index(write_cluster_address);
-    new_entry.start_cluster = write_cluster_address;
-    auto read_cluster_address = source_entry.start_cluster;
-    auto read_cluster_index = get_cluster_index(read_cluster_address);
-    write_to_fat(write_cluster_index, FAT_EOF); // Marking as used; EOF will do for now, later it will be changed
-    uint32_t previous_cluster_index = 0;
-
-    // Copy the file
-    auto number_of_iterations = source_entry.size / meta_data.cluster_size + 1;
-
-    for (int i = 0; i < number_of_iterations; i++) {
-        // Write cluster address to FAT
-        if (previous_cluster_index != 0)
-            write_to_fat(previous_cluster_index, write_cluster_address);
-
-        previous_cluster_index = write_cluster_index;
-
-        // Read and write cluster
-        if (i != number_of_iterations - 1) {
-            char *buffer = new char[meta_data.cluster_size];
-            read_from_cluster(read_cluster_address, buffer, static_cast<int>(meta_data.cluster_size));
-            write_to_cluster(write_cluster_address, buffer, static_cast<int>(meta_data.cluster_size));
-            delete[] buffer;
-        }
-            // Last iteration
-        else {
-            char *buffer = new char[source_entry.size % meta_data.cluster_size];
-            read_from_cluster(read_cluster_address, buffer,
-                              static_cast<int>(source_entry.size % meta_data.cluster_size));
-            write_to_cluster(write_cluster_address, buffer,
-                             static_cast<int>(source_entry.size % meta_data.cluster_size));
-            delete[] buffer;
-            break;
-        }
 
-        // Find next free cluster
-        index = find_free_cluster();
-        if (!index) {
-            std::cerr << NO_SPACE << std::endl;
-            working_directory = saved_working_directory;
-            return false;
+    // Allocate all the clusters of the copy at once (as few contiguous extents as possible)
+    auto number_of_clusters = source_entry.size / meta_data.cluster_size + 1;
+    std::vector<Extent> extents;
+    if (!allocate_clusters(number_of_clusters, extents)) {
+        return false;
+    }
+    new_entry.start_cluster = meta_data.data_start_address + extents[0].start * meta_data.cluster_size;
+
+    // Copy the file - pair the source extents with the new ones and copy each run of clusters in one go
+    auto source_extents = get_file_extents(source_entry);
+    std::vector<ClusterCopy> copies;
+    size_t source_extent = 0;
+    uint32_t source_used = 0;
+    for (const auto &extent: extents) {
+        uint32_t copied = 0;
+        while (copied < extent.length && source_extent < source_extents.size()) {
+            const auto &piece = source_extents[source_extent];
+            auto length = std::min(extent.length - copied, piece.length - source_used);
+            copies.push_back(ClusterCopy{piece.start + source_used, extent.start + copied, length});
+            copied += length;
+            source_used += length;
+            if (source_used == piece.length) {
+                source_extent++;
+                source_used = 0;
+            }
         }
-        write_cluster_index = meta_data.fat_start_address + index * sizeof(uint32_t);
-        write_to_fat(write_cluster_index, FAT_EOF); // Marking as used; EOF will do for now, later it will be changed
-        write_cluster_address = get_cluster_address(write_cluster_index);
-
-        // Find next cluster to read
-        read_cluster_address = read_from_fat(read_cluster_index);
-        read_cluster_index = get_cluster_index(read_cluster_address);
+    }
+    if (!copy_clusters(copies)) {
+        free_allocated_clusters(extents);
+        return false;
     }
 
     // Write directory entry to directory
-    write_directory_entry(working_directory.cluster_address, new_entry);
+    write_directory_entry(destination.directory, new_entry);
 
-    // Restore and update working directory
-    working_directory = saved_working_directory;
-    working_directory.entries = get_directory_entries(working_directory.cluster_address);
-
-    std::cout << OK << std::endl;
+    output() << OK << std::endl;
     return true;
 }
 
 bool PseudoFS::mv(const std::vector<std::string> &args) {
     // First check that the file exists
-    auto saved_working_directory = working_directory;
-    std::string file_name = args[1].substr(args[1].find_last_of('/') + 1, args[1].size());
-    std::string file_path = args[1].substr(0, args[1].find_last_of('/'));
-    std::vector<std::string> cd_args_file = {"cd", file_path, "don't print ok"};
-    bool result_cd_file = true;
-    // If directory path is not empty, change working directory
-    if (args[1].find('/') != std::string::npos)
-        result_cd_file = this->cd(cd_args_file);
+    PathHandle source;
+    if (!resolve_path(args[1], source))
+        return false;
 
-    // Error could have occurred while changing working directory
-    if (!result_cd_file) {
-        working_directory = saved_working_directory;
+    // Check if file with the given name exists
+    auto entry = source.entry;
+    if (!entry.start_cluster) {
+        errors() << FILE_NOT_FOUND << std::endl;
         return false;
     }
 
-    // Check if file with the given name exists
-    auto entry = DirectoryEntry{};
-    if (!does_entry_exist(file_name, entry)) {
-        std::cerr << FILE_NOT_FOUND << std::endl;
-        working_directory = saved_working_directory;
+    // A directory can't be moved under itself, it would be cut off from the rest of the tree
+    auto source_path = normalize_path(args[1]);
+    if (entry.is_directory && normalize_path(args[2]).starts_with(source_path)) {
+        errors() << CANNOT_MOVE_DIR_INTO_ITSELF << std::endl;
         return false;
     }
 
     // Second check that the destination directory exists
-    working_directory = saved_working_directory;
-
-    std::string new_file_name = args[2].substr(args[2].find_last_of('/') + 1, args[2].size());
-    std::string dir_path = args[2].substr(0, args[2].find_last_of('/'));
-    std::vector<std::string> cd_args_dir = {"cd", dir_path, "don't print ok"};
-    bool result_cd_dir = true;
-    // If directory path is not empty, change working directory
-    if (args[2].find('/') != std::string::npos)
-        result_cd_dir = this->cd(cd_args_dir);
-
-    // Error could have occurred while changing working directory
-    if (!result_cd_dir) {
-        working_directory = saved_working_directory;
+    PathHandle destination;
+    if (!resolve_path(args[2], destination))
         return false;
-    }
+    const auto &new_file_name = destination.name;
 
     // Check if file with the given name exists
-    auto existence_check = DirectoryEntry{};
-    if (does_entry_exist(new_file_name, existence_check)) {
-        std::cerr << FILE_ALREADY_EXISTS << std::endl;
-        working_directory = saved_working_directory;
+    if (destination.entry.start_cluster) {
+        errors() << FILE_ALREADY_EXISTS << std::endl;
         return false;
     }
 
-    // Everything looks fine, let's move the file - remove the entry from the old path
-    working_directory = saved_working_directory;
-    if (args[1].find('/') != std::string::npos)
-        cd(cd_args_file);
-    remove_directory_entry(working_directory.cluster_address, entry);
+    // Make sure the destination directory has space for the entry (within one directory the entry keeps its slot)
+    if (destination.directory != source.directory && !reserve_directory_slot(destination.directory)) {
+        return false;
+    }
 
     // Modify the file name
     for (int i = 0; i < DEFAULT_FILE_NAME_LENGTH - 1; i++)
         entry.item_name[i] = new_file_name[i];
     entry.item_name[DEFAULT_FILE_NAME_LENGTH - 1] = '\0';
 
-    // Add the entry to the new path
-    working_directory = saved_working_directory;
-    if (args[2].find('/') != std::string::npos)
-        cd(cd_args_dir);
-    write_directory_entry(working_directory.cluster_address, entry);
+    // Everything looks fine, let's move the file - within one directory it is renamed in place, otherwise the entry
+    // is removed from the old path and added to the new one (into the reserved slot)
+    if (destination.directory == source.directory)
+        rename_directory_entry(source.directory, source.entry.item_name, entry);
+    else {
+        remove_directory_entry(source.directory, source.entry);
+        write_directory_entry(destination.directory, entry);
+    }
 
-    // Restore and update working directory
-    working_directory = saved_working_directory;
-    working_directory.entries = get_directory_entries(working_directory.cluster_address);
+    // A moved directory has a new parent and the cached paths under its old path are no longer valid
+    if (entry.is_directory) {
+        update_directory_entry(entry.start_cluster, DirectoryEntry{"..", true, 0, destination.directory});
+        invalidate_path_cache(source_path);
+    }
 
-    std::cout << OK << std::endl;
+    output() << OK << std::endl;
     return true;
 }
 
 bool PseudoFS::rm(const std::vector<std::string> &args) {
-    // Change working directory
-    auto saved_working_directory = working_directory;
-    std::string file_name = args[1].substr(args[1].find_last_of('/') + 1, args[1].size());
-    std::string file_path = args[1].substr(0, args[1].find_last_of('/'));
-    std::vector<std::string> cd_args = {"cd", file_path, "don't print ok"};
-    bool result_cd = true;
-    // If directory path is not empty, change working directory
-    if (args[1].find('/') != std::string::npos)
-        result_cd = this->cd(cd_args);
+    // The --secure flag can be given before the path
+    bool secure = args.size() > 2 && args[1] == "--secure";
+    const auto &path = secure ? args[2] : args[1];
 
-    // Error could have occurred while changing working directory
-    if (!result_cd) {
-        working_directory = saved_working_directory;
+    // Find the directory of the file
+    PathHandle file;
+    if (!resolve_path(path, file))
         return false;
-    }
 
     // Check if file with the given name exists
-    auto entry = DirectoryEntry{};
-    if (!does_entry_exist(file_name, entry)) {
-        std::cerr << FILE_NOT_FOUND << std::endl;
-        working_directory = saved_working_directory;
+    auto entry = file.entry;
+    if (!entry.start_cluster) {
+        errors() << FILE_NOT_FOUND << std::endl;
         return false;
     }
 
     // Check if file is not a directory
     if (entry.is_directory) {
-        std::cerr << FILE_IS_DIRECTORY << std::endl;
-        working_directory = saved_working_directory;
+        errors() << FILE_IS_DIRECTORY << std::endl;
         return false;
     }
 
-    // Remove file
-    auto cluster_address = entry.start_cluster;
-    auto cluster_index = get_cluster_index(cluster_address);
-    auto number_of_iterations = entry.size / meta_data.cluster_size + 1;
-
-    for (int i = 0; i < number_of_iterations; i++) {
-        write_to_cluster(cluster_address, &EMPTY_CLUSTER[0], static_cast<int>(meta_data.cluster_size));
-
-        auto next_cluster = read_from_fat(cluster_index);
-        write_to_fat(cluster_index, FAT_FREE);
-
-        cluster_address = next_cluster;
-        cluster_index = get_cluster_index(cluster_address);
+    // Remove file - only mark the clusters as free, the data is overwritten only if asked for
+    // (clusters shared with other files just lose a reference)
+    auto extents = drop_cluster_references(get_file_extents(entry));
+    for (const auto &extent: extents) {
+        for (uint32_t i = extent.start; i < extent.start + extent.length; i++)
+            write_to_fat(get_fat_index(i), FAT_FREE);
     }
-    write_to_fat(cluster_index, FAT_FREE);
+    release_clusters(extents, secure);
 
     // Remove entry from directory
-    remove_directory_entry(working_directory.cluster_address, entry);
+    remove_directory_entry(file.directory, entry);
 
-    // Restore and update working directory
-    working_directory = saved_working_directory;
-    working_directory.entries = get_directory_entries(working_directory.cluster_address);
-
-    std::cout << OK << std::endl;
+    output() << OK << std::endl;
     return true;
 }
 
 bool PseudoFS::mkdir(const std::vector<std::string> &args) {
-    // Change working directory
-    auto saved_working_directory = working_directory;
-    std::string dir_name = args[1].substr(args[1].find_last_of('/') + 1, args[1].size());
-    std::string dir_path = args[1].substr(0, args[1].find_last_of('/'));
-    std::vector<std::string> cd_args = {"cd", dir_path, "don't print ok"};
-    bool result_cd = true;
-    // If directory path is not empty, change working directory
-    if (args[1].find('/') != std::string::npos)
-        result_cd = this->cd(cd_args);
+    // Find the parent directory
+    PathHandle dir;
+    if (!resolve_path(args[1], dir))
+        return false;
+    const auto &dir_name = dir.name;
 
-    // Error could have occurred while changing working directory
-    if (!result_cd) {
-        working_directory = saved_working_directory;
+    // Check if directory (or file) with the same name already exists
+    if (dir.entry.start_cluster) {
+        errors() << DIRECTORY_ALREADY_EXISTS << std::endl;
         return false;
     }
 
-    // Check if directory (or file) with the same name already exists
-    auto existence_check = DirectoryEntry{};
-    if (does_entry_exist(dir_name, existence_check)) {
-        std::cerr << DIRECTORY_ALREADY_EXISTS << std::endl;
-        working_directory = saved_working_directory;
+    // Make sure the parent directory has space for the new entry (and the new directory fits before it grows)
+    if (!has_space_for(0, dir.directory) || !reserve_directory_slot(dir.directory)) {
         return false;
     }
 
     // Find free cluster
     auto index = find_free_cluster();
     if (!index) {
-        std::cerr << NO_SPACE << std::endl;
-        working_directory = saved_working_directory;
+        errors() << NO_SPACE << std::endl;
         return false;
     }
 
     // Calculate address and index of the cluster
-    auto cluster_address = meta_data.data_start_address + index * meta_data.cluster_size;
+    auto cluster_address = get_data_address(index);
     auto cluster_index = get_cluster_index(cluster_address);
 
-    // Mark cluster as used in FAT table
+    // Mark cluster as used in FAT table and clear it (free clusters can contain old data)
     write_to_fat(cluster_index, FAT_EOF);
+    write_metadata(cluster_address, &EMPTY_CLUSTER[0], meta_data.cluster_size);
+    directory_indexes.erase(cluster_address);
 
     // Create new directory entry
     DirectoryEntry entry{"", true, 0, cluster_address};
@@ -597,146 +2820,114 @@ bool PseudoFS::mkdir(const std::vector<std::string> &args) {
         entry.item_name[i] = dir_name[i];
     entry.item_name[DEFAULT_FILE_NAME_LENGTH - 1] = '\0';
     DirectoryEntry this_entry{".", true, 0, cluster_address};
-    DirectoryEntry parent_entry{"..", true, 0, working_directory.cluster_address};
+    DirectoryEntry parent_entry{"..", true, 0, dir.directory};
 
     // Write current and parent directory entries to the cluster
     write_directory_entry(cluster_address, this_entry);
     write_directory_entry(cluster_address, parent_entry);
 
     // Add new directory entry to parent directory
-    write_directory_entry(working_directory.cluster_address, entry);
+    write_directory_entry(dir.directory, entry);
 
-    // Restore and update working directory
-    working_directory = saved_working_directory;
-    working_directory.entries = get_directory_entries(working_directory.cluster_address);
-
-    std::cout << OK << std::endl;
+    output() << OK << std::endl;
     return true;
 }
 
 bool PseudoFS::rmdir(const std::vector<std::string> &args) {
-    // Change working directory
-    auto saved_working_directory = working_directory;
-    std::string dir_name = args[1].substr(args[1].find_last_of('/') + 1, args[1].size());
-    if (dir_name == ".") {
-        std::cerr << CANNOT_REMOVE_CURR_DIR << std::endl;
+    // Find the parent directory
+    PathHandle dir;
+    if (!resolve_path(args[1], dir))
         return false;
-    }
-    std::string dir_path = args[1].substr(0, args[1].find_last_of('/'));
-    std::vector<std::string> cd_args = {"cd", dir_path, "don't print ok"};
-    bool result_cd = true;
-    // If directory path is not empty, change working directory
-    if (args[1].find('/') != std::string::npos)
-        result_cd = this->cd(cd_args);
-
-    // Error could have occurred while changing working directory
-    if (!result_cd) {
-        working_directory = saved_working_directory;
+    if (dir.name == ".") {
+        errors() << CANNOT_REMOVE_CURR_DIR << std::endl;
         return false;
     }
 
     // Check if directory with the given name exists
-    auto entry = DirectoryEntry{};
-    if (!does_entry_exist(dir_name, entry)) {
-        std::cerr << DIRECTORY_NOT_FOUND << std::endl;
-        working_directory = saved_working_directory;
+    auto entry = dir.entry;
+    if (!entry.start_cluster) {
+        errors() << DIRECTORY_NOT_FOUND << std::endl;
         return false;
     }
 
     // Check if it actually is a directory
     if (!entry.is_directory) {
-        std::cerr << FILE_IS_NOT_DIRECTORY << std::endl;
-        working_directory = saved_working_directory;
+        errors() << FILE_IS_NOT_DIRECTORY << std::endl;
         return false;
     }
 
     // Check if directory is empty
     auto entries = get_directory_entries(entry.start_cluster);
     if (entries.size() > 2) {
-        std::cerr << DIRECTORY_IS_NOT_EMPTY << std::endl;
-        working_directory = saved_working_directory;
+        errors() << DIRECTORY_IS_NOT_EMPTY << std::endl;
         return false;
     }
 
-    // Mark cluster as free in FAT table
-    auto cluster_index = get_cluster_index(entry.start_cluster);
-    write_to_fat(cluster_index, FAT_FREE);
+    // Mark all the clusters of the directory as free in FAT table (clusters kept by a snapshot just lose a reference)
+    std::vector<Extent> extents;
+    for (auto cluster_address: get_directory_index(entry.start_cluster).clusters)
+        extents.push_back(Extent{get_fat_entry(get_cluster_index(cluster_address)), 1});
+    extents = drop_cluster_references(extents);
+    for (const auto &extent: extents) {
+        for (uint32_t i = extent.start; i < extent.start + extent.length; i++)
+            write_to_fat(get_fat_index(i), FAT_FREE);
+    }
+    directory_indexes.erase(entry.start_cluster);
+    auto dir_full_path = normalize_path(args[1]);
+    invalidate_path_cache(dir_full_path);
 
     // Remove directory entry from parent directory
-    remove_directory_entry(working_directory.cluster_address, entry);
+    remove_directory_entry(dir.directory, entry);
+    release_clusters(extents, false);
 
-    // Mark cluster as free by putting zeroes in it
-    write_to_cluster(entry.start_cluster, &EMPTY_CLUSTER[0], static_cast<int>(meta_data.cluster_size));
+    // If the working directory was removed, go to the root directory
+    if (current_directory().path == dir_full_path)
+        current_directory() = ROOT_DIRECTORY;
 
-    // Restore and update working directory
-    working_directory = saved_working_directory;
-    working_directory.entries = get_directory_entries(working_directory.cluster_address);
-
-    std::cout << OK << std::endl;
+    output() << OK << std::endl;
     return true;
 }
 
 bool PseudoFS::ls(const std::vector<std::string> &args) {
-    // If argument is given, change working directory
-    bool result_cd = true;
-    auto saved_working_directory = working_directory;
-    if (args.size() > 1) {
-        std::vector<std::string> cd_args = {"cd", args[1], "don't print ok"};
-        result_cd = this->cd(cd_args);
-    }
-
-    // Error could have occurred while changing working directory
-    if (!result_cd) {
-        working_directory = saved_working_directory;
+    // If argument is given, list the given directory, otherwise the working directory
+    auto cluster_address = current_directory().cluster_address;
+    if (args.size() > 1 && !find_directory(normalize_path(args[1]), cluster_address)) {
+        errors() << PATH_NOT_FOUND << std::endl;
         return false;
     }
 
-    // List directory entries in working directory
-    for (const auto &entry: working_directory.entries) {
-        std::cout << entry.item_name << " ";
+    // List directory entries of the directory (straight from its index, nothing is copied)
+    for (const auto &entry: get_directory_index(cluster_address).slots) {
+        if (!entry.start_cluster)
+            continue;
+        output() << entry.item_name << " ";
         if (entry.is_directory)
-            std::cout << "<DIR> ";
+            output() << "<DIR> ";
         else
-            std::cout << "<FILE> ";
-        std::cout << entry.size << "B ";
-        std::cout << entry.start_cluster << std::endl;
+            output() << "<FILE> ";
+        output() << entry.size << "B ";
+        output() << entry.start_cluster << std::endl;
     }
 
-    // Restore working directory
-    working_directory = saved_working_directory;
-
     return true;
 }
 
 bool PseudoFS::cat(const std::vector<std::string> &args) {
-    // Change working directory
-    auto saved_working_directory = working_directory;
-    std::string file_name = args[1].substr(args[1].find_last_of('/') + 1, args[1].size());
-    std::string file_path = args[1].substr(0, args[1].find_last_of('/'));
-    std::vector<std::string> cd_args = {"cd", file_path, "don't print ok"};
-    bool result_cd = true;
-    // If directory path is not empty, change working directory
-    if (args[1].find('/') != std::string::npos)
-        result_cd = this->cd(cd_args);
-
-    // Error could have occurred while changing working directory
-    if (!result_cd) {
-        working_directory = saved_working_directory;
+    // Find the directory of the file
+    PathHandle file;
+    if (!resolve_path(args[1], file))
         return false;
-    }
 
     // Check if file with the given name exists
-    auto entry = DirectoryEntry{};
-    if (!does_entry_exist(file_name, entry)) {
-        std::cerr << FILE_NOT_FOUND << std::endl;
-        working_directory = saved_working_directory;
+    auto entry = file.entry;
+    if (!entry.start_cluster) {
+        errors() << FILE_NOT_FOUND << std::endl;
         return false;
     }
 
     // Check if it actually is a file
     if (entry.is_directory) {
-        std::cerr << FILE_IS_DIRECTORY << std::endl;
-        working_directory = saved_working_directory;
+        errors() << FILE_IS_DIRECTORY << std::endl;
         return false;
     }
 
@@ -745,295 +2936,227 @@ bool PseudoFS::cat(const std::vector<std::string> &args) {
     auto cluster_index = get_cluster_index(cluster_address);
     auto number_of_iterations = entry.size / meta_data.cluster_size + 1;
 
-    for (int i = 0; i < number_of_iterations; i++) {
-        if (i != number_of_iterations - 1) {
-            auto bytes_to_read = meta_data.cluster_size;
-            char *buffer = new char[bytes_to_read];
-            read_from_cluster(cluster_address, buffer, static_cast<int>(bytes_to_read));
-            std::cout << buffer;
-            delete[] buffer;
-        }
-            // Last iteration
-        else {
-            auto bytes_to_read = entry.size % meta_data.cluster_size;
-            char *buffer = new char[bytes_to_read];
-            read_from_cluster(cluster_address, buffer, static_cast<int>(bytes_to_read));
-            std::cout << buffer << std::endl;
-            delete[] buffer;
+    for (uint64_t i = 0; i < number_of_iterations; i++) {
+        auto bytes_to_read = i != number_of_iterations - 1 ? meta_data.cluster_size
+                                                            : entry.size % meta_data.cluster_size;
+        {
+            // A cluster that isn't cached has no changes waiting, the mapped image gives it without copying
+            std::lock_guard<std::recursive_mutex> guard(cache_lock);
+            auto data = cache->is_cached(cluster_address) ? nullptr : device->view(cluster_address, bytes_to_read);
+            if (!data)
+                data = view_file_cluster(cluster_address);
+            output().write(data, bytes_to_read);
         }
+        // Last iteration
+        if (i == number_of_iterations - 1)
+            output() << std::endl;
 
         cluster_address = read_from_fat(cluster_index);
         cluster_index = get_cluster_index(cluster_address);
     }
 
-    // Restore working directory
-    working_directory = saved_working_directory;
-
     return true;
 }
 
 bool PseudoFS::cd(const std::vector<std::string> &args) {
     // If no argument is given, go to root directory
-    if (args.size() == 1 || args[1].empty() || args[1] == "/") {
-        change_directory("");
-        if (args.size() == 2) // When other functions use this function, they don't want to print OK
-            std::cout << OK << std::endl;
-        return true;
-    }
+    auto path = args.size() == 1 || args[1].empty() ? std::string("/") : normalize_path(args[1]);
 
-    // Save current working directory
-    auto saved_working_directory = working_directory;
-
-    // If argument is given, tokenize the path and go to the directory
-    std::stringstream ss(args[1]);
-    std::string token;
-    std::vector<std::string> path_tokenized;
-    while (std::getline(ss, token, '/'))
-        path_tokenized.push_back(token);
-
-    // Go to the directory one by one
-    for (const auto &path: path_tokenized)
-        if (!change_directory(path)) {
-            working_directory = saved_working_directory;
-            std::cerr << PATH_NOT_FOUND << std::endl;
-            return false;
-        }
+    // Find the directory (the whole path is usually resolved by one lookup in the path cache)
+    uint64_t cluster_address;
+    if (!find_directory(path, cluster_address)) {
+        errors() << PATH_NOT_FOUND << std::endl;
+        return false;
+    }
+    current_directory() = WorkingDirectory{cluster_address, path};
 
     if (args.size() == 2) // When other functions use this function, they don't want to print OK
-        std::cout << OK << std::endl;
+        output() << OK << std::endl;
     return true;
 }
 
 bool PseudoFS::pwd(const std::vector<std::string> &args) {
-    std::cout << working_directory.path << std::endl;
+    output() << current_directory().path << std::endl;
     return true;
 }
 
 bool PseudoFS::info(const std::vector<std::string> &args) {
-    // Change working directory
-    auto saved_working_directory = working_directory;
-    std::string file_name = args[1].substr(args[1].find_last_of('/') + 1, args[1].size());
-    std::string file_path = args[1].substr(0, args[1].find_last_of('/'));
-    std::vector<std::string> cd_args = {"cd", file_path, "don't print ok"};
-    bool result_cd = true;
-    // If directory path is not empty, change working directory
-    if (args[1].find('/') != std::string::npos)
-        result_cd = this->cd(cd_args);
-
-    // Error could have occurred while changing working directory
-    if (!result_cd) {
-        working_directory = saved_working_directory;
+    // Find the directory of the file
+    PathHandle file;
+    if (!resolve_path(args[1], file))
         return false;
-    }
 
     // Check if file with the given name exists
-    auto entry = DirectoryEntry{};
-    if (!does_entry_exist(file_name, entry)) {
-        std::cerr << FILE_NOT_FOUND << std::endl;
-        working_directory = saved_working_directory;
+    auto entry = file.entry;
+    if (!entry.start_cluster) {
+        errors() << FILE_NOT_FOUND << std::endl;
         return false;
     }
 
     // Print file info
-    std::cout << "File name: " << entry.item_name << std::endl;
+    output() << "File name: " << entry.item_name << std::endl;
     if (entry.is_directory)
-        std::cout << "Type: directory" << std::endl;
+        output() << "Type: directory" << std::endl;
     else
-        std::cout << "Type: file" << std::endl;
-    std::cout << "File size: " << entry.size << "B" << std::endl;
-    std::cout << "File start cluster address: " << entry.start_cluster << std::endl;
-    std::cout << "File clusters: ";
+        output() << "Type: file" << std::endl;
+    output() << "File size: " << entry.size << "B" << std::endl;
+    output() << "File start cluster address: " << entry.start_cluster << std::endl;
+    auto first_cluster = get_fat_entry(get_cluster_index(entry.start_cluster));
+    if (!cluster_refs.empty() && cluster_refs[first_cluster])
+        output() << "Shared with: " << cluster_refs[first_cluster] << " other file(s)" << std::endl;
+    output() << "File clusters: ";
     auto cluster_address = entry.start_cluster;
     auto cluster_index = get_cluster_index(cluster_address);
     while (cluster_address != FAT_EOF) {
-        std::cout << (cluster_index - meta_data.fat_start_address) / sizeof(uint32_t) << " ";
+        output() << get_fat_entry(cluster_index) << " ";
         cluster_address = read_from_fat(cluster_index);
         cluster_index = get_cluster_index(cluster_address);
     }
-    std::cout << std::endl;
-
-    // Restore working directory
-    working_directory = saved_working_directory;
+    output() << std::endl;
 
     return true;
 }
 
 bool PseudoFS::incp(const std::vector<std::string> &args) {
-    // Change working directory
-    auto saved_working_directory = working_directory;
-    std::string file_name = args[2].substr(args[2].find_last_of('/') + 1, args[2].size());
-    std::string file_path = args[2].substr(0, args[2].find_last_of('/'));
-    std::vector<std::string> cd_args = {"cd", file_path, "don't print ok"};
-    bool result_cd = true;
-    // If directory path is not empty, change working directory
-    if (args[2].find('/') != std::string::npos)
-        result_cd = this->cd(cd_args);
-
-    // Error could have occurred while changing working directory
-    if (!result_cd) {
-        working_directory = saved_working_directory;
+    // Find the destination directory
+    PathHandle destination;
+    if (!resolve_path(args[2], destination))
         return false;
-    }
+    const auto &file_name = destination.name;
 
-    // Open source file from hard drive
-    std::ifstream source_file(args[1], std::ios::binary);
+    // Open source file from hard drive (at the end, to get its size - the data itself is streamed later)
+    std::ifstream source_file(args[1], std::ios::binary | std::ios::ate);
     if (!source_file.is_open()) {
-        std::cerr << FILE_NOT_FOUND << std::endl;
-        working_directory = saved_working_directory;
+        errors() << FILE_NOT_FOUND << std::endl;
         return false;
     }
-    std::vector<unsigned char> buffer(std::istreambuf_iterator<char>(source_file), {});
-    source_file.close();
+    auto file_size = static_cast<uint64_t>(source_file.tellg());
+    source_file.seekg(0);
 
     // Check if file with the same name already exists
-    auto existence_check = DirectoryEntry{};
-    if (does_entry_exist(file_name, existence_check)) {
-        std::cerr << FILE_ALREADY_EXISTS << std::endl;
-        working_directory = saved_working_directory;
+    if (destination.entry.start_cluster) {
+        errors() << FILE_ALREADY_EXISTS << std::endl;
+        return false;
+    }
+
+    // Make sure the directory has space for the new entry (and the data fits before it grows)
+    if (!has_space_for(file_size, destination.directory) || !reserve_directory_slot(destination.directory)) {
         return false;
     }
 
-    // Get file size
-    uint32_t file_size = buffer.size();
-    auto number_of_iterations = file_size / meta_data.cluster_size + 1;
+    // Get number of clusters
+    auto number_of_clusters = file_size / meta_data.cluster_size + 1;
 
-    // Iterate over clusters and write data to them from source file (and write cluster addresses to FAT)
-    auto index = find_free_cluster();
-    if (!index) {
-        std::cerr << NO_SPACE << std::endl;
-        working_directory = saved_working_directory;
+    // Allocate all the clusters of the file at once (as few contiguous extents as possible)
+    std::vector<Extent> extents;
+    if (!allocate_clusters(number_of_clusters, extents)) {
         return false;
     }
-    auto current_cluster_index = meta_data.fat_start_address + index * sizeof(uint32_t);
-    auto current_cluster_address = get_cluster_address(current_cluster_index);
-    write_to_fat(current_cluster_index, FAT_EOF); // Marking as used; EOF will do for now, later it will be changed
-    uint32_t previous_cluster_index = 0;
 
     // Create directory entry
     auto entry = DirectoryEntry{
             "",
             false,
             file_size,
-            current_cluster_address,
+            meta_data.data_start_address + extents[0].start * meta_data.cluster_size,
     };
     for (int i = 0; i < DEFAULT_FILE_NAME_LENGTH - 1; i++)
         entry.item_name[i] = file_name[i];
     entry.item_name[DEFAULT_FILE_NAME_LENGTH - 1] = '\0';
 
-    for (auto i = 0; i < number_of_iterations; i++) {
-        // Write cluster address to FAT
-        if (previous_cluster_index != 0)
-            write_to_fat(previous_cluster_index, current_cluster_address);
-
-        previous_cluster_index = current_cluster_index;
-
-        // Write data to cluster
-        if (i != number_of_iterations - 1) {
-            std::string cluster_buffer = std::string(buffer.begin() + static_cast<int>(i * meta_data.cluster_size),
-                                                     buffer.begin() +
-                                                     static_cast<int>((i + 1) * meta_data.cluster_size));
-            write_to_cluster(current_cluster_address, &cluster_buffer[0], static_cast<int>(meta_data.cluster_size));
-        }
-            // Last iteration
-        else {
-            std::string cluster_buffer = std::string(buffer.begin() + static_cast<int>(i * meta_data.cluster_size),
-                                                     buffer.end());
-            write_to_cluster(current_cluster_address, &cluster_buffer[0],
-                             static_cast<int>(file_size % meta_data.cluster_size));
-            break;
-        }
-
-        // Find next free cluster
-        index = find_free_cluster();
-        if (!index) {
-            std::cerr << NO_SPACE << std::endl;
-            working_directory = saved_working_directory;
-            return false;
+    // Stream the data of each extent from the source file in big chunks, only one chunk is ever held in memory
+    std::vector<char> buffer(std::min<uint64_t>(COPY_BUFFER_SIZE, number_of_clusters * meta_data.cluster_size));
+    uint64_t bytes_remaining = file_size;
+    for (const auto &extent: extents) {
+        auto address = get_data_address(extent.start);
+        auto extent_bytes = std::min(bytes_remaining, static_cast<uint64_t>(extent.length) * meta_data.cluster_size);
+        while (extent_bytes) {
+            auto chunk = std::min<uint64_t>(extent_bytes, buffer.size());
+            source_file.read(buffer.data(), chunk);
+            write_to_cluster(address, buffer.data(), chunk);
+            address += chunk;
+            extent_bytes -= chunk;
+            bytes_remaining -= chunk;
         }
-        current_cluster_index = meta_data.fat_start_address + index * sizeof(uint32_t);
-        write_to_fat(current_cluster_index, FAT_EOF); // Marking as used; EOF will do for now, later it will be changed
-        current_cluster_address = get_cluster_address(current_cluster_index);
     }
+    source_file.close();
     // Write directory entry to directory
-    write_directory_entry(working_directory.cluster_address, entry);
+    write_directory_entry(destination.directory, entry);
 
-    // Restore and update working directory
-    working_directory = saved_working_directory;
-    working_directory.entries = get_directory_entries(working_directory.cluster_address);
-
-    std::cout << OK << std::endl;
+    output() << OK << std::endl;
     return true;
 }
 
 bool PseudoFS::outcp(const std::vector<std::string> &args) {
-    // Change working directory
-    auto saved_working_directory = working_directory;
-    std::string file_name = args[1].substr(args[1].find_last_of('/') + 1, args[1].size());
-    std::string file_path = args[1].substr(0, args[1].find_last_of('/'));
-    std::vector<std::string> cd_args = {"cd", file_path, "don't print ok"};
-    bool result_cd = true;
-    // If directory path is not empty, change working directory
-    if (args[1].find('/') != std::string::npos)
-        result_cd = this->cd(cd_args);
-
-    // Error could have occurred while changing working directory
-    if (!result_cd) {
-        working_directory = saved_working_directory;
+    // Find the directory of the file
+    PathHandle source;
+    if (!resolve_path(args[1], source))
         return false;
-    }
 
     // Open destination file from hard drive
     std::ofstream destination_file(args[2], std::ios::binary | std::ios::out | std::ios::trunc);
     if (!destination_file.is_open()) {
-        std::cerr << PATH_NOT_FOUND << std::endl;
-        working_directory = saved_working_directory;
+        errors() << PATH_NOT_FOUND << std::endl;
         return false;
     }
 
     // Find directory entry with the given name and check existence
-    auto entry = DirectoryEntry{};
-    if (!does_entry_exist(file_name, entry)) {
-        std::cerr << FILE_NOT_FOUND << std::endl;
-        working_directory = saved_working_directory;
+    auto entry = source.entry;
+    if (!entry.start_cluster) {
+        errors() << FILE_NOT_FOUND << std::endl;
         return false;
     }
 
-    // Iterate over clusters and write data to destination file
-    auto current_cluster_address = entry.start_cluster;
-    auto current_cluster_index = get_cluster_index(current_cluster_address);
-    auto number_of_iterations = entry.size / meta_data.cluster_size + 1;
-
-    for (auto i = 0; i < number_of_iterations; i++) {
-        // Read data from cluster
-        if (i != number_of_iterations - 1) {
-            char *buffer = new char[meta_data.cluster_size];
-            read_from_cluster(current_cluster_address, buffer, static_cast<int>(meta_data.cluster_size));
-            for (int j = 0; j < meta_data.cluster_size; j++)
-                destination_file.write(&buffer[j], sizeof(char));
-            delete[] buffer;
+    // Read physically consecutive clusters in big chunks, the chunks filling the buffer are read in one batch (all of
+    // them in flight at once) and the buffer is written to the destination file
+    auto start_time = std::chrono::steady_clock::now();
+    std::vector<char> buffer(std::min<uint64_t>(COPY_BUFFER_SIZE, entry.size));
+    std::vector<IoRequest> requests;
+    uint64_t buffered = 0;
+    auto write_buffer = [&]() {
+        submit_cluster_io(requests);
+        destination_file.write(buffer.data(), static_cast<std::streamsize>(buffered));
+        requests.clear();
+        buffered = 0;
+    };
+    uint64_t bytes_remaining = entry.size;
+    for (const auto &extent: get_file_extents(entry)) {
+        auto address = get_data_address(extent.start);
+        auto extent_bytes = std::min(bytes_remaining, static_cast<uint64_t>(extent.length) * meta_data.cluster_size);
+        device->advise_sequential(address, extent_bytes);
+
+        // The mapped image gives the whole extent without copying it through the buffer
+        if (auto data = view_data(address, extent_bytes)) {
+            if (buffered)
+                write_buffer();
+            destination_file.write(data, static_cast<std::streamsize>(extent_bytes));
+            bytes_remaining -= extent_bytes;
+            continue;
         }
-            // Last iteration
-        else {
-            char *buffer = new char[entry.size % meta_data.cluster_size];
-            read_from_cluster(current_cluster_address, buffer, static_cast<int>(entry.size % meta_data.cluster_size));
-            for (int j = 0; j < entry.size % meta_data.cluster_size; j++)
-                destination_file.write(&buffer[j], sizeof(char));
-            delete[] buffer;
-            break;
+        while (extent_bytes) {
+            auto chunk = std::min(extent_bytes, buffer.size() - buffered);
+            requests.push_back(IoRequest{false, address, &buffer[buffered], chunk});
+            buffered += chunk;
+            address += chunk;
+            extent_bytes -= chunk;
+            bytes_remaining -= chunk;
+            if (buffered == buffer.size())
+                write_buffer();
         }
-
-        // Find next cluster
-        current_cluster_address = read_from_fat(current_cluster_index);
-        current_cluster_index = get_cluster_index(current_cluster_address);
     }
+    if (buffered)
+        write_buffer();
+    destination_file.flush();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start_time;
 
     // Close destination file
     destination_file.close();
 
-    // Restore working directory
-    working_directory = saved_working_directory;
-
-    std::cout << OK << std::endl;
+    // Report the throughput
+    output() << entry.size << "B in " << std::fixed << std::setprecision(3) << elapsed.count() << "s ("
+             << (elapsed.count() > 0 ? entry.size / static_cast<double>(MB) / elapsed.count() : 0.0) << " MB/s)"
+             << std::defaultfloat << std::endl;
+    output() << OK << std::endl;
     return true;
 }
 
@@ -1041,7 +3164,7 @@ bool PseudoFS::load(const std::vector<std::string> &args) {
     // Open file from hard drive
     std::ifstream command_file(args[1]);
     if (!command_file.is_open()) {
-        std::cerr << PATH_NOT_FOUND << std::endl;
+        errors() << PATH_NOT_FOUND << std::endl;
         return false;
     }
 
@@ -1055,41 +3178,65 @@ bool PseudoFS::load(const std::vector<std::string> &args) {
         while (std::getline(ss, token, ' '))
             tokens.push_back(token);
 
-        std::cout << working_directory.path << "$ >" << command << std::endl;
-        call_cmd(tokens[0], tokens);
+        output() << current_directory().path << "$ >" << command << std::endl;
+        if (!tokens.empty())
+            call_cmd(tokens[0], tokens);
     }
 
     command_file.close();
 
-    std::cout << OK << std::endl;
+    output() << OK << std::endl;
     return true;
 }
 
 bool PseudoFS::format(const std::vector<std::string> &args) {
-    // Get the user input for the disk size
-    uint32_t disk_size = std::stoi(args[1]);
-    if (args[1].find("KB") != std::string::npos)
-        disk_size *= KB;
-    else if (args[1].find("MB") != std::string::npos)
-        disk_size *= MB;
-    else if (args[1].find("GB") != std::string::npos)
-        disk_size *= GB;
-
-    // Calculate remaining size (size for FAT table and data)
-    uint32_t remaining_size = disk_size - sizeof(MetaData);
-    uint32_t num_blocks = remaining_size / (DEFAULT_CLUSTER_SIZE + sizeof(uint32_t));
-
-    // Create the metadata for the file system
+    // Get the user input for the disk size and the cluster size
+    uint64_t disk_size = parse_size(args[1]);
+    uint64_t cluster_size = DEFAULT_CLUSTER_SIZE;
+    bool full_format = false;
+    for (size_t i = 2; i < args.size(); i++) {
+        if (args[i] == "--full") {
+            full_format = true;
+            continue;
+        }
+        cluster_size = parse_size(args[i]);
+        if (cluster_size < MIN_CLUSTER_SIZE || cluster_size > MAX_CLUSTER_SIZE || !std::has_single_bit(cluster_size)) {
+            errors() << INVALID_CLUSTER_SIZE << std::endl;
+            return false;
+        }
+    }
+
+    // The journal takes a part of the file system (but at least a few clusters)
+    auto journal_size = std::max<uint64_t>(std::clamp(disk_size / JOURNAL_SHARE, JOURNAL_MIN_SIZE, JOURNAL_MAX_SIZE),
+                                           JOURNAL_MIN_CLUSTERS * cluster_size + JOURNAL_HEADER_SIZE);
+
+    // Calculate remaining size (size for FAT table and data), every cluster needs its own FAT entry
+    uint64_t remaining_size = disk_size > METADATA_SIZE + journal_size ? disk_size - METADATA_SIZE - journal_size : 0;
+    uint64_t num_blocks = std::min<uint64_t>(remaining_size / (cluster_size + sizeof(uint32_t)), MAX_CLUSTER_COUNT);
+    if (!num_blocks) {
+        errors() << NO_SPACE << std::endl;
+        return false;
+    }
+
+    // Create the metadata for the file system (always in the current layout)
     meta_data = MetaData{
-            "zapped99",
+            "",
+            CURRENT_VERSION,
             disk_size,
-            DEFAULT_CLUSTER_SIZE,
-            static_cast<uint32_t>((disk_size - (sizeof(MetaData) + num_blocks * sizeof(uint32_t))) /
-                                  DEFAULT_CLUSTER_SIZE),
-            sizeof(MetaData),
-            static_cast<uint32_t>(num_blocks * sizeof(uint32_t)),
-            static_cast<uint32_t>(sizeof(MetaData) + num_blocks * sizeof(uint32_t))
+            static_cast<uint32_t>(cluster_size),
+            static_cast<uint32_t>(num_blocks),
+            METADATA_SIZE,
+            num_blocks * sizeof(uint32_t),
+            METADATA_SIZE + num_blocks * sizeof(uint32_t) + journal_size,
+            0,
+            0,
+            METADATA_SIZE + num_blocks * sizeof(uint32_t),
+            journal_size
     };
+    std::memcpy(meta_data.signature, SIGNATURE, sizeof(MetaData::signature));
+    fat_entry_size = sizeof(uint32_t);
+    directory_entry_size = sizeof(DirectoryEntry);
+
     // Create root directory
     auto root_dir_curr = DirectoryEntry{
             ".",
@@ -1104,145 +3251,334 @@ bool PseudoFS::format(const std::vector<std::string> &args) {
             meta_data.data_start_address
     };
 
-    // Rewrite the file system file
-    if (file_system.is_open()) file_system.close();
-    file_system.open(file_system_filepath, std::ios::binary | std::ios::in | std::ios::out | std::ios::trunc);
-
-    // Write the meta data
-    file_system.write(reinterpret_cast<const char *>(&meta_data), sizeof(struct MetaData));
-
-    // Write the FAT table (all clusters are free)
-    for (uint32_t i = 0; i < meta_data.cluster_count; i++)
-        write_to_fat(meta_data.fat_start_address + i * sizeof(uint32_t), FAT_FREE);
-
-    // Write the data (no data)
+    // Rewrite the file system file, it is resized sparsely so all the data clusters read as zeroes
+    device->create(meta_data.disk_size);
+    cache = std::make_unique<ClusterCache>(*device, meta_data.cluster_size, meta_data.data_start_address,
+                                           options.cache_size);
+
+    // The transactions of the old file system are thrown away
+    journal_head = 0;
+    journal_sequence = 1;
+    journal_group.clear();
+    journal_group_size = 0;
+    journal_clusters.clear();
+    journal_freed.clear();
+    journal_logged.clear();
+
+    // Write the meta data in its place right away (not through the journal), the journal is found by it
+    char meta_data_buffer[METADATA_SIZE]{};
+    std::memcpy(meta_data_buffer, &meta_data, sizeof(MetaData));
+    device->write(0, meta_data_buffer, METADATA_SIZE);
+    journal_meta_dirty = false;
+
+    // Write the FAT table (all clusters are free), the whole table goes to the disk in one write with the flush
+    fat_table.resize(meta_data.cluster_count);
+    fat_scanner->fill(fat_table.data(), fat_table.size(), FAT_FREE);
+    fat_dirty.assign(meta_data.cluster_count, true);
+    fat_dirty_low = 0;
+    fat_dirty_high = meta_data.cluster_count - 1;
+    journal_fat_dirty.assign(meta_data.cluster_count, false);
+    journal_fat_low = 1;
+    journal_fat_high = 0;
+    build_free_bitmap();
+    load_refcounts();
+    load_snapshots();
+
+    // Write the data (no data) only for the full format, otherwise the holes in the file are already zeroes
     EMPTY_CLUSTER = std::string(meta_data.cluster_size, '\0');
-    for (uint32_t i = 0; i < meta_data.cluster_count; i++)
-        write_to_cluster(meta_data.data_start_address + i * meta_data.cluster_size, &EMPTY_CLUSTER[0],
-                         static_cast<int>(meta_data.cluster_size));
+    if (full_format) {
+        std::vector<char> zeroes(COPY_BUFFER_SIZE, '\0');
+        auto data_size = static_cast<uint64_t>(meta_data.cluster_count) * meta_data.cluster_size;
+        for (uint64_t offset = 0; offset < data_size; offset += zeroes.size())
+            write_to_cluster(meta_data.data_start_address + offset, zeroes.data(),
+                             std::min<uint64_t>(zeroes.size(), data_size - offset));
+    }
 
-    // Write the root directory to FAT table and data
+    // Write the root directory to FAT table and data (indexes of the old directories are thrown away)
+    directory_indexes.clear();
+    path_cache.clear();
     write_to_fat(meta_data.fat_start_address, FAT_EOF);
     write_directory_entry(meta_data.data_start_address, root_dir_curr);
     write_directory_entry(meta_data.data_start_address, root_dir_parent);
 
+    // The new file system goes to the disk right away (the meta data and the empty FAT are made durable in their
+    // places together with the empty journal, the rest goes through the journal)
+    flush_fat();
+    reset_journal();
+    commit_transaction();
+    commit_journal();
+
     // Set the working directory to root
     ROOT_DIRECTORY = WorkingDirectory{
             meta_data.data_start_address,
-            "/",
-            get_directory_entries(meta_data.data_start_address)
+            "/"
     };
-    working_directory = ROOT_DIRECTORY;
+    current_directory() = ROOT_DIRECTORY;
+
+    output() << OK << std::endl;
+    return true;
+}
+
+bool PseudoFS::sync(const std::vector<std::string> &args) {
+    flush_refcounts();
+    commit_transaction();
+    commit_journal();
+    device->sync();
+
+    output() << OK << std::endl;
+    return true;
+}
 
-    std::cout << OK << std::endl;
+bool PseudoFS::cache_stats(const std::vector<std::string> &args) {
+    std::lock_guard<std::recursive_mutex> guard(cache_lock);
+    const auto &stats = cache->get_stats();
+    auto reads = stats.hits + stats.misses;
+    output() << "Cached clusters: " << cache->get_size() << " / " << cache->get_capacity() << " ("
+             << cache->get_capacity() * meta_data.cluster_size / KB << "KB)" << std::endl;
+    output() << "Hits: " << stats.hits << std::endl;
+    output() << "Misses: " << stats.misses << std::endl;
+    output() << "Hit ratio: " << std::fixed << std::setprecision(1)
+             << (reads ? 100.0 * static_cast<double>(stats.hits) / static_cast<double>(reads) : 0.0) << "%"
+             << std::defaultfloat << std::endl;
+    output() << "Read ahead clusters: " << stats.read_ahead << std::endl;
+    output() << "Written back clusters: " << stats.write_backs << std::endl;
+    output() << "Evicted clusters: " << stats.evictions << std::endl;
     return true;
 }
 
 bool PseudoFS::defrag(const std::vector<std::string> &args) {
-    // Check if the filepath is valid
-    auto saved_working_directory = working_directory;
-    std::string file_name = args[1].substr(args[1].find_last_of('/') + 1, args[1].size());
-    std::string file_path = args[1].substr(0, args[1].find_last_of('/'));
-    std::vector<std::string> cd_args_file = {"cd", file_path, "don't print ok"};
-    bool result_cd_file = true;
-    // If directory path is not empty, change working directory
-    if (args[1].find('/') != std::string::npos)
-        result_cd_file = this->cd(cd_args_file);
+    // Defragment the whole file system
+    if (args.size() > 1 && args[1] == "-a") {
+        // The snapshots remember the clusters of the tree, they would point to the data of other files afterwards
+        if (!snapshots.empty()) {
+            errors() << SNAPSHOTS_EXIST << std::endl;
+            return false;
+        }
+        if (!defrag_all())
+            return false;
+        output() << OK << std::endl;
+        return true;
+    }
 
-    // Error could have occurred while changing working directory
-    if (!result_cd_file) {
-        working_directory = saved_working_directory;
+    // Check if the filepath is valid
+    PathHandle file;
+    if (!resolve_path(args[1], file))
         return false;
-    }
 
     // Check if file with the given name exists
-    auto entry = DirectoryEntry{};
-    if (!does_entry_exist(file_name, entry)) {
-        std::cerr << FILE_NOT_FOUND << std::endl;
-        working_directory = saved_working_directory;
+    auto entry = file.entry;
+    if (!entry.start_cluster) {
+        errors() << FILE_NOT_FOUND << std::endl;
         return false;
     }
 
     // Check if the source file is a directory
     if (entry.is_directory) {
-        std::cerr << FILE_IS_DIRECTORY << std::endl;
-        working_directory = saved_working_directory;
+        errors() << FILE_IS_DIRECTORY << std::endl;
         return false;
     }
 
     // Check if the file is already defragmented
     std::vector<uint32_t> clusters;
-    if (is_file_defragmented(entry, clusters)) {
-        working_directory = saved_working_directory;
+    if (is_file_defragmented(entry, clusters))
         return true;
-    }
 
-    // Find new clusters that are consecutive
-    auto number_of_needed_consecutive_clusters = clusters.size();
-    std::vector<uint32_t> new_clusters;
-    for (;;) {
-        bool found = true;
-        auto index = find_free_cluster();
-        new_clusters.push_back(index);
-        write_to_fat(meta_data.fat_start_address + index * sizeof(uint32_t), FAT_EOF); // Mark the cluster as used
-        if (new_clusters.size() == number_of_needed_consecutive_clusters) {
-            for (int i = 0; i < number_of_needed_consecutive_clusters - 1; i++) {
-                if (new_clusters[i] + 1 != new_clusters[i + 1]) {
-                    write_to_fat(meta_data.fat_start_address + new_clusters[0] * sizeof(uint32_t),
-                                 42); // Mark the cluster as "free"
-                    new_clusters.erase(new_clusters.begin());
-                    found = false;
-                    break;
-                }
-            }
-            if (found) break;
-        }
-    }
-    // Truly free clusters that were marked as "free"
-    for (int i = 0; i < meta_data.cluster_count; i++) {
-        uint32_t fat_value = read_from_fat(meta_data.fat_start_address + i * sizeof(uint32_t));
-        if (fat_value == 42)
-            write_to_fat(meta_data.fat_start_address + i * sizeof(uint32_t), FAT_FREE);
+    // Allocate new clusters that are consecutive (best fitting free run)
+    auto number_of_needed_consecutive_clusters = static_cast<uint32_t>(clusters.size());
+    std::vector<Extent> extents;
+    if (!allocate_clusters(number_of_needed_consecutive_clusters, extents, true)) {
+        errors() << NO_SPACE << std::endl;
+        return false;
     }
+    auto new_start = extents[0].start;
 
-    // Copy the data from the old clusters to the new ones
-    for (int i = 0; i < number_of_needed_consecutive_clusters; i++) {
-        char *data = new char[meta_data.cluster_size];
-        read_from_cluster(meta_data.data_start_address + clusters[i] * meta_data.cluster_size, data,
-                          static_cast<int>(meta_data.cluster_size));
-        write_to_cluster(meta_data.data_start_address + new_clusters[i] * meta_data.cluster_size, data,
-                         static_cast<int>(meta_data.cluster_size));
-        delete[] data;
+    // Copy the data from the old clusters to the new ones, each run of the old clusters in one go
+    std::vector<ClusterCopy> copies;
+    for (uint32_t i = 0; i < number_of_needed_consecutive_clusters; i++) {
+        if (i && clusters[i - 1] + 1 == clusters[i])
+            copies.back().length++;
+        else
+            copies.push_back(ClusterCopy{clusters[i], new_start + i, 1});
+    }
+    if (!copy_clusters(copies)) {
+        free_allocated_clusters(extents);
+        return false;
     }
 
-    // Update the FAT table
-    for (int i = 0; i < number_of_needed_consecutive_clusters - 1; i++)
-        write_to_fat(meta_data.fat_start_address + new_clusters[i] * sizeof(uint32_t),
-                     meta_data.data_start_address + new_clusters[i + 1] * meta_data.cluster_size);
-
-    // Free the old clusters
-    for (int i = 0; i < number_of_needed_consecutive_clusters; i++) {
-        write_to_fat(meta_data.fat_start_address + clusters[i] * sizeof(uint32_t), FAT_FREE);
-        write_to_cluster(meta_data.data_start_address + clusters[i] * meta_data.cluster_size, &EMPTY_CLUSTER[0],
-                         static_cast<int>(meta_data.cluster_size));
+    // Free the old clusters (if they were shared, the other files keep them and this file has its own copy now)
+    std::vector<Extent> old_extents;
+    for (int i = 0; i < number_of_needed_consecutive_clusters; i++)
+        old_extents.push_back(Extent{clusters[i], 1});
+    old_extents = drop_cluster_references(old_extents);
+    for (const auto &extent: old_extents) {
+        for (uint32_t i = extent.start; i < extent.start + extent.length; i++)
+            write_to_fat(get_fat_index(i), FAT_FREE);
     }
+    release_clusters(old_extents, false);
 
     // Update the file entry
     auto new_entry = DirectoryEntry{
             "",
             entry.is_directory,
             entry.size,
-            meta_data.data_start_address + new_clusters[0] * meta_data.cluster_size
+            get_data_address(new_start)
     };
     for (int i = 0; i < DEFAULT_FILE_NAME_LENGTH - 1; i++)
         new_entry.item_name[i] = entry.item_name[i];
-    remove_directory_entry(working_directory.cluster_address, entry);
-    write_directory_entry(working_directory.cluster_address, new_entry);
+    update_directory_entry(file.directory, new_entry);
+
+    output() << OK << std::endl;
+    return true;
+}
 
-    // Update and restore working directory
-    working_directory = saved_working_directory;
-    working_directory.entries = get_directory_entries(working_directory.cluster_address);
+bool PseudoFS::fragstat(const std::vector<std::string> &args) {
+    // Split the FAT into runs of consecutive clusters chained one after another in one pass
+    auto cluster_count = static_cast<uint32_t>(fat_table.size());
+    auto none = std::numeric_limits<uint32_t>::max();
+    std::vector<uint32_t> extent_ends;
+    std::vector<uint32_t> extent_of(cluster_count, none);
+    for (uint32_t cluster = 0; cluster < cluster_count; cluster++) {
+        if (fat_table[cluster] == FAT_FREE || fat_table[cluster] == FAT_BAD)
+            continue;
+        if (cluster && fat_table[cluster - 1] == cluster)
+            extent_ends.back() = cluster;
+        else {
+            extent_of[cluster] = static_cast<uint32_t>(extent_ends.size());
+            extent_ends.push_back(cluster);
+        }
+    }
+
+    // Counts the extents of the file by following the chain from one extent to the next one
+    auto count_extents = [&](uint64_t start_cluster) {
+        // Chain pointing outside of the data or into the middle of an extent (corrupted file system) ends the count
+        auto find_extent = [&](uint32_t cluster) {
+            return cluster < cluster_count ? extent_of[cluster] : none;
+        };
+        uint32_t extents = 0;
+        auto extent = find_extent(get_fat_value(start_cluster));
+        while (extent != none && extents < extent_ends.size()) {
+            extents++;
+            extent = find_extent(fat_table[extent_ends[extent]]);
+        }
+        return extents;
+    };
+
+    // Go through the directory tree breadth first, every directory is visited once
+    std::vector<FileFragmentation> files;
+    std::vector<std::pair<uint64_t, std::string>> queue{{ROOT_DIRECTORY.cluster_address, "/"}};
+    std::unordered_map<uint64_t, bool> visited{{ROOT_DIRECTORY.cluster_address, true}};
+    uint64_t directory_count = 0;
+    for (size_t i = 0; i < queue.size(); i++) {
+        auto [cluster_address, path] = queue[i];
+        files.push_back(FileFragmentation{path, 0, count_extents(cluster_address)});
+        directory_count++;
+        for (const auto &entry: get_directory_entries(cluster_address)) {
+            if (!strcmp(entry.item_name, ".") || !strcmp(entry.item_name, ".."))
+                continue;
+            if (!entry.is_directory)
+                files.push_back(FileFragmentation{path + entry.item_name, entry.size,
+                                                  count_extents(entry.start_cluster)});
+            else if (!visited[entry.start_cluster]) {
+                visited[entry.start_cluster] = true;
+                queue.emplace_back(entry.start_cluster, path + entry.item_name + "/");
+            }
+        }
+    }
+
+    uint64_t fragmented = 0;
+    uint64_t extents = 0;
+    for (const auto &file: files) {
+        extents += file.extents;
+        if (file.extents > 1)
+            fragmented++;
+    }
+    auto extra_percent = 100.0 * static_cast<double>(extents - files.size()) / static_cast<double>(files.size());
+    output() << std::fixed << std::setprecision(1);
+    output() << "Files: " << files.size() - directory_count << ", directories: " << directory_count << std::endl;
+    output() << "Fragmented: " << fragmented << " ("
+             << 100.0 * static_cast<double>(fragmented) / static_cast<double>(files.size()) << "%)" << std::endl;
+    output() << "Extents: " << extents << " ("
+             << static_cast<double>(extents) / static_cast<double>(files.size()) << " per file)" << std::endl;
+
+    // Free space fragmentation - the free runs by their length (powers of two)
+    auto runs = find_free_runs();
+    uint32_t largest_run = 0;
+    std::vector<uint64_t> histogram;
+    for (const auto &run: runs) {
+        largest_run = std::max(largest_run, run.length);
+        auto bucket = static_cast<size_t>(std::bit_width(run.length) - 1);
+        if (histogram.size() <= bucket)
+            histogram.resize(bucket + 1, 0);
+        histogram[bucket]++;
+    }
+    output() << "Free clusters: " << free_cluster_count << " in " << runs.size() << " runs, largest run "
+             << largest_run << " clusters (" << static_cast<uint64_t>(largest_run) * meta_data.cluster_size / KB
+             << "KB)" << std::endl;
+    for (size_t bucket = 0; bucket < histogram.size(); bucket++) {
+        if (!histogram[bucket])
+            continue;
+        auto low = 1ULL << bucket;
+        auto range = bucket ? std::to_string(low) + "-" + std::to_string(2 * low - 1) + " clusters" : "1 cluster";
+        output() << "  " << std::left << std::setw(20) << range << std::right << histogram[bucket] << " runs"
+                 << std::endl;
+    }
+
+    // The most fragmented files
+    std::sort(files.begin(), files.end(), [](const FileFragmentation &a, const FileFragmentation &b) {
+        return a.extents > b.extents || (a.extents == b.extents && a.path < b.path);
+    });
+    if (fragmented)
+        output() << "Most fragmented:" << std::endl;
+    for (uint32_t i = 0; i < std::min<uint64_t>(fragmented, FRAGSTAT_WORST_FILES); i++)
+        output() << "  " << files[i].path << " - " << files[i].extents << " extents, " << files[i].size << "B"
+                 << std::endl;
+
+    if (extra_percent >= FRAGSTAT_DEFRAG_THRESHOLD)
+        output() << "Defragmentation is recommended (defrag -a)" << std::endl;
+    output() << std::defaultfloat;
+    return true;
+}
+
+bool PseudoFS::snapshot(const std::vector<std::string> &args) {
+    if (args.size() > 1 && args[1] == "list") {
+        for (const auto &info: snapshots) {
+            auto created = static_cast<std::time_t>(info.created);
+            output() << std::left << std::setw(DEFAULT_FILE_NAME_LENGTH) << info.name << std::right
+                     << std::put_time(std::localtime(&created), "%Y-%m-%d %H:%M:%S") << "  " << info.cluster_count
+                     << " clusters, " << info.directory_count << " directory clusters" << std::endl;
+        }
+        return true;
+    }
+    if (args.size() < 3) {
+        errors() << "Usage: snapshot create|restore|delete <name>, snapshot list" << std::endl;
+        return false;
+    }
+
+    bool result;
+    if (args[1] == "create")
+        result = create_snapshot(args[2]);
+    else if (args[1] == "restore")
+        result = restore_snapshot(args[2]);
+    else if (args[1] == "delete")
+        result = delete_snapshot(args[2]);
+    else {
+        errors() << "Usage: snapshot create|restore|delete <name>, snapshot list" << std::endl;
+        return false;
+    }
+    if (result)
+        output() << OK << std::endl;
+    return result;
+}
+
+bool PseudoFS::fsck(const std::vector<std::string> &args) {
+    bool repair = args.size() > 1 && args[1] == "--repair";
+    return check_file_system(repair);
+}
+
+bool PseudoFS::upgrade(const std::vector<std::string> &args) {
+    if (!upgrade_layout())
+        return false;
 
-    std::cout << OK << std::endl;
+    output() << OK << std::endl;
     return true;
 }
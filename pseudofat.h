@@ -6,6 +6,19 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <set>
+#include <algorithm>
+#include <bit>
+#include <chrono>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include "block_device.h"
+#include "cluster_cache.h"
+#include "fat_scanner.h"
 
 /** Free cluster_address constant */
 constexpr int32_t FAT_FREE = -1;
@@ -21,6 +34,38 @@ constexpr int32_t MB = 1024 * KB;
 constexpr int32_t GB = 1024 * MB;
 /** Cluster size in bytes */
 constexpr uint32_t DEFAULT_CLUSTER_SIZE = 1 * KB;
+/** Smallest cluster size in bytes that can be chosen at format */
+constexpr uint32_t MIN_CLUSTER_SIZE = 512;
+/** Largest cluster size in bytes that can be chosen at format */
+constexpr uint32_t MAX_CLUSTER_SIZE = 1 * MB;
+/** Signature of the original layout (32-bit offsets and sizes, no version) */
+constexpr const char *SIGNATURE_V1 = "zapped99";
+/** Signature of the versioned layout (the version is stored in the meta data) */
+constexpr const char *SIGNATURE = "zapped64";
+/** Version of the layout written by format (2 = FAT of 64-bit cluster addresses, 3 = FAT of 32-bit cluster indices) */
+constexpr uint32_t CURRENT_VERSION = 3;
+/** Largest number of clusters of a file system (the highest 32-bit FAT values are the special ones) */
+constexpr uint32_t MAX_CLUSTER_COUNT = 0xfffffff0;
+/** Space reserved for the meta data at the start of the versioned layout in bytes */
+constexpr uint32_t METADATA_SIZE = 512;
+/** Signature of the journal header (zjournal + null terminator) */
+constexpr const char *JOURNAL_SIGNATURE = "zjournal";
+/** Magic number at the start of every journal transaction */
+constexpr uint32_t JOURNAL_TRANSACTION_MAGIC = 0x4e58544a;
+/** Magic number at the start of the record of a transaction staged outside of the journal (too big to fit into it) */
+constexpr uint32_t JOURNAL_STAGED_MAGIC = 0x4754534a;
+/** Space reserved for the journal header at the start of the journal in bytes */
+constexpr uint32_t JOURNAL_HEADER_SIZE = 512;
+/** Part of the file system reserved for the journal by format (one in JOURNAL_SHARE bytes) */
+constexpr uint64_t JOURNAL_SHARE = 32;
+/** Smallest journal created by format in bytes */
+constexpr uint64_t JOURNAL_MIN_SIZE = 16 * KB;
+/** Largest journal created by format in bytes */
+constexpr uint64_t JOURNAL_MAX_SIZE = 8 * MB;
+/** Smallest journal created by format in clusters (so the transactions changing a few directories fit) */
+constexpr uint32_t JOURNAL_MIN_CLUSTERS = 8;
+/** Maximum number of the commands committed to the journal together (with one sync) */
+constexpr uint32_t JOURNAL_GROUP_COMMANDS = 32;
 /** Default length of file name */
 constexpr uint32_t DEFAULT_FILE_NAME_LENGTH = 12;
 /** Default FILE NOT FOUND error message */
@@ -37,20 +82,92 @@ constexpr const char *FILE_IS_DIRECTORY = "ERROR: IS DIR";
 constexpr const char *FILE_IS_NOT_DIRECTORY = "ERROR: IS NOT DIR";
 /** Default DIRECTORY IS NOT EMPTY error message */
 constexpr const char *DIRECTORY_IS_NOT_EMPTY = "ERROR: DIR IS NOT EMPTY";
+/** Default MISSING ARGUMENTS error message */
+constexpr const char *MISSING_ARGUMENTS = "ERROR: MISSING ARGUMENTS";
 /** Default NO SPACE error message */
 constexpr const char *NO_SPACE = "ERROR: NO SPACE";
 /** Default CANNOT REMOVE CURRENT DIRECTORY error message */
 constexpr const char *CANNOT_REMOVE_CURR_DIR = "ERROR: CANNOT REMOVE CURRENT DIR";
+/** Default CANNOT MOVE DIRECTORY INTO ITSELF error message */
+constexpr const char *CANNOT_MOVE_DIR_INTO_ITSELF = "ERROR: CANNOT MOVE DIR INTO ITSELF";
+/** Default INVALID CLUSTER SIZE error message */
+constexpr const char *INVALID_CLUSTER_SIZE = "ERROR: INVALID CLUSTER SIZE";
 /** Default PATH NOT FOUND error message */
 constexpr const char *PATH_NOT_FOUND = "ERROR: PATH NOT FOUND";
+/** Default NOT SUPPORTED error message (feature needs a newer layout) */
+constexpr const char *NOT_SUPPORTED = "ERROR: NOT SUPPORTED BY THIS VERSION";
+/** Default TOO MANY REFERENCES error message */
+constexpr const char *TOO_MANY_REFERENCES = "ERROR: TOO MANY REFERENCES";
+/** Default SNAPSHOT NOT FOUND error message */
+constexpr const char *SNAPSHOT_NOT_FOUND = "ERROR: SNAPSHOT NOT FOUND";
+/** Default SNAPSHOT ALREADY EXISTS error message */
+constexpr const char *SNAPSHOT_ALREADY_EXISTS = "ERROR: SNAPSHOT ALREADY EXISTS";
+/** Default SNAPSHOTS EXIST error message (the operation can't keep the snapshots valid) */
+constexpr const char *SNAPSHOTS_EXIST = "ERROR: DELETE THE SNAPSHOTS FIRST";
+/** Default NOT ATOMIC error message (the changes too big for the journal had no free space to be staged in) */
+constexpr const char *NOT_ATOMIC = "ERROR: NO SPACE TO STAGE THE CHANGES, THEY ARE WRITTEN WITHOUT THE JOURNAL";
+/** Already the current version error message */
+constexpr const char *ALREADY_CURRENT_VERSION = "ERROR: ALREADY THE CURRENT VERSION";
+/** Default FILE SYSTEM DAMAGED error message (fsck --repair should be run) */
+constexpr const char *FILE_SYSTEM_DAMAGED = "ERROR: FILE SYSTEM IS DAMAGED";
+/** Default NO MEMORY error message (a buffer couldn't be allocated) */
+constexpr const char *NO_MEMORY = "ERROR: NOT ENOUGH MEMORY";
 /** Default OK message */
 constexpr const char *OK = "OK";
+/** Size of the buffer used for streaming file data in bytes */
+constexpr uint32_t COPY_BUFFER_SIZE = 1 * MB;
+/** Alignment of the copy buffers in bytes (page size, so the buffers suit direct I/O) */
+constexpr uint32_t COPY_BUFFER_ALIGNMENT = 4 * KB;
+/** Maximum number of clean FAT entries between two dirty ones that are still flushed in one write */
+constexpr uint32_t FAT_FLUSH_GAP = 64;
+/** Default size of the cluster cache in bytes */
+constexpr uint64_t DEFAULT_CACHE_SIZE = 16 * MB;
+/** Number of the following clusters of the FAT chain that are read together with a cluster missing in the cache */
+constexpr uint32_t READ_AHEAD_CLUSTERS = 16;
+/** Maximum size of the data moved in one batch of the whole file system defragmentation */
+constexpr uint64_t DEFRAG_BATCH_SIZE = 64 * MB;
+/** Number of the most fragmented files listed by the fragmentation report */
+constexpr uint32_t FRAGSTAT_WORST_FILES = 10;
+/** Share of the extra extents (above one per file) at which the defragmentation is recommended in percent */
+constexpr uint32_t FRAGSTAT_DEFRAG_THRESHOLD = 10;
 
 /**
  * MetaData structure for the whole file system
  * Includes information about the file system
+ * This is the versioned layout, it is stored in the first METADATA_SIZE bytes of the file system
  */
 struct MetaData {
+    /** zapped64 + null terminator = 9 */
+    char signature[9];
+    /** Version of the layout */
+    uint32_t version;
+    /** Size of the file system in bytes */
+    uint64_t disk_size;
+    /** Size of a cluster_address in bytes */
+    uint32_t cluster_size;
+    /** Number of clusters in the file system */
+    uint32_t cluster_count;
+    /** Fat table offset in bytes */
+    uint64_t fat_start_address;
+    /** Fat table size */
+    uint64_t fat_size;
+    /** Root directory offset in bytes */
+    uint64_t data_start_address;
+    /** Cluster address of the reference count table (0 if no cluster was ever shared) */
+    uint64_t refcount_address;
+    /** Cluster address of the snapshot catalog (0 if there are no snapshots) */
+    uint64_t snapshot_address;
+    /** Journal offset in bytes (between the FAT and the data) */
+    uint64_t journal_address;
+    /** Journal size in bytes (0 if the file system has no journal) */
+    uint64_t journal_size;
+};
+
+/**
+ * MetaData structure of the original layout (version 1, signature zapped99)
+ * Only used to read and write older file systems
+ */
+struct MetaDataV1 {
     /** zapped99 + null terminator = 9 */
     char signature[9];
     /** Size of the file system in bytes */
@@ -72,27 +189,242 @@ struct MetaData {
  * Includes information about a file or directory
  */
 struct DirectoryEntry {
+    /** Name of the file or directory */
+    char item_name[DEFAULT_FILE_NAME_LENGTH];
+    /** Flag for if the entry is a file or directory */
+    bool is_directory;
+    /** Size of the file in bytes */
+    uint64_t size;
+    /** Address of the first data cluster_address (the index of the cluster on the disk since the version 3) */
+    uint64_t start_cluster;
+};
+
+/**
+ * DirectoryEntry structure of the original layout (version 1)
+ * Only used to read and write older file systems
+ */
+struct DirectoryEntryV1 {
     /** Name of the file or directory */
     char item_name[DEFAULT_FILE_NAME_LENGTH];
     /** Flag for if the entry is a file or directory */
     bool is_directory;
     /** Size of the file in bytes */
     uint32_t size;
-    /** Index of the first data cluster_address */
+    /** Address of the first data cluster_address */
     uint32_t start_cluster;
 };
 
+/**
+ * Extent structure for a run of consecutive clusters
+ */
+struct Extent {
+    /** Index of the first cluster of the run */
+    uint32_t start;
+    /** Number of clusters in the run */
+    uint32_t length;
+};
+
 /**
  * Working directory structure
  * Includes information about the current working directory
  */
 struct WorkingDirectory {
     /** Cluster address of the working directory */
-    uint32_t cluster_address;
+    uint64_t cluster_address;
     /** Path of the working directory */
     std::string path;
-    /** Directory entries of the working directory */
-    std::vector<DirectoryEntry> entries;
+};
+
+/**
+ * Handle of a resolved path - the directory the path leads to and the entry given by the last component
+ */
+struct PathHandle {
+    /** Cluster address of the directory containing the entry */
+    uint64_t directory;
+    /** Name of the entry (last component of the path) */
+    std::string name;
+    /** Directory entry (zero start cluster if there is no entry with the name) */
+    DirectoryEntry entry;
+};
+
+/**
+ * In-memory index of the directory entries of one directory (all the clusters of its FAT chain)
+ * Kept in sync with the clusters on the disk, so the lookups don't have to read and scan the clusters
+ */
+struct DirectoryIndex {
+    /** Cluster addresses of the directory in the order of its FAT chain */
+    std::vector<uint64_t> clusters;
+    /** Directory entries by their slot in the directory (empty slots have zero start cluster) */
+    std::vector<DirectoryEntry> slots;
+    /** Slot of the entry by its name */
+    std::unordered_map<std::string, uint32_t> names;
+    /** Empty slots in the directory (min-heap, the lowest slot is used first) */
+    std::vector<uint32_t> free_slots;
+};
+
+/**
+ * File or directory laid out by the whole file system defragmentation
+ */
+struct LayoutItem {
+    /** Clusters of the item in the order of its FAT chain */
+    std::vector<uint32_t> clusters;
+    /** Flag for if the item is a file or directory */
+    bool is_directory;
+};
+
+/**
+ * Fragmentation of one file or directory
+ */
+struct FileFragmentation {
+    /** Absolute path of the file or directory */
+    std::string path;
+    /** Size of the file in bytes */
+    uint64_t size;
+    /** Number of the runs of consecutive clusters of the file */
+    uint32_t extents;
+};
+
+/**
+ * Directory found by the file system check, waiting for its entries to be checked
+ */
+struct CheckedDirectory {
+    /** Cluster address of the directory */
+    uint64_t cluster_address;
+    /** Cluster address of the parent directory */
+    uint64_t parent_address;
+    /** Absolute path of the directory */
+    std::string path;
+    /** Clusters of the directory in the order of its FAT chain */
+    std::vector<uint32_t> clusters;
+};
+
+/**
+ * File with a FAT chain longer than its size, found by the file system check
+ */
+struct LongFile {
+    /** Cluster address of the first cluster of the file */
+    uint64_t start_cluster;
+    /** Number of the clusters the file needs */
+    uint64_t needed;
+    /** Address of the directory entry of the file in bytes */
+    uint64_t slot_address;
+    /** Directory entry of the file */
+    DirectoryEntry entry;
+};
+
+/**
+ * Move of the data of one cluster to another cluster
+ */
+struct ClusterMove {
+    /** Cluster the data is read from */
+    uint32_t source;
+    /** Cluster the data is written to */
+    uint32_t destination;
+};
+
+/**
+ * Copy of the data of a run of consecutive clusters to another run
+ */
+struct ClusterCopy {
+    /** First cluster the data is read from */
+    uint32_t source;
+    /** First cluster the data is written to */
+    uint32_t destination;
+    /** Number of the clusters */
+    uint32_t length;
+};
+
+/**
+ * Snapshot of the whole directory tree, as stored in the snapshot catalog
+ */
+struct SnapshotInfo {
+    /** Name of the snapshot */
+    char name[DEFAULT_FILE_NAME_LENGTH];
+    /** Time the snapshot was created (seconds since the epoch) */
+    int64_t created;
+    /** Cluster address of the hidden chain with the record of the snapshot */
+    uint64_t address;
+    /** Number of the clusters of the files and directories in the snapshot */
+    uint32_t cluster_count;
+    /** Number of the directory clusters in the snapshot */
+    uint32_t directory_count;
+};
+
+/**
+ * Cluster of the directory tree saved in a snapshot record
+ */
+struct SnapshotCluster {
+    /** FAT entry of the cluster (cluster address of the next cluster in every layout version) */
+    uint64_t value;
+    /** Cluster */
+    uint32_t cluster;
+    /** Number of the files and directories using the cluster */
+    uint32_t users;
+};
+
+/**
+ * Header of the journal, stored in the first JOURNAL_HEADER_SIZE bytes of the journal
+ */
+struct JournalHeader {
+    /** zjournal + null terminator = 9 */
+    char signature[9];
+    /** Sequence number of the first transaction after the header (older transactions are ignored) */
+    uint64_t sequence;
+};
+
+/**
+ * Header of one transaction of the journal (changes made by one command), followed by its blocks
+ * The record of a staged transaction has the same header, its blocks say where the parts of the transaction are (they
+ * are followed by no data)
+ */
+struct JournalTransaction {
+    /** JOURNAL_TRANSACTION_MAGIC (or JOURNAL_STAGED_MAGIC for the record of a staged transaction) */
+    uint32_t magic;
+    /** Number of the blocks of the transaction */
+    uint32_t block_count;
+    /** Sequence number of the transaction */
+    uint64_t sequence;
+    /** Size of the whole transaction (with this header) in bytes */
+    uint64_t size;
+    /** Checksum of the whole transaction (computed with this field set to zero) */
+    uint64_t checksum;
+};
+
+/**
+ * Header of one block of a journal transaction, followed by the data of the block
+ */
+struct JournalBlock {
+    /** Offset the data is written to in bytes */
+    uint64_t address;
+    /** Size of the data in bytes */
+    uint64_t size;
+};
+
+/**
+ * Options given to the file system when it is opened (mounted)
+ */
+struct MountOptions {
+    /** Type of the block device to store the file system on ("stream", "pread" or "mmap") */
+    std::string device_type = "stream";
+    /** Give the space of the freed clusters back to the host file system (punch holes into the image) */
+    bool discard = false;
+    /** Size of the cluster cache in bytes (0 disables the cache) */
+    uint64_t cache_size = DEFAULT_CACHE_SIZE;
+    /** Check the file system and repair it when it is opened */
+    bool check = false;
+};
+
+/**
+ * Session of one client of the command server
+ * Every client has its own working directory and output, the file system itself is shared by all of them
+ */
+struct Session {
+    /** Working directory of the session (the root directory if the path is empty) */
+    WorkingDirectory working_directory;
+    /** Output of the commands not yet sent to the client (the standard and the error output together) */
+    std::ostringstream output;
+    /** True if the commands of the session changed the file system since the last journal commit */
+    bool uncommitted = false;
 };
 
 /**
@@ -107,10 +439,18 @@ private:
     typedef std::map<std::string, command> command_map;
     /** Map of command functions */
     command_map commands;
+    /** Commands that don't change the file system (the sessions of the server run them at the same time) */
+    std::unordered_set<std::string> read_only_commands;
+    /** Smallest number of the arguments of each command (the command itself included) */
+    std::unordered_map<std::string, size_t> required_arguments;
     /** File system file */
     std::string file_system_filepath;
-    /** File system stream */
-    std::fstream file_system;
+    /** Block device the file system is stored on */
+    std::unique_ptr<BlockDevice> device;
+    /** Options the file system was opened with */
+    MountOptions options;
+    /** Cache of the data clusters in front of the block device */
+    std::unique_ptr<ClusterCache> cache;
     /** Meta data for the file system */
     struct MetaData meta_data;
     /** Working directory */
@@ -119,6 +459,69 @@ private:
     struct WorkingDirectory ROOT_DIRECTORY;
     /** String representing empty cluster (zeroes) */
     std::string EMPTY_CLUSTER;
+    /** In-memory copy of the FAT table (loaded on open and after format), the index of the next cluster of each
+     * cluster (or FAT_FREE, FAT_EOF, FAT_BAD) whatever the layout on the disk is */
+    std::vector<uint32_t> fat_table;
+    /** Scanner of the whole FAT table (using the vector instructions the processor supports) */
+    std::unique_ptr<FatScanner> fat_scanner;
+    /** Size of one FAT entry on the disk in bytes (depends on the layout version) */
+    uint32_t fat_entry_size;
+    /** Size of one directory entry on the disk in bytes (depends on the layout version) */
+    uint32_t directory_entry_size;
+    /** Flags of the FAT entries that were changed in memory but not yet written to the disk */
+    std::vector<bool> fat_dirty;
+    /** Lowest index of a dirty FAT entry */
+    uint32_t fat_dirty_low;
+    /** Highest index of a dirty FAT entry (dirty range is empty if lower than fat_dirty_low) */
+    uint32_t fat_dirty_high;
+    /** Bitmap of free clusters (bit set = cluster is free), 64 clusters per word */
+    std::vector<uint64_t> free_bitmap;
+    /** Cluster where the search for the next free cluster starts */
+    uint32_t next_free_hint;
+    /** Number of free clusters */
+    uint32_t free_cluster_count;
+    /** Extra references of each cluster (0 = the cluster belongs to one file only), empty if there is no table */
+    std::vector<uint16_t> cluster_refs;
+    /** Clusters of the reference count table in the order of its FAT chain */
+    std::vector<uint32_t> refcount_clusters;
+    /** Lowest cluster with a changed reference count */
+    uint32_t refs_dirty_low;
+    /** Highest cluster with a changed reference count (dirty range is empty if lower than refs_dirty_low) */
+    uint32_t refs_dirty_high;
+    /** Snapshots of the file system (the catalog loaded from its hidden FAT chain) */
+    std::vector<SnapshotInfo> snapshots;
+    /** Offset in the journal (after its header) where the next transactions are written */
+    uint64_t journal_head;
+    /** Sequence number of the next transaction */
+    uint64_t journal_sequence;
+    /** Transactions of the last commands that are not in the journal yet */
+    std::vector<char> journal_group;
+    /** Number of the transactions in journal_group */
+    uint32_t journal_group_size;
+    /** Flags of the FAT entries changed by the current command */
+    std::vector<bool> journal_fat_dirty;
+    /** Lowest index of a FAT entry changed by the current command */
+    uint32_t journal_fat_low;
+    /** Highest index of a FAT entry changed by the current command (empty range if lower than journal_fat_low) */
+    uint32_t journal_fat_high;
+    /** Cluster addresses of the metadata clusters changed by the current command */
+    std::set<uint64_t> journal_clusters;
+    /** True if the meta data was changed by the current command */
+    bool journal_meta_dirty;
+    /** Clusters freed since the last commit (they can't be reused until the frees are in the journal) */
+    std::vector<uint32_t> journal_freed;
+    /** Metadata clusters with their data in the journal (the journal is emptied before any of them is reused) */
+    std::unordered_set<uint32_t> journal_logged;
+    /** Indexes of the directories that were already read, by the cluster address of the directory */
+    std::unordered_map<uint64_t, DirectoryIndex> directory_indexes;
+    /** Cluster addresses of the already resolved directories by their normalized path */
+    std::unordered_map<std::string, uint64_t> path_cache;
+    /** Lock of the file system taken by the sessions of the server (shared by the read-only commands, exclusive
+     * for the others) */
+    std::shared_mutex fs_lock;
+    /** Lock of the in-memory state the read-only commands fill on the way (cluster cache, directory indexes and
+     * path cache), so the commands can run at the same time */
+    std::recursive_mutex cache_lock;
 
     /**
      * Initializes the command map
@@ -127,26 +530,112 @@ private:
      */
     void initialize_command_map();
 
+    /**
+     * Checks if the command got all the arguments it needs, prints an error if it didn't
+     * @param cmd String of the command
+     * @param args Arguments of the command (the command itself included)
+     * @return True if the command can be executed, false otherwise
+     */
+    bool has_required_arguments(const std::string &cmd, const std::vector<std::string> &args) const;
+
+    /**
+     * Gets the working directory of the session the command runs in (the one of the shell if there is no session)
+     * @return Working directory
+     */
+    WorkingDirectory &current_directory();
+
+    /**
+     * Gets the working directory of the session the command runs in (the one of the shell if there is no session)
+     * @return Working directory
+     */
+    const WorkingDirectory &current_directory() const;
+
+    /**
+     * Gets the stream the command prints its output to (the session output or the standard output)
+     * @return Output stream
+     */
+    static std::ostream &output();
+
+    /**
+     * Gets the stream the command prints its errors to (the session output or the standard error output)
+     * @return Error output stream
+     */
+    static std::ostream &errors();
+
     /**
      * Transforms FAT cluster index to cluster address offset in bytes in the file system
      * @param cluster_index Index of the cluster in the FAT table (cluster index)
      * @return Offset of the cluster in bytes (cluster address)
      */
-    uint32_t get_cluster_address(uint32_t cluster_index) const;
+    uint64_t get_cluster_address(uint64_t cluster_index) const;
 
     /**
      * Transforms cluster address offset in bytes in the file system to FAT cluster index
      * @param cluster_address Offset of the cluster in bytes (cluster address)
      * @return Index of the cluster in the FAT table (cluster index)
      */
-    uint32_t get_cluster_index(uint32_t cluster_address) const;
+    uint64_t get_cluster_index(uint64_t cluster_address) const;
 
     /**
-    * Gets the first free cluster_address address in the FAT table
-    * @return Index of the first free cluster_address (or 0 if there are no free clusters)
+    * Gets the next free cluster in the FAT table (searching from the last allocated one)
+    * @return Index of the free cluster (or 0 if there are no free clusters)
     */
     uint32_t find_free_cluster();
 
+    /**
+     * Builds the free clusters bitmap and the free clusters count from the in-memory FAT table
+     */
+    void build_free_bitmap();
+
+    /**
+     * Updates the free clusters bitmap after a FAT entry change
+     * @param entry Position of the entry in the in-memory FAT table
+     * @param old_value Previous value of the entry
+     * @param new_value New value of the entry
+     */
+    void update_free_bitmap(uint32_t entry, uint32_t old_value, uint32_t new_value);
+
+    /**
+     * Gets all runs of consecutive free clusters
+     * @return Vector of the free runs ordered by their start
+     */
+    std::vector<Extent> find_free_runs() const;
+
+    /**
+     * Allocates the given number of clusters as the fewest possible runs of consecutive clusters
+     * The smallest free run that fits all the clusters is used, otherwise the largest runs are used first
+     * Allocated clusters are chained in the FAT table (in the order of the returned extents)
+     * @param count Number of clusters to allocate
+     * @param extents Vector of the allocated extents to be returned
+     * @param contiguous If true, the allocation fails unless all the clusters fit into one run
+     * @return True if the clusters were allocated, false otherwise
+     */
+    bool allocate_clusters(uint32_t count, std::vector<Extent> &extents, bool contiguous = false);
+
+    /**
+     * Releases the data of the clusters that were freed
+     * The data is overwritten with zeroes if secure is set and holes are punched if the discard option is set
+     * @param extents Extents of the freed clusters
+     * @param secure If true, the data is overwritten with zeroes
+     */
+    void release_clusters(const std::vector<Extent> &extents, bool secure);
+
+    /**
+     * Frees the clusters allocated by a command that failed afterwards (nothing points to them yet)
+     * @param extents Extents of the allocated clusters
+     */
+    void free_allocated_clusters(const std::vector<Extent> &extents);
+
+    /**
+     * Checks if there is enough free clusters for a file of the given size
+     * Prints the NO SPACE error message if there is not
+     * @param size Size of the file in bytes
+     * @param directory Cluster address of the directory the file goes to (a full directory needs one more cluster to
+     *                  grow), 0 if the entry isn't counted
+     * @return True if the file fits into the free clusters, false otherwise
+     */
+    bool has_space_for(uint64_t size, uint64_t directory = 0);
+
     /**
      * Reads the data from the cluster
      * @param cluster_address Address of the cluster in bytes
@@ -154,7 +643,7 @@ private:
      * @param size Size of the data to read in bytes
      * @return Data read from the cluster
      */
-    void read_from_cluster(uint32_t cluster_address, char *buffer, int size);
+    void read_from_cluster(uint64_t cluster_address, char *buffer, size_t size);
 
     /**
      * Writes the data to the cluster
@@ -163,57 +652,443 @@ private:
      * @param data Data to write to the cluster
      * @param size Size of the data in bytes
      */
-    void write_to_cluster(uint32_t cluster_address, char *buffer, int size);
+    void write_to_cluster(uint64_t cluster_address, char *buffer, size_t size);
+
+    /**
+     * Writes the data within one metadata cluster (directory, reference count table or snapshot chain)
+     * With the journal, the cluster stays in the cache until the change is committed
+     * @param address Address of the data in bytes
+     * @param buffer Buffer with data to be written
+     * @param size Size of the data in bytes
+     */
+    void write_metadata(uint64_t address, char *buffer, size_t size);
+
+    /**
+     * Gets the data of the whole cluster of a file (or directory) through the cluster cache
+     * On a miss, the next clusters of the FAT chain are read ahead
+     * Has to be called with cache_lock held (until the data is used)
+     * @param cluster_address Address of the cluster in bytes
+     * @return Pointer to the data (valid until the next read or write)
+     */
+    const char *view_file_cluster(uint64_t cluster_address);
+
+    /**
+     * Gets the data range of the image without copying it, if the block device can give a view of it (mmap)
+     * The cached data of the range is written first
+     * @param address Address of the data in bytes
+     * @param size Size of the data in bytes
+     * @return Pointer to the data, or nullptr if the block device can't give a view of the data
+     */
+    const char *view_data(uint64_t address, size_t size);
+
+    /**
+     * Reads and writes the batch of data ranges around the cluster cache with all of them in flight at once
+     * The cached data of the ranges is written before they are read and thrown away after they are written
+     * @param requests Requests to be executed (they must not overlap)
+     */
+    void submit_cluster_io(const std::vector<IoRequest> &requests);
+
+    /**
+     * Copies the data of the runs of clusters within the image (copy_file_range or the mapping), or through one
+     * reusable buffer in big batches if the block device can't copy by itself
+     * The cached data of the sources is written first, the cached data of the destinations is thrown away
+     * Prints the NO MEMORY error message if the buffer couldn't be allocated
+     * @param copies Copies to be executed (the sources and destinations must not overlap)
+     * @return True if all the data was copied, false otherwise
+     */
+    bool copy_clusters(const std::vector<ClusterCopy> &copies);
 
     /**
      * Reads the value from the FAT table
      * @param cluster_index Index of the cluster in the FAT table
-     * @return Value of the cluster in the FAT table
+     * @return Cluster address of the next cluster (or FAT_FREE, FAT_EOF, FAT_BAD)
      */
-    uint32_t read_from_fat(uint32_t cluster_index);
+    uint64_t read_from_fat(uint64_t cluster_index);
 
     /**
      * Writes the value to the FAT table at the given index
      * @param cluster_index Index of the cluster in the FAT table
-     * @param value Value to write to the FAT table
+     * @param value Cluster address of the next cluster (or FAT_FREE, FAT_EOF, FAT_BAD)
+     */
+    void write_to_fat(uint64_t cluster_index, uint64_t value);
+
+    /**
+     * Writes the value to the in-memory FAT table and remembers the change
+     * @param entry Position of the entry in the in-memory FAT table (number of the cluster)
+     * @param value Number of the next cluster (or FAT_FREE, FAT_EOF, FAT_BAD)
+     */
+    void set_fat_entry(uint32_t entry, uint32_t value);
+
+    /**
+     * Transforms the cluster address to the value of the in-memory FAT table
+     * @param cluster_address Cluster address (or FAT_FREE, FAT_EOF, FAT_BAD)
+     * @return Number of the cluster (cluster count if the address isn't one of a cluster), special values are kept
+     */
+    uint32_t get_fat_value(uint64_t cluster_address) const;
+
+    /**
+     * Transforms the value of the in-memory FAT table to the cluster address
+     * @param value Number of the cluster (or FAT_FREE, FAT_EOF, FAT_BAD)
+     * @return Cluster address, special values are kept (as 64-bit values)
+     */
+    uint64_t get_value_address(uint32_t value) const;
+
+    /**
+     * Transforms the run of the FAT entries to their on-disk form (given by the layout version)
+     * @param first Position of the first entry in the in-memory FAT table
+     * @param count Number of the entries
+     * @param data Buffer to be filled with the on-disk form (resized to fit it)
      */
-    void write_to_fat(uint32_t cluster_index, uint32_t value);
+    void encode_fat_entries(uint32_t first, uint32_t count, std::vector<char> &data) const;
+
+    /**
+     * Transforms the number of the cluster to its cluster address offset in bytes in the file system
+     * @param cluster Number of the cluster (position in the FAT table)
+     * @return Offset of the cluster in bytes (cluster address)
+     */
+    uint64_t get_data_address(uint32_t cluster) const;
+
+    /**
+     * Transforms the number of the cluster to the offset of its FAT entry in bytes in the file system
+     * @param cluster Number of the cluster (position in the FAT table)
+     * @return Offset of the FAT entry in bytes (cluster index)
+     */
+    uint64_t get_fat_index(uint32_t cluster) const;
+
+    /**
+     * Transforms FAT cluster index (offset of the FAT entry in bytes) to the position in the in-memory FAT table
+     * @param cluster_index Index of the cluster in the FAT table (cluster index)
+     * @return Position of the entry in the in-memory FAT table
+     */
+    uint32_t get_fat_entry(uint64_t cluster_index) const;
+
+    /**
+     * Reads the meta data from the disk (both the original and the versioned layout)
+     * @return True if the meta data has a known signature, false otherwise
+     */
+    bool read_meta_data();
+
+    /**
+     * Writes the meta data to the disk in the layout given by its version
+     * With the journal, the meta data is written with the transaction of the current command
+     */
+    void write_meta_data();
+
+    /**
+     * Checks if the file system has a journal
+     * @return True if the metadata changes go through the journal, false otherwise
+     */
+    bool has_journal() const;
+
+    /**
+     * Computes the checksum of the data (64-bit FNV-1a)
+     * @param data Data
+     * @param size Size of the data in bytes
+     * @return Checksum of the data
+     */
+    static uint64_t compute_checksum(const char *data, size_t size);
+
+    /**
+     * Replays the valid transactions of the journal (left by a crash) to their places, called before the FAT is loaded
+     * @return True if any transaction was replayed (the meta data has to be read again), false otherwise
+     */
+    bool replay_journal();
+
+    /**
+     * Writes the blocks of the transactions to their places
+     * @param data Transactions
+     * @param size Size of the transactions in bytes
+     */
+    void apply_journal_transactions(const char *data, uint64_t size);
+
+    /**
+     * Reads the transaction staged outside of the journal
+     * @param record Record of the staged transaction (its checksum is already verified)
+     * @param transaction Read transaction
+     * @return True if the staged transaction was written whole (it can be replayed), false otherwise
+     */
+    bool read_staged_transaction(const char *record, std::vector<char> &transaction);
+
+    /**
+     * Plans where the transaction too big for the journal is staged (the free runs it is split into)
+     * @param size Size of the transaction in bytes
+     * @param record Record of the staged transaction without its header (the space for it is left at the start)
+     * @return True if there is enough free space to stage the transaction, false otherwise
+     */
+    bool plan_staging(uint64_t size, std::vector<char> &record) const;
+
+    /**
+     * Stages the transaction too big for the journal in the free clusters and commits it with a record in the journal
+     * The journal has to be empty, the transaction is written to its place by the caller
+     * @param transaction Transaction
+     * @return True if the transaction is committed, false if there is not enough free space to stage it
+     */
+    bool stage_transaction(const std::vector<char> &transaction);
+
+    /**
+     * Builds the transaction of the changes made by the current command (FAT entries, metadata clusters, meta data)
+     * @return Transaction, or an empty vector if nothing was changed
+     */
+    std::vector<char> build_transaction();
+
+    /**
+     * Ends the transaction of the current command, it is added to the group of transactions waiting for the commit
+     * Without the journal, all the changes are written to the disk right away
+     */
+    void commit_transaction();
+
+    /**
+     * Writes the group of transactions to the journal with one sync and then to their places
+     */
+    void write_journal_group();
+
+    /**
+     * Empties the journal, all the changes written to their places are made durable first
+     */
+    void reset_journal();
+
+    /**
+     * Transforms the directory entry from its on-disk form (given by the layout version)
+     * @param data Directory entry as stored on the disk
+     * @return Directory entry
+     */
+    DirectoryEntry decode_directory_entry(const char *data) const;
+
+    /**
+     * Transforms the directory entry to its on-disk form (given by the layout version)
+     * @param entry Directory entry
+     * @param data Buffer (of directory_entry_size bytes) to be filled with the on-disk form
+     */
+    void encode_directory_entry(const DirectoryEntry &entry, char *data) const;
+
+    /**
+     * Parses the size given by the user (KB, MB and GB suffixes are supported)
+     * @param text Size given by the user (examples: 1024, 10KB, 200MB, 2GB...)
+     * @return Size in bytes
+     */
+    static uint64_t parse_size(const std::string &text);
+
+    /**
+     * Loads the whole FAT table from the disk to the memory
+     * Entries that are not backed by the FAT on the disk are marked as bad
+     */
+    void load_fat();
+
+    /**
+     * Writes all the dirty FAT entries to the disk
+     * Dirty entries close to each other are coalesced into one write
+     */
+    void flush_fat();
+
+    /**
+     * Loads the reference count table from its hidden FAT chain (if the file system has one)
+     */
+    void load_refcounts();
+
+    /**
+     * Writes the changed part of the reference count table to its clusters
+     */
+    void flush_refcounts();
+
+    /**
+     * Marks the reference counts of the clusters as changed
+     * @param first First changed cluster
+     * @param last Last changed cluster
+     */
+    void mark_refcounts_dirty(uint32_t first, uint32_t last);
+
+    /**
+     * Creates the reference count table (all the counts are zero) in a hidden FAT chain
+     * The chain is referenced from the meta data, not from any directory
+     * @return True if the table exists, false if there is no space for it or the layout doesn't support it
+     */
+    bool create_refcount_table();
+
+    /**
+     * Adds a reference to every cluster of the extents (the clusters become shared by one more file)
+     * @param extents Extents of the shared file
+     * @return True if the references were added, false otherwise (nothing is changed)
+     */
+    bool share_clusters(const std::vector<Extent> &extents);
+
+    /**
+     * Drops a reference to every cluster of the extents
+     * @param extents Extents of the file that doesn't use the clusters anymore
+     * @return Extents of the clusters that aren't used by any file anymore (to be freed)
+     */
+    std::vector<Extent> drop_cluster_references(const std::vector<Extent> &extents);
+
+    /**
+     * Writes the data to a new hidden FAT chain (referenced from the meta data or a snapshot, not from any directory)
+     * @param data Data to be written
+     * @return Cluster address of the first cluster of the chain, or 0 if there is no space for it
+     */
+    uint64_t write_system_chain(const std::vector<char> &data);
+
+    /**
+     * Reads the data of a hidden FAT chain
+     * @param cluster_address Cluster address of the first cluster of the chain
+     * @param size Size of the data in bytes
+     * @return Data of the chain
+     */
+    std::vector<char> read_system_chain(uint64_t cluster_address, uint64_t size);
+
+    /**
+     * Frees all the clusters of a hidden FAT chain
+     * @param cluster_address Cluster address of the first cluster of the chain
+     */
+    void free_system_chain(uint64_t cluster_address);
+
+    /**
+     * Loads the snapshot catalog from its hidden FAT chain (if the file system has one)
+     */
+    void load_snapshots();
+
+    /**
+     * Writes the snapshot catalog to a new hidden FAT chain (the old one is freed) and points the meta data to it
+     * @return True if the catalog was written, false if there is no space for it
+     */
+    bool write_snapshot_catalog();
+
+    /**
+     * Finds the snapshot with the given name
+     * @param name Name of the snapshot
+     * @return Index of the snapshot in the catalog, or the number of the snapshots if there is none
+     */
+    size_t find_snapshot(const std::string &name) const;
+
+    /**
+     * Creates the snapshot of the whole directory tree, the data is shared with the snapshot (copy-on-write)
+     * Only the FAT entries and the directory clusters are saved
+     * @param name Name of the snapshot
+     * @return True if the snapshot was created, false otherwise
+     */
+    bool create_snapshot(const std::string &name);
+
+    /**
+     * Replaces the whole directory tree with the tree saved in the snapshot (the snapshot is kept)
+     * @param name Name of the snapshot
+     * @return True if the snapshot was restored, false otherwise
+     */
+    bool restore_snapshot(const std::string &name);
+
+    /**
+     * Deletes the snapshot, the clusters not used by anything else are freed
+     * @param name Name of the snapshot
+     * @return True if the snapshot was deleted, false otherwise
+     */
+    bool delete_snapshot(const std::string &name);
+
+    /**
+     * Gets the index of the directory, the directory cluster is read and indexed on the first use
+     * @param cluster_address Cluster address of the directory
+     * @return Index of the directory
+     */
+    DirectoryIndex &get_directory_index(uint64_t cluster_address);
+
+    /**
+     * Gets the address of the slot of the directory entry on the disk
+     * @param index Index of the directory
+     * @param slot Slot of the directory entry
+     * @return Address of the slot in bytes
+     */
+    uint64_t get_slot_address(const DirectoryIndex &index, uint32_t slot) const;
+
+    /**
+     * Makes sure the directory has an empty slot, the directory grows by one cluster if it is full
+     * Prints the NO SPACE error message if the directory couldn't grow
+     * @param cluster_address Cluster address of the directory
+     * @return True if the directory has an empty slot, false otherwise
+     */
+    bool reserve_directory_slot(uint64_t cluster_address);
 
     /**
      * Gets the directory entries of a directory given by it's cluster_address index
      * @param cluster Cluster index of the directory
      * @return Vector of directory entries
      */
-    std::vector<DirectoryEntry> get_directory_entries(uint32_t cluster);
+    std::vector<DirectoryEntry> get_directory_entries(uint64_t cluster);
 
     /**
      * Writes the DirectoryEntry to the given cluster_address (directory)
+     * The directory grows by one cluster if it is full
      * @param cluster_address Cluster address of the directory
      * @param entry Entry to be written
+     * @return True if the entry was written, false if there is no space for it
      */
-    void write_directory_entry(uint32_t cluster_address, const DirectoryEntry &entry);
+    bool write_directory_entry(uint64_t cluster_address, const DirectoryEntry &entry);
 
     /**
      * Removes the DirectoryEntry from the given cluster_address (directory)
+     * The last entry of the directory is moved to the freed slot to keep the directory dense,
+     * the last cluster of the directory is freed once it is empty
      * @param cluster_address Cluster address of the directory
-     * @param entry Entry to be removed
+     * @param entry Entry to be removed (found by its name)
      */
-    void remove_directory_entry(uint32_t cluster_address, const DirectoryEntry &entry);
+    void remove_directory_entry(uint64_t cluster_address, const DirectoryEntry &entry);
 
     /**
-     * Checks if the entry given by the name exists in the current working directory
+     * Checks if the entry given by the name exists in the given directory
+     * @param directory Cluster address of the directory
      * @param name Name of the entry
      * @param entry Entry to be found
      * @return True if the entry exists, false otherwise
      */
-    bool does_entry_exist(const std::string &name, DirectoryEntry &entry);
+    bool does_entry_exist(uint64_t directory, const std::string &name, DirectoryEntry &entry);
 
     /**
-     * Changes current working directory to the given entry within the current working directory
-     * @param dir_name Name of the directory to change to (not a path)
-     * @return True if the directory was changed, false otherwise
+     * Overwrites the DirectoryEntry with the same name in the given cluster_address (directory) in place
+     * @param cluster_address Cluster address of the directory
+     * @param entry New content of the entry (found by its name)
+     */
+    void update_directory_entry(uint64_t cluster_address, const DirectoryEntry &entry);
+
+    /**
+     * Overwrites the DirectoryEntry given by its old name in the given cluster_address (directory) in place
+     * @param cluster_address Cluster address of the directory
+     * @param name Old name of the entry
+     * @param entry New content of the entry (with the new name)
+     */
+    void rename_directory_entry(uint64_t cluster_address, const std::string &name, const DirectoryEntry &entry);
+
+    /**
+     * Transforms the path to the absolute path without ".", ".." and empty components
+     * Relative paths are taken from the current working directory
+     * @param path Path to be normalized
+     * @return Normalized path starting and ending with "/" (example: "/dir/subdir/")
+     */
+    std::string normalize_path(const std::string &path) const;
+
+    /**
+     * Finds the directory given by the normalized path, resolved directories are remembered in the path cache
+     * @param path Normalized path of the directory
+     * @param cluster_address Cluster address of the directory to be returned
+     * @return True if the directory exists, false otherwise
      */
-    bool change_directory(const std::string &dir_name);
+    bool find_directory(const std::string &path, uint64_t &cluster_address);
+
+    /**
+     * Resolves the path to the directory it leads to and the entry given by its last component
+     * Nothing is changed (the working directory stays the same), prints PATH NOT FOUND if the directory doesn't exist
+     * @param path Absolute or relative path
+     * @param handle Handle of the resolved path to be returned (the entry may not exist)
+     * @return True if the directory of the path exists, false otherwise
+     */
+    bool resolve_path(const std::string &path, PathHandle &handle);
+
+    /**
+     * Forgets the cached directory given by the normalized path and all the directories under it
+     * Has to be called whenever a directory is removed or moved
+     * @param path Normalized path of the directory
+     */
+    void invalidate_path_cache(const std::string &path);
+
+    /**
+     * Gets the runs of physically consecutive clusters of the file by walking its FAT chain
+     * @param entry File entry to be walked
+     * @return Vector of the extents in the order of the file data
+     */
+    std::vector<Extent> get_file_extents(const DirectoryEntry &entry);
 
     /**
      * Checks if the given file is defragmented
@@ -223,6 +1098,54 @@ private:
      */
     bool is_file_defragmented(const DirectoryEntry &entry, std::vector<uint32_t> &clusters);
 
+    /**
+     * Gets all the files and directories of the file system with their clusters
+     * @return Directories (breadth first from the root) followed by the files grouped by their directories
+     */
+    std::vector<LayoutItem> collect_layout_items();
+
+    /**
+     * Prints the fragmentation of the file system
+     * @param label Label of the printed line
+     * @param items Files and directories of the file system
+     */
+    void print_fragmentation(const std::string &label, const std::vector<LayoutItem> &items) const;
+
+    /**
+     * Copies the data of the clusters, the destinations have to be free (the sources stay untouched until the new
+     * places are committed)
+     * @param moves Moves to be executed (sorted by their destinations)
+     */
+    void execute_moves(std::vector<ClusterMove> &moves);
+
+    /**
+     * Defragments the whole file system - the directories are moved to the start of the data, followed by the
+     * files of each directory, every file and directory ends up in consecutive clusters
+     * The clusters are moved in passes committed one by one, the clusters in the places of each other need at least
+     * one free cluster
+     * @return True if the defragmentation was successful, false otherwise
+     */
+    bool defrag_all();
+
+    /**
+     * Checks the whole file system - every FAT chain of the directory tree, the snapshots and the reference count
+     * table is walked once, the clusters they reach are counted, one pass over the FAT then finds the leaked,
+     * cross-linked and wrongly counted clusters
+     * Broken chains are cut, entries pointing to free clusters are removed and leaked clusters are freed if repair
+     * is set
+     * @param repair If true, the problems are repaired, otherwise they are only reported
+     * @return True if no problems were found (or all of them were repaired), false otherwise
+     */
+    bool check_file_system(bool repair);
+
+    /**
+     * Upgrades the file system in the layout version 2 to the current layout in place - the FAT entries become
+     * 32-bit cluster indices (at the start of the old FAT), the directory entries (also the ones saved by the
+     * snapshots) point to the cluster indices, the data stays where it is
+     * @return True if the file system was upgraded, false otherwise
+     */
+    bool upgrade_layout();
+
     /**
      * Help function to list all commands
      * Callable by using the 'help' command
@@ -249,8 +1172,9 @@ private:
 
     /**
      * Copy function copies a file from the <src> to the <dst>
-     * Callable by using the 'copy' command with the <src> and <dst> arguments
-     * @param args <src> and <dst> filepaths to copy from and to are expected
+     * With '--reflink' the copy shares the clusters of the <src> (copy-on-write), no data is copied
+     * Callable by using the 'copy' command with the (optional '--reflink') <src> and <dst> arguments
+     * @param args (optional '--reflink') <src> and <dst> filepaths to copy from and to are expected
      * @return True if the copy was successful, false otherwise
      */
     bool cp(const std::vector<std::string> &args);
@@ -265,8 +1189,9 @@ private:
 
     /**
      * Remove function removes a file from the file system
-     * Callable by using the 'remove' command with the <filepath> argument
-     * @param args <filepath> to be removed is expected
+     * Only the FAT and the directory entry are changed, the data is overwritten only with the --secure flag
+     * Callable by using the 'remove' command with the optional [--secure] flag and the <filepath> argument
+     * @param args [--secure] flag and <filepath> to be removed is expected
      * @return True if the remove was successful, false otherwise
      */
     bool rm(const std::vector<std::string> &args);
@@ -356,17 +1281,68 @@ private:
 
     /**
      * Format function formats the file system to the given size <size> in bytes
-     * Callable by using the 'format' command with the <size> argument
+     * Callable by using the 'format' command with the <size> and optional [cluster_size] [--full] arguments
      * @param args <size> of the file system is expected (KB, MB and GB are supported)
      *            (examples: 1024, 10KB, 200MB, 2GB...)
+     *            [cluster_size] is a power of two from 512 to 1MB (default 1KB)
+     *            [--full] writes zeroes to all the data clusters (otherwise the file is only resized sparsely)
      * @return True if the format was successful, false otherwise
      */
     bool format(const std::vector<std::string> &args);
 
     /**
-     * Defragmentation function defragments the given file <filepath>
-     * Callable by using the 'defrag' command with the <filepath> argument
-     * @param args <filepath> to be defragmented is expected
+     * Sync function writes all the cached changes (data clusters and FAT table) to the disk
+     * Callable by using the 'sync' command
+     * @param args This function takes no arguments (only for genericity)
+     * @return Always returns true (only for genericity)
+     */
+    bool sync(const std::vector<std::string> &args);
+
+    /**
+     * Cache function prints the statistics of the cluster cache
+     * Callable by using the 'cache' command
+     * @param args This function takes no arguments (only for genericity)
+     * @return Always returns true (only for genericity)
+     */
+    bool cache_stats(const std::vector<std::string> &args);
+
+    /**
+     * Fragmentation function prints the fragmentation report of the whole file system
+     * Callable by using the 'fragstat' command
+     * @param args This function takes no arguments (only for genericity)
+     * @return Always returns true (only for genericity)
+     */
+    bool fragstat(const std::vector<std::string> &args);
+
+    /**
+     * Snapshot function creates, lists, restores or deletes the snapshots of the whole file system
+     * Callable by using the 'snapshot' command with the 'create', 'restore' or 'delete' and <name> arguments,
+     * or with the 'list' argument
+     * @param args 'create' / 'restore' / 'delete' and <name> of the snapshot, or 'list' is expected
+     * @return True if the snapshot command was successful, false otherwise
+     */
+    bool snapshot(const std::vector<std::string> &args);
+
+    /**
+     * File system check function checks the consistency of the whole file system (and repairs it with '--repair')
+     * Callable by using the 'fsck' command with the optional '--repair' argument
+     * @param args Optional '--repair' is expected
+     * @return True if the file system is consistent (or was repaired), false otherwise
+     */
+    bool fsck(const std::vector<std::string> &args);
+
+    /**
+     * Upgrade function converts the file system to the current layout version in place
+     * Callable by using the 'upgrade' command
+     * @param args No arguments are expected
+     * @return True if the file system was upgraded, false otherwise
+     */
+    bool upgrade(const std::vector<std::string> &args);
+
+    /**
+     * Defragmentation function defragments the given file <filepath> (or the whole file system with '-a')
+     * Callable by using the 'defrag' command with the <filepath> or '-a' argument
+     * @param args <filepath> to be defragmented or '-a' is expected
      * @return True if the defragmentation was successful, false otherwise
      */
     bool defrag(const std::vector<std::string> &args);
@@ -375,8 +1351,9 @@ public:
     /**
      * Constructor
      * @param filepath Filepath of the file system file
+     * @param options Options the file system is opened with
      */
-    explicit PseudoFS(const std::string &filepath);
+    explicit PseudoFS(const std::string &filepath, const MountOptions &options = {});
 
     /**
      * Destructor
@@ -390,9 +1367,38 @@ public:
      */
     void call_cmd(const std::string &cmd, const std::vector<std::string> &args);
 
+    /**
+     * Commits the transactions of the last commands to the journal with one sync (group commit)
+     * Has to be called between the commands, the shell calls it when it waits for the input
+     */
+    void commit_journal();
+
+    /**
+     * Calls the command in the session of a client of the server (takes the lock of the file system)
+     * The read-only commands of the sessions run at the same time, the other commands one at a time
+     * @param session Session of the client (its working directory is checked first, another session could remove it)
+     * @param cmd String of the command to be executed
+     * @param args Arguments of the command to be executed
+     */
+    void call_cmd(Session &session, const std::string &cmd, const std::vector<std::string> &args);
+
+    /**
+     * Commits the journal if the commands of the session changed the file system since the last commit
+     * The server calls it when the client waits for the input (the commits of the clients are grouped too)
+     * @param session Session of the client
+     */
+    void commit_journal(Session &session);
+
     /**
      * Getter for the current directory of the file system
      * @return Current directory of the file system
      */
     std::string get_working_directory_path() const;
+
+    /**
+     * Getter for the current directory of the session of a client of the server
+     * @param session Session of the client
+     * @return Current directory of the session
+     */
+    std::string get_working_directory_path(const Session &session);
 };